@@ -0,0 +1,215 @@
+/*
+
+  Throughput benchmarks for a mounted MyFS.
+
+  gcc -O2 -Wall -pthread bench.c -o bench
+  ./bench <directory inside the mount> [max threads] [seconds] [read|stat]
+
+  read: every thread gets a file of its own and reads it sequentially
+  over and over with pread. The combined throughput is printed in MB/s.
+
+  stat: a tree of BENCH_DIRS directories with BENCH_FILES files each is
+  created, and every thread stats random files of it, like ls -l or
+  find do. The combined rate is printed in stats per second.
+
+  The run is repeated with 1, 2, 4, ... up to max threads (8 for read
+  and 16 for stat by default), so it shows how the filesystem scales
+  with the number of threads.
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define BENCH_FILE_SIZE ((size_t) (16 << 20))
+#define BENCH_CHUNK ((size_t) (128 << 10))
+#define BENCH_DIRS 16
+#define BENCH_FILES 64
+
+struct reader {
+	pthread_t thread;
+	int fd;
+	const char *dir;
+	unsigned int seed;
+	double seconds;
+	size_t bytes;
+};
+
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void *read_loop(void *arg){
+	struct reader *r = arg;
+	char *buf = malloc(BENCH_CHUNK);
+	double end = now()+r->seconds;
+	off_t off = 0;
+	if(buf==NULL){
+		return NULL;
+	}
+	while(now()<end){
+		ssize_t n = pread(r->fd,buf,BENCH_CHUNK,off);
+		if(n<=0){
+			off = 0;
+			continue;
+		}
+		r->bytes += n;
+		off += n;
+	}
+	free(buf);
+	return NULL;
+}
+
+static void *stat_loop(void *arg){
+	struct reader *r = arg;
+	struct stat st;
+	char path[4096];
+	double end = now()+r->seconds;
+	while(now()<end){
+		int d = rand_r(&r->seed)%BENCH_DIRS;
+		int f = rand_r(&r->seed)%BENCH_FILES;
+		snprintf(path,sizeof(path),"%s/stat/d%d/f%d",r->dir,d,f);
+		if(stat(path,&st)==0){
+			r->bytes++;
+		}
+	}
+	return NULL;
+}
+
+static int make_tree(const char *dir){
+	char path[4096];
+	snprintf(path,sizeof(path),"%s/stat",dir);
+	mkdir(path,0755);
+	for(int d=0;d<BENCH_DIRS;d++){
+		snprintf(path,sizeof(path),"%s/stat/d%d",dir,d);
+		mkdir(path,0755);
+		for(int f=0;f<BENCH_FILES;f++){
+			int fd;
+			snprintf(path,sizeof(path),"%s/stat/d%d/f%d",dir,d,f);
+			fd = open(path,O_CREAT|O_RDWR,0644);
+			if(fd<0){
+				return -1;
+			}
+			close(fd);
+		}
+	}
+	return 0;
+}
+
+static int make_file(const char *path){
+	char *buf;
+	size_t done = 0;
+	int fd = open(path,O_CREAT|O_RDWR,0644);
+	if(fd<0){
+		return -1;
+	}
+	if(lseek(fd,0,SEEK_END)==(off_t) BENCH_FILE_SIZE){
+		return fd;
+	}
+	buf = malloc(BENCH_CHUNK);
+	if(buf==NULL){
+		close(fd);
+		return -1;
+	}
+	memset(buf,'x',BENCH_CHUNK);
+	while(done<BENCH_FILE_SIZE){
+		ssize_t n = pwrite(fd,buf,BENCH_CHUNK,done);
+		if(n<=0){
+			free(buf);
+			close(fd);
+			return -1;
+		}
+		done += n;
+	}
+	free(buf);
+	return fd;
+}
+
+int main(int argc,char** argv){
+	int max_threads = 8;
+	int stat_mode = 0;
+	double seconds = 5;
+	struct reader *readers;
+	char path[4096];
+
+	if(argc<2){
+		printf("usage: %s <directory> [max threads] [seconds] [read|stat]\n",argv[0]);
+		return 1;
+	}
+	if((argc>4)&&(strcmp(argv[4],"stat")==0)){
+		stat_mode = 1;
+		max_threads = 16;
+	}
+	if(argc>2){
+		max_threads = atoi(argv[2]);
+	}
+	if(argc>3){
+		seconds = atof(argv[3]);
+	}
+	if(max_threads<1){
+		max_threads = 1;
+	}
+	readers = calloc(max_threads,sizeof(struct reader));
+	if(readers==NULL){
+		return 1;
+	}
+	if(stat_mode){
+		if(make_tree(argv[1])<0){
+			printf("%s: %s\n",argv[1],strerror(errno));
+			return 1;
+		}
+		for(int i=0;i<max_threads;i++){
+			readers[i].fd = -1;
+			readers[i].dir = argv[1];
+			readers[i].seed = i+1;
+		}
+		printf("threads  stats/s\n");
+	}else{
+		for(int i=0;i<max_threads;i++){
+			snprintf(path,sizeof(path),"%s/bench.%d",argv[1],i);
+			readers[i].fd = make_file(path);
+			if(readers[i].fd<0){
+				printf("%s: %s\n",path,strerror(errno));
+				return 1;
+			}
+		}
+		printf("threads  MB/s\n");
+	}
+	for(int threads=1;threads<=max_threads;){
+		size_t total = 0;
+		for(int i=0;i<threads;i++){
+			readers[i].seconds = seconds;
+			readers[i].bytes = 0;
+			pthread_create(&readers[i].thread,NULL,stat_mode?stat_loop:read_loop,readers+i);
+		}
+		for(int i=0;i<threads;i++){
+			pthread_join(readers[i].thread,NULL);
+			total += readers[i].bytes;
+		}
+		if(stat_mode){
+			printf("%7d  %.0f\n",threads,total/seconds);
+		}else{
+			printf("%7d  %.1f\n",threads,total/seconds/(1<<20));
+		}
+		if((threads<max_threads)&&(threads*2>max_threads)){
+			threads = max_threads;
+		}else{
+			threads *= 2;
+		}
+	}
+	for(int i=0;i<max_threads;i++){
+		if(readers[i].fd>=0){
+			close(readers[i].fd);
+		}
+	}
+	free(readers);
+	return 0;
+}
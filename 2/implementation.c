@@ -24,6 +24,8 @@
 
 */
 
+#define _GNU_SOURCE
+
 #include <stddef.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
@@ -36,7 +38,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 
 /* The filesystem you implement must support all the 13 operations
@@ -233,1150 +238,6202 @@
 
 /* Helper types and functions */
 
-struct __myfs_fat_entry {
-    unsigned short used_size;
-    unsigned short is_used;
-    unsigned int next_block;
-};
-
-#define MYFS_FAT_SIZE sizeof(struct __myfs_fat_entry)
-#define MYFS_HEADER_SIZE (size_t) 8
-#define MYFS_BLOCK_SIZE (size_t) 4096
-#define MYFS_MAX_NAME_SIZE 32
+#define MYFS_MAGIC_SIZE (size_t) 8
+#define MYFS_MAGIC 0x00000005c1f16546
+#define MYFS_VERSION 16
+#define MYFS_MIN_BLOCK_SIZE (size_t) 1024
+#define MYFS_MAX_BLOCK_SIZE (size_t) (1 << 20)
+// Only for an image an operation finds unformatted; mounting takes the block size it is given
+#define MYFS_DEFAULT_BLOCK_SIZE (size_t) 4096
+#define MYFS_BITMAP_WORD_BITS (size_t) 64
+#define MYFS_MAX_NAME_SIZE 60
 #define MYFS_MAX_PATH_LEN 255
+#define MYFS_INLINE_EXTENTS 3
+#define MYFS_MAX_DEPTH 8
+#define MYFS_SEQ_RETRIES 4
+#define MYFS_DCACHE_MAX_SLOTS (size_t) 16384
+#define MYFS_DIR_INDEX_THRESHOLD (size_t) 64
+#define MYFS_DIR_INDEX_MIN_SLOTS (size_t) 256
+#define MYFS_DIR_INDEX_TOMBSTONE UINT32_MAX
+#define MYFS_FRAG_SLOTS (size_t) 16
+#define MYFS_FRAG_MAX (size_t) 3072
+#define MYFS_FRAG_SCAN 8
+#define MYFS_FAT_FRAG 2
+#define MYFS_FAT_FRAG_OFF 3
+#define MYFS_FAT_META 4
+#define MYFS_INODE_RATIO (size_t) 2048
+#define MYFS_INODE_GROUPS 16
+#define MYFS_FAT_SLICES 16
+#define MYFS_ROOT_INODE 1
+#define MYFS_HASH_INIT 14695981039346656037ULL
+#define MYFS_HASH_PRIME 1099511628211ULL
+#define MYFS_JOURNAL_MAGIC 0x6c616e72756f6a6dULL
+#define MYFS_JOURNAL_RATIO (size_t) 64
+#define MYFS_JOURNAL_MIN_BLOCKS (size_t) 64
+#define MYFS_JOURNAL_MAX_BLOCKS (size_t) 8192
+#define MYFS_JOURNAL_BATCH (size_t) 256
+#define MYFS_JOURNAL_UNDO 1
+#define MYFS_JOURNAL_REDO 2
+#define MYFS_JOURNAL_REVOKE 3
+#define MYFS_GROW_HEADER (size_t) 2
+#define MYFS_GROW_FREE (size_t) 8
+#define MYFS_ALLOC_WINDOW (size_t) 256
+#define MYFS_ALLOC_SCAN (size_t) 64
 #define max(x, y) (((x) > (y)) ? (x) : (y))
 #define min(x, y) (((x) < (y)) ? (x) : (y))
 
-size_t __myfs_get_fat_size(void *fsptr, size_t fssize, int *errnoptr) {
-    return (size_t) (fssize - MYFS_HEADER_SIZE ) / ( MYFS_FAT_SIZE + MYFS_BLOCK_SIZE);
-}
+struct __myfs_fat_entry {
+    uint32_t used_size;
+    uint32_t is_used;
+    uint64_t next_block;
+};
 
-struct __myfs_dir_entry {
-    char file_name[MYFS_MAX_NAME_SIZE];
-    enum FileType{DIRECTORY, REG_FILE} file_type;
-    size_t file_block;
+/* A run of length physical blocks, starting at block start, holding
+   the file blocks logical to logical + length - 1.
+
+   In the inner nodes of an extent tree, start is the block of the
+   child node and logical is the first file block the child covers.
+*/
+struct __myfs_extent {
+    uint32_t logical;
+    uint32_t length;
+    uint64_t start;
+};
+
+/* Describes where the data of a file or directory lives.
+
+   Up to MYFS_INLINE_EXTENTS extents are kept in root. When a file
+   gets more fragmented than that, its extents move into a tree of
+   extent nodes, one block each, and root holds the index entries
+   of the top level of the tree (depth > 0).
+
+   tail is the block of the rightmost leaf of the tree, which holds
+   the end of the file, so that appending does not need to descend
+   the tree. It is 0 while the extents fit into root.
+
+   A file of at most MYFS_INLINE_DATA bytes takes no blocks at all:
+   with MYFS_MAP_INLINE set in flags, its data is kept in data, in
+   place of tail and root. The bytes of data past size are zero.
+
+   A file of at most MYFS_FRAG_MAX bytes that does not fit inline has
+   MYFS_MAP_FRAG set instead: its data is kept in frag_slots slots of
+   the fragment block frag_block, starting at slot frag_slot. The
+   bytes of the slots past size are zero, too. Neither is ever done
+   for a map with MYFS_MAP_FIXED set, which directories have, as the
+   entries of a directory must not move.
+
+   MYFS_MAP_META is set for directories and directory indexes: their
+   contents are metadata, and changes to them go through the journal.
+
+   blocks counts every block the file holds, tree nodes included.
+*/
+#define MYFS_INLINE_DATA (sizeof(uint64_t) + MYFS_INLINE_EXTENTS * sizeof(struct __myfs_extent))
+#define MYFS_MAP_INLINE 1
+#define MYFS_MAP_FRAG 2
+#define MYFS_MAP_FIXED 4
+#define MYFS_MAP_META 8
+#define MYFS_MAP_SMALL (MYFS_MAP_INLINE | MYFS_MAP_FRAG)
+
+struct __myfs_extent_map {
+    uint64_t size;
+    uint16_t depth;
+    uint8_t count;
+    uint8_t flags;
+    uint32_t blocks;
+    union {
+        struct {
+            uint64_t tail;
+            struct __myfs_extent root[MYFS_INLINE_EXTENTS];
+        };
+        struct {
+            uint64_t frag_block;
+            uint16_t frag_slot;
+            uint16_t frag_slots;
+        };
+        char data[MYFS_INLINE_DATA];
+    };
+};
+
+struct __myfs_extent_node {
+    uint32_t count;
+    uint32_t depth;
+    struct __myfs_extent entries[];
+};
+
+/* Everything about a file but its name. Inodes live in a table of
+   fixed size, made when the filesystem is built, and are referred to
+   by their index in it; inode 0 stands for "no inode".
+   nlink is the number of directory entries naming the inode, and 0
+   for a free one. subdirs is the number of directories inside a
+   directory, kept so that st_nlink does not need a scan of the
+   directory. generation goes up every time the inode is freed, so
+   that whoever remembers an inode number can tell that it was reused.
+   An inode of type DIR_INDEX is never seen by users: it holds the
+   hash index of a large directory, see below.
+*/
+struct __myfs_inode {
+    enum FileType{DIRECTORY, REG_FILE, DIR_INDEX} file_type;
+    uint32_t nlink;
+    uint32_t subdirs;
+    uint32_t generation;
+    struct __myfs_extent_map map;
     struct timespec atime;
     struct timespec mtime;
 };
 
-void __myfs_copy_dir_entry(struct __myfs_dir_entry* dest, struct __myfs_dir_entry* src) {
-    memcpy(dest->file_name, src->file_name, MYFS_MAX_NAME_SIZE);
-    dest->file_type = src->file_type;
-    dest->file_block = src->file_block;
-    dest->atime = src->atime;
-    dest->mtime = src->mtime;
-}
+/* A directory is an array of entries, each a name and an inode */
+struct __myfs_dir_entry {
+    char file_name[MYFS_MAX_NAME_SIZE];
+    uint32_t inode;
+};
 
-/* BLOCK LAYOUT
-   Checks if the fs is built.
-   If it is invalid, then try to build it.
+#define MYFS_DIR_ENTRY_SIZE sizeof(struct __myfs_dir_entry)
+
+/* Directory entries must never straddle two blocks, as the blocks of
+   a directory need not be next to each other in the image. Block
+   sizes are powers of two, so it is enough to check the smallest.
 */
-void __myfs_try_build(void *fsptr, size_t fssize, int *errnoptr) {
-    unsigned long long *ul_fsptr = fsptr;
-    if (ul_fsptr[0] == 0x00000005c1f16546) {
-        // Already set up, do nothing
-        return;
-    }
-    ul_fsptr[0] = 0x00000005c1f16546;
-    struct __myfs_fat_entry* fat_fsptr = (struct __myfs_fat_entry*) ((char *) fsptr + MYFS_HEADER_SIZE);
-    size_t fat_size = __myfs_get_fat_size(fsptr, fssize, errnoptr);
-    for (size_t i = 0; i < fat_size; i++) {
-        fat_fsptr[i].used_size = 0;
-        fat_fsptr[i].is_used = 0;
-        fat_fsptr[i].next_block = 0;
+_Static_assert(MYFS_MIN_BLOCK_SIZE % MYFS_DIR_ENTRY_SIZE == 0,
+               "directory entries must tile a block");
+
+/* Superblock, stored right after the magic number.
+   block_size is the size of every block, fixed when the filesystem is
+   built.
+   block_count and free_count are kept up to date by every function
+   that claims or releases a block, so statfs never has to scan.
+   next_free is the next-fit cursor: the block index at which the
+   next search for a free block starts. It only ever rotates forward
+   (wrapping around at the end of the image), so allocation does not
+   rescan the already full front of the image over and over again.
+   Files that keep growing are given windows of blocks from it, see
+   __myfs_alloc_run.
+   Writers to different files allocate blocks at the same time, so
+   free_count and next_free are only ever changed atomically.
+   The root directory has no parent to hold its entry, so it is kept
+   here, naming inode MYFS_ROOT_INODE.
+   block_capacity is the number of blocks the bitmap and the FAT before
+   block 0 have room for, which fixes where block 0 starts. The image
+   may hold fewer and grow up to it. Past that, the bitmap and the FAT
+   go on in fat_slices slices, one from the build and one more for every
+   time the image grew beyond the ones before, up to MYFS_FAT_SLICES:
+   slice s is for the blocks from fat_first[s] on, and is kept in the
+   blocks starting at fat_block[s], see __myfs_grow. Together they have
+   room for fat_capacity blocks.
+   The inode table holds inode_count inodes in inode_groups groups, one
+   from the build and one more for every time the image grew: group g
+   holds the inodes from inode_first[g] on, in the blocks starting at
+   inode_block[g]. inode_free of them are free, and next_inode is where
+   the next search for a free one starts, like next_free for blocks.
+   Inodes are only allocated and freed under the exclusive lock.
+   The path lookup cache takes dcache_slots slots in the blocks starting
+   at dcache_block. Slots filled under an older dcache_epoch are stale.
+   seq is a sequence counter for getattr, which runs without any lock:
+   it is odd while a directory or an entry's metadata is being changed.
+   frag_list and frag_lock belong to the fragment allocator, see
+   __myfs_frag_alloc.
+   The journal takes journal_blocks blocks starting at journal_block,
+   and its records are only good if they carry journal_gen. Its state
+   while mounted lives in the blocks starting at journal_state_block,
+   see __myfs_journal_dirty. A larger journal set aside when the image
+   grew waits at journal_next_block, and the blocks of the one it
+   replaced at journal_old_block until they are freed, see
+   __myfs_journal_switch.
+   shared_count is the number of blocks of file data held by more than
+   one file, which only snapshots do, see __myfs_release_data. While it
+   is 0, writes and truncates need not look for shared blocks. It is
+   changed atomically, like free_count.
+*/
+struct __myfs_superblock {
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t block_count;
+    uint64_t block_capacity;
+    uint64_t fat_capacity;
+    uint32_t fat_slices;
+    uint32_t unused;
+    uint64_t fat_first[MYFS_FAT_SLICES];
+    uint64_t fat_block[MYFS_FAT_SLICES];
+    uint64_t free_count;
+    uint64_t next_free;
+    uint64_t dcache_block;
+    uint32_t dcache_slots;
+    uint32_t dcache_epoch;
+    uint32_t seq;
+    uint32_t frag_lock;
+    uint64_t frag_list;
+    uint32_t inode_count;
+    uint32_t inode_free;
+    uint32_t next_inode;
+    uint32_t inode_groups;
+    uint32_t inode_first[MYFS_INODE_GROUPS];
+    uint64_t inode_block[MYFS_INODE_GROUPS];
+    uint64_t journal_block;
+    uint64_t journal_state_block;
+    uint32_t journal_blocks;
+    uint32_t journal_gen;
+    uint64_t journal_next_block;
+    uint64_t journal_old_block;
+    uint32_t journal_next_blocks;
+    uint32_t journal_old_blocks;
+    uint64_t shared_count;
+    struct __myfs_dir_entry root;
+};
+
+/* One slot of the path lookup cache: maps the hash of a full path to
+   the offset of its directory entry from the start of the image.
+   Lookups that only hold the shared lock still fill the cache, so two
+   of them may write the same slot at once. check is a hash over the
+   other three fields; a slot torn by such a race fails the check and
+   reads as a miss.
+*/
+struct __myfs_dcache_slot {
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t epoch;
+    uint32_t check;
+};
+
+/* Directory index
+
+   Once a directory holds more than MYFS_DIR_INDEX_THRESHOLD entries,
+   its first slot goes to a hidden entry, much like ext4 hides the root
+   of its htree in the first block of a directory. The hidden entry has
+   no name, and its inode, of type DIR_INDEX, holds an open addressing
+   hash table from the hash of a name to the slot of the
+   entry with that name. The other entries stay where they are, so a
+   directory is still an array of entries.
+
+   The table is a header followed by capacity slots, capacity being a
+   power of two. At most half of the slots are used or tombstones;
+   past that, the table is rebuilt at twice the size. A slot keeps the
+   top half of the name hash as tag, to skip most mismatches without
+   reading the entry, and the index of the entry in the directory.
+   Index 0 is the hidden entry itself, so it marks a free slot.
+*/
+struct __myfs_dir_index_header {
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t tombstones;
+    uint32_t unused;
+};
+
+struct __myfs_dir_index_slot {
+    uint32_t tag;
+    uint32_t entry;
+};
+
+#define MYFS_FAT_SIZE sizeof(struct __myfs_fat_entry)
+#define MYFS_HEADER_SIZE (MYFS_MAGIC_SIZE + sizeof(struct __myfs_superblock))
+
+// Every change marks the first unit of the journal along, see __myfs_journal_dirty
+_Static_assert(MYFS_HEADER_SIZE <= MYFS_MIN_BLOCK_SIZE, "the superblock must fit into the first unit");
+
+/* Every block costs one FAT entry, one block of data and one bit in
+   the free-space bitmap. The bitmap is rounded up to whole 64-bit
+   words, hence the extra word reserved before dividing. Returns the
+   number of blocks of block_size bytes an image of size bytes has
+   room for.
+*/
+size_t __myfs_layout_capacity(size_t size, size_t block_size) {
+    if (size < MYFS_HEADER_SIZE + sizeof(uint64_t)) {
+        return (size_t) 0;
     }
-    fat_fsptr[0].used_size = 0;
-    fat_fsptr[0].is_used = 1;
+    return (size_t) ((size - MYFS_HEADER_SIZE - sizeof(uint64_t)) * 8) / (8 * (MYFS_FAT_SIZE + block_size) + 1);
 }
-    
-struct __myfs_fat_entry* __myfs_get_fat(void *fsptr, size_t fssize, int *errnoptr, size_t fat_num) {
-    char *c_fsptr = fsptr;
-    c_fsptr += MYFS_HEADER_SIZE;
-    struct __myfs_fat_entry* f_fsptr = (struct __myfs_fat_entry*) c_fsptr;
-    return (f_fsptr + fat_num);
+
+// Size of the part of the image before block 0, for a FAT of capacity entries
+size_t __myfs_layout_header(size_t capacity) {
+    return MYFS_HEADER_SIZE + (capacity + MYFS_BITMAP_WORD_BITS - 1) / MYFS_BITMAP_WORD_BITS * sizeof(uint64_t) +
+           capacity * MYFS_FAT_SIZE;
 }
 
-size_t __myfs_get_num_free_blocks(void *fsptr, size_t fssize, int *errnoptr) {
-    size_t free_num = 0;
-    for (size_t i = 0; i < __myfs_get_fat_size(fsptr, fssize, errnoptr); i++) {
-        struct __myfs_fat_entry *f = __myfs_get_fat(fsptr, fssize, errnoptr, i);
-        if (f->is_used == 0) {
-            free_num++;
-        }
+// Number of blocks an image of size bytes holds, with a FAT of capacity entries
+size_t __myfs_layout_blocks(size_t size, size_t capacity, size_t block_size) {
+    size_t header = __myfs_layout_header(capacity);
+    if (size <= header) {
+        return (size_t) 0;
     }
-    return free_num;
+    return min((size - header) / block_size, capacity);
+}
+
+/* Number of blocks in the image. It only grows, under the exclusive
+   lock, but getattr reads it without any lock.
+*/
+size_t __myfs_get_fat_size(void *fsptr, size_t fssize, int *errnoptr) {
+    return __atomic_load_n(&((struct __myfs_superblock*) ((char *) fsptr + MYFS_MAGIC_SIZE))->block_count, __ATOMIC_ACQUIRE);
 }
 
-/* Does not allocate any new bytes */
-void * __myfs_load_block(void *fsptr, size_t fssize, int *errnoptr, size_t block_num, size_t *mem_size) {
-    struct __myfs_fat_entry* fat = __myfs_get_fat(fsptr, fssize, errnoptr, block_num);
-    fsptr += MYFS_HEADER_SIZE + MYFS_FAT_SIZE * __myfs_get_fat_size(fsptr, fssize, errnoptr);
-    fsptr += block_num * MYFS_BLOCK_SIZE;
-    mem_size[0] = fat->used_size;
-    return fsptr;
+// Number of 64-bit words of the free-space bitmap in use
+size_t __myfs_get_bitmap_words(void *fsptr, size_t fssize, int *errnoptr) {
+    return (__myfs_get_fat_size(fsptr, fssize, errnoptr) + MYFS_BITMAP_WORD_BITS - 1) / MYFS_BITMAP_WORD_BITS;
 }
 
-/* allocates block and returns the allocated block */
-size_t __myfs_alloc_block(void *fsptr, size_t fssize, int *errnoptr) {
-    char *c_fsptr = fsptr;
-    c_fsptr += MYFS_HEADER_SIZE;
-    struct __myfs_fat_entry* f_fsptr = (struct __myfs_fat_entry*) c_fsptr;
-    for (size_t i = 0; i < __myfs_get_fat_size(fsptr, fssize, errnoptr); i++) {
-        if (f_fsptr[i].is_used == 0) {
-            f_fsptr[i].is_used = 1;
-            return i;
-        }
-    }
-    *errnoptr = 1;
-    return 0;
+struct __myfs_superblock* __myfs_get_superblock(void *fsptr, size_t fssize, int *errnoptr) {
+    return (struct __myfs_superblock*) ((char *) fsptr + MYFS_MAGIC_SIZE);
 }
 
-void __myfs_alloc_data(void *fsptr, size_t fssize, int *errnoptr, void *data, size_t data_size) {
-    int first = 1;
-    struct __myfs_fat_entry* fat = NULL;
-    size_t num_blocks = data_size / __myfs_get_fat_size(fsptr, fssize, errnoptr);
-    if (num_blocks % __myfs_get_fat_size(fsptr, fssize, errnoptr) != 0) {
-        num_blocks++;
-    }
-    for (size_t i = 0; i < num_blocks; i++) {
-        size_t block = __myfs_alloc_block(fsptr, fssize, errnoptr);
-        size_t block_size = 0;
-        void *copy_to = __myfs_load_block(fsptr, fssize, errnoptr, block, &block_size);
-        size_t start_index = i * MYFS_BLOCK_SIZE;
-        size_t end = start_index + MYFS_BLOCK_SIZE - 1;
-        size_t copy_len = MYFS_BLOCK_SIZE;
-        if (end + start_index > data_size) {
-            copy_len = data_size-start_index;
-        }
-        memcpy(copy_to, data + start_index, copy_len);
-        if (first) {
-            first = 0;
-        } else {
-            fat->next_block = block;
-            fat = __myfs_get_fat(fsptr, fssize, errnoptr, block);
-        }
-    }
+// The block size is chosen when the filesystem is built, see __myfs_build
+size_t __myfs_block_size(void *fsptr, size_t fssize, int *errnoptr) {
+    return __myfs_get_superblock(fsptr, fssize, errnoptr)->block_size;
 }
 
-/* Frees block and following children */
-int __myfs_free_data(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
-    struct __myfs_fat_entry* current_block;
+// Number of extents an extent node has room for
+uint32_t __myfs_node_extents(void *fsptr, size_t fssize, int *errnoptr) {
+    return (uint32_t) ((__myfs_block_size(fsptr, fssize, errnoptr) - sizeof(struct __myfs_extent_node)) / sizeof(struct __myfs_extent));
+}
 
-    current_block = __myfs_get_fat(fsptr, fssize, errnoptr, block);
-    block = current_block->next_block;
-    current_block->used_size = 0;
-    current_block->is_used = 0;
-    current_block->next_block = 0;
-    if (block == 0) {
-        return 0;
-    }
-    return __myfs_free_data(fsptr, fssize, errnoptr, block);
+/* Returns a pointer to the data of a block. Blocks with consecutive
+   numbers are next to each other in memory.
+*/
+void *__myfs_get_block(void *fsptr, size_t fssize, int *errnoptr, size_t block_num) {
+    size_t capacity = __myfs_get_superblock(fsptr, fssize, errnoptr)->block_capacity;
+    return (char *) fsptr + __myfs_layout_header(capacity) + block_num * __myfs_block_size(fsptr, fssize, errnoptr);
 }
 
-size_t __myfs_read_data(void *fsptr, size_t fssize, int *errnoptr, size_t block, size_t start, size_t read_len, void *buff) {
-    size_t current_block = block;
-    size_t read_size = 0;
-    size_t write_size = 0;
-    while (1) {
-        struct __myfs_fat_entry* fat = __myfs_get_fat(fsptr, fssize, errnoptr, current_block);
-        if (*errnoptr != 0) {
-            return -1;
-        }
-        size_t t_mem_size = 0;
-        char *t_data = __myfs_load_block(fsptr, fssize, errnoptr, current_block, &t_mem_size);
-        if (*errnoptr != 0) {
-            return -1;
-        }
-        if ((t_mem_size + read_size) > start) {
-            size_t start_index = start - read_size;
-            if (start < read_size) {
-                start_index = 0;    
-            }
-            size_t end_index = t_mem_size;
-            if (end_index - start_index + write_size > read_len) {
-                end_index = read_len - read_size + start_index;
-            }
-            memcpy(buff + write_size, t_data + start_index, end_index - start_index);
-            read_size += end_index - start_index;
-            write_size += end_index - start_index;
-            if (write_size == read_len) {
-                return write_size;
-            }
-        } else {
-            read_size += t_mem_size;
-        }
-        if (fat->next_block != 0) {
-            current_block = fat->next_block;
-        } else {
-            return write_size;
-        }
+/* Returns the slice of the bitmap and the FAT that block belongs to.
+   Slices are only added under the exclusive lock, and nothing that
+   runs without a lock looks at the bitmap or the FAT.
+*/
+size_t __myfs_fat_slice(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t s = sb->fat_slices - 1;
+    while ((s > 0) && (block < sb->fat_first[s])) {
+        s--;
     }
-    return -1;
+    return s;
 }
 
-int __myfs_write_byte(void *fsptr, size_t fssize, int*errnoptr, size_t start_block, size_t write_addr, unsigned char to_write) {
-    size_t read_size = 0;
-    while (1) {
-        struct __myfs_fat_entry*  fat = __myfs_get_fat(fsptr, fssize, errnoptr, start_block);
-        // If is in current block
-        if ((write_addr >= read_size) && (write_addr < (read_size + fat->used_size))) {
-            size_t t_mem_size;
-            unsigned char *data = __myfs_load_block(fsptr, fssize, errnoptr, start_block, &t_mem_size);
-            if (*errnoptr != 0) {
-                return -1;
-            }
-            data[write_addr - read_size] = to_write;
-            return 0;
-        } else if ((write_addr >= read_size) && (write_addr < (read_size + MYFS_BLOCK_SIZE))) {
-            // If inside of block but not allocated
-            size_t addr_in_block = write_addr - read_size;
-            size_t t_mem_size;
-            unsigned char *data = __myfs_load_block(fsptr, fssize, errnoptr, start_block, &t_mem_size);
-            if (*errnoptr != 0) {
-                return -1;
-            }
-            memset(data + fat->used_size, 0, addr_in_block - fat->used_size);
-            data[addr_in_block] = to_write;
-            // Updating size;
-            fat->used_size = addr_in_block + 1;
-        } else {
-            // Getting next in block
-            read_size += fat->used_size;
-            if (fat->next_block != 0) {
-                start_block = fat->next_block;
-            } else {
-                size_t t_block = __myfs_alloc_block(fsptr, fssize, errnoptr);
-                struct __myfs_fat_entry* t = __myfs_get_fat(fsptr, fssize, errnoptr, t_block);
-                t->used_size = 0;
-                if (*errnoptr != 0) {
-                    return -1;
-                }
-                start_block = t_block;
-                fat->next_block = start_block;
-            }
-        }
-    }
+// Number of blocks from block on that belong to the same slice
+size_t __myfs_fat_span(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t s = __myfs_fat_slice(fsptr, fssize, errnoptr, block);
+    return ((s + 1 < sb->fat_slices) ? sb->fat_first[s + 1] : sb->fat_capacity) - block;
 }
 
-int __myfs_write_data(void *fsptr, size_t fssize, int *errnoptr, size_t block_number, size_t start, size_t write_len, const char *to_write) {
-    size_t current_block = block_number;
-    size_t bytes_written = 0;
-    size_t bytes_traversed = 0;
-    while (1) {
-        struct __myfs_fat_entry* fat = __myfs_get_fat(fsptr, fssize, errnoptr, current_block);
-        if (*errnoptr != 0) {
-            return -1;
-        }
-        // If block is smaller then need be...
-        if (fat->used_size < MYFS_BLOCK_SIZE) {
-            // ...Then set it to be the size needed
-            size_t old_used_size = fat->used_size;
-            fat->used_size = min(MYFS_BLOCK_SIZE, (write_len + start - bytes_traversed));
-            size_t temp;
-            void *disk_data = __myfs_load_block(fsptr, fssize, errnoptr, current_block, &temp);
-            if (*errnoptr != 0) {
-                return -1;
-            }
-            memset(disk_data + old_used_size, 0, fat->used_size - old_used_size);
-        }
-        // If write is in block
-        if ((bytes_traversed + fat->used_size) > start) {
-            size_t write_start = 0;
-            // If write start is not at start of block
-            if (bytes_traversed < start) {
-                write_start = start - bytes_traversed;
-            }
-            // If write_start is before block
-            if (bytes_traversed > start) {
-                write_start = 0;
-            }
-            size_t write_end = fat->used_size;
-            // If write end is not at end of block
-            if ((bytes_written + fat->used_size) < write_len) {
-                write_end = start + (write_len - bytes_written);
-            }
-            size_t temp;
-            void *disk_data = __myfs_load_block(fsptr, fssize, errnoptr, current_block, &temp);
-            if (*errnoptr != 0) {
-                return -1;
-            }
-            memcpy(disk_data, to_write + bytes_written, write_end - write_start);
-            bytes_written += write_end - write_start;
-            if (bytes_written == write_len) {
-                return bytes_written;
-            }
-        }
-        bytes_traversed += fat->used_size;
-        if (fat->next_block != 0) {
-            current_block = fat->next_block;
-        } else {
-            size_t t_block = __myfs_alloc_block(fsptr, fssize, errnoptr);
-            struct __myfs_fat_entry* t = __myfs_get_fat(fsptr, fssize, errnoptr, t_block);
-            t->used_size = 0;
-            if (*errnoptr != 0) {
-                return bytes_written;
-            }
-            current_block = t_block;
-            fat->next_block = current_block;
-        }
+// Number of blocks a slice of size blocks is kept in: its bitmap, followed by its FAT
+size_t __myfs_fat_slice_blocks(size_t size, size_t block_size) {
+    return (size / MYFS_BITMAP_WORD_BITS * sizeof(uint64_t) + size * MYFS_FAT_SIZE + block_size - 1) / block_size;
+}
+
+/* The bitmap has one bit per block, set when the block is in use.
+   This is the part of it before block 0.
+*/
+uint64_t* __myfs_get_bitmap(void *fsptr, size_t fssize, int *errnoptr) {
+    return (uint64_t*) ((char *) fsptr + MYFS_HEADER_SIZE);
+}
+
+/* Returns the word of the bitmap holding the bit of block. Slices
+   start at a multiple of MYFS_BITMAP_WORD_BITS, so no word is cut in
+   two.
+*/
+uint64_t* __myfs_bitmap_word(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t s;
+    if (block < sb->block_capacity) {
+        return __myfs_get_bitmap(fsptr, fssize, errnoptr) + block / MYFS_BITMAP_WORD_BITS;
     }
+    s = __myfs_fat_slice(fsptr, fssize, errnoptr, block);
+    return (uint64_t *) __myfs_get_block(fsptr, fssize, errnoptr, sb->fat_block[s]) + (block - sb->fat_first[s]) / MYFS_BITMAP_WORD_BITS;
 }
 
-/* Reallocates data to proper size */
-int __myfs_append_data(void *fsptr, size_t fssize, int *errnoptr, size_t block, size_t append_size, void *new_data) {
-    struct __myfs_fat_entry* current_block;
-    size_t size = 0;
-    while (1) {
-        current_block = __myfs_get_fat(fsptr, fssize, errnoptr, block);
-        size += current_block->used_size;
-        if (current_block->next_block == 0) {
-            // Increase size
-            size_t index_in_block = 0;
-            void *memory = __myfs_load_block(fsptr, fssize, errnoptr, block, &index_in_block);
-            // First copy to end of current block
-            if (index_in_block < MYFS_BLOCK_SIZE) {    
-                size_t copy_size = min(MYFS_BLOCK_SIZE - index_in_block, append_size);
-                memcpy(memory + index_in_block, new_data, copy_size);
-                current_block->used_size = copy_size + index_in_block;
-                if (append_size + index_in_block < MYFS_BLOCK_SIZE - index_in_block) {
-                    return 0;
-                }
-            }
-            while (1) {
-                current_block->next_block = __myfs_alloc_block(fsptr, fssize, errnoptr);
-                if (append_size > MYFS_BLOCK_SIZE) {
-                    void *t_memory = __myfs_load_block(fsptr, fssize, errnoptr, block, &index_in_block);
-                    memcpy(t_memory, new_data, MYFS_BLOCK_SIZE);
-                    current_block = __myfs_get_fat(fsptr, fssize, errnoptr, current_block->next_block);
-                    current_block->used_size = MYFS_BLOCK_SIZE;
-                }
-                if (append_size == MYFS_BLOCK_SIZE) {
-                    void *t_memory = __myfs_load_block(fsptr, fssize, errnoptr, block, &index_in_block);
-                    memcpy(t_memory, new_data, MYFS_BLOCK_SIZE);
-                    current_block = __myfs_get_fat(fsptr, fssize, errnoptr, current_block->next_block);
-                    current_block->next_block = 0;
-                    current_block->used_size = MYFS_BLOCK_SIZE;
-                    return 0;
-                }
-                if (append_size < MYFS_BLOCK_SIZE) {
-                    // Copy only part
-                    void *t_memory = __myfs_load_block(fsptr, fssize, errnoptr, block, &index_in_block);
-                    memcpy(t_memory, new_data, append_size % MYFS_FAT_SIZE);
-                    current_block = __myfs_get_fat(fsptr, fssize, errnoptr, current_block->next_block);
-                    current_block->used_size = append_size % MYFS_FAT_SIZE;
-                    return 0;
-                }
-                // Then copy to new blocks
-            }
-        }else{
-		block=current_block->next_block;
-		
+/* Setting and clearing bits is atomic, as writers to different files
+   allocate blocks concurrently. Both return whether the bit was set
+   before, so exactly one caller wins a block.
+*/
+int __myfs_bitmap_set(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
+    uint64_t *word = __myfs_bitmap_word(fsptr, fssize, errnoptr, block);
+    uint64_t bit = ((uint64_t) 1) << (block % MYFS_BITMAP_WORD_BITS);
+    return (__atomic_fetch_or(word, bit, __ATOMIC_ACQ_REL) & bit) != 0;
+}
 
-	}
+int __myfs_bitmap_clear(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
+    uint64_t *word = __myfs_bitmap_word(fsptr, fssize, errnoptr, block);
+    uint64_t bit = ((uint64_t) 1) << (block % MYFS_BITMAP_WORD_BITS);
+    return (__atomic_fetch_and(word, ~bit, __ATOMIC_ACQ_REL) & bit) != 0;
+}
+
+int __myfs_bitmap_test(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
+    uint64_t *word = __myfs_bitmap_word(fsptr, fssize, errnoptr, block);
+    return (__atomic_load_n(word, __ATOMIC_ACQUIRE) >> (block % MYFS_BITMAP_WORD_BITS)) & 1;
+}
+
+/* Returns the FAT entry of block fat_num. Before block 0, the FAT comes
+   after the bitmap, sized for block_capacity blocks; in a slice, it
+   comes after the bitmap of the slice.
+*/
+struct __myfs_fat_entry* __myfs_get_fat(void *fsptr, size_t fssize, int *errnoptr, size_t fat_num) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t s, size;
+    char *c_fsptr;
+    if (fat_num < sb->block_capacity) {
+        c_fsptr = (char *) __myfs_get_bitmap(fsptr, fssize, errnoptr);
+        c_fsptr += (sb->block_capacity + MYFS_BITMAP_WORD_BITS - 1) / MYFS_BITMAP_WORD_BITS * sizeof(uint64_t);
+        return (struct __myfs_fat_entry*) c_fsptr + fat_num;
     }
-    return -1;
+    s = __myfs_fat_slice(fsptr, fssize, errnoptr, fat_num);
+    size = ((s + 1 < sb->fat_slices) ? sb->fat_first[s + 1] : sb->fat_capacity) - sb->fat_first[s];
+    c_fsptr = (char *) __myfs_get_block(fsptr, fssize, errnoptr, sb->fat_block[s]) + size / MYFS_BITMAP_WORD_BITS * sizeof(uint64_t);
+    return (struct __myfs_fat_entry*) c_fsptr + (fat_num - sb->fat_first[s]);
 }
 
-// Loads data at block
-void *__myfs_load_mem(void *fsptr, size_t fssize, int *errnoptr, size_t block_number, size_t *mem_size) {
-    size_t current_block = block_number;
-    char *data = NULL;
-    *mem_size = 0;
-    while (1) {
-        struct __myfs_fat_entry* fat = __myfs_get_fat(fsptr, fssize, errnoptr, current_block);
-        size_t t_mem_size = 0;
-        char *t_data = __myfs_load_block(fsptr, fssize, errnoptr, current_block, &t_mem_size);
-        data = realloc(data, t_mem_size + *mem_size);
-        memcpy(data + *mem_size, t_data, t_mem_size);
-        *mem_size += t_mem_size;
-        if (fat->next_block == 0) {
-            break;
-        }
-        current_block = fat->next_block;
+size_t __myfs_get_num_free_blocks(void *fsptr, size_t fssize, int *errnoptr) {
+    return __atomic_load_n(&__myfs_get_superblock(fsptr, fssize, errnoptr)->free_count, __ATOMIC_RELAXED);
+}
+
+/* Returns inode ino, or NULL if there is no such inode. getattr
+   follows entries that may be changing under it, so ino is checked
+   against the size of the table before it is used. A group is filled
+   in before inode_count takes its inodes in, so the group holding ino
+   is there once ino passed the check.
+*/
+struct __myfs_inode *__myfs_get_inode(void *fsptr, size_t fssize, int *errnoptr, size_t ino) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t g;
+    if ((ino == 0) || (ino >= __atomic_load_n(&sb->inode_count, __ATOMIC_ACQUIRE))) {
+        return NULL;
     }
-    return data;
+    g = __atomic_load_n(&sb->inode_groups, __ATOMIC_ACQUIRE) - 1;
+    while (ino < sb->inode_first[g]) {
+        g--;
+    }
+    return (struct __myfs_inode *) __myfs_get_block(fsptr, fssize, errnoptr, sb->inode_block[g]) + (ino - sb->inode_first[g]);
 }
 
-size_t __myfs_get_size(void *fsptr, size_t fssize, int *errnoptr, size_t block_number) {
-    size_t current_block = block_number, size = 0;
-    struct __myfs_fat_entry* fat;
-    do {
-        fat = __myfs_get_fat(fsptr, fssize, errnoptr, current_block);
-        size += fat->used_size;
-    } while (fat->next_block != 0);
-    return size;
+/* Metadata journal
+
+   The image is changed in place, and the kernel may write any page of
+   it back to the backup file at any time, so a crash in the middle of
+   an operation can leave any mix of old and new metadata behind. The
+   journal brings the metadata back to how it was at the end of the
+   last commit.
+
+   The metadata is cut into units: the part of the image before block
+   0 (magic, superblock, bitmap and FAT) in pieces of a block each,
+   followed by one unit per block. Whoever is about to change
+   metadata first passes it to __myfs_journal_dirty, which marks the
+   units holding it dirty. The first time a unit is touched since the
+   last checkpoint, a copy of it is appended to the journal as an UNDO
+   record and flushed to the disk before anything changes. That is a
+   synchronous write, but only once per unit and checkpoint.
+
+   A commit appends a copy of every dirty unit as REDO records, the
+   last of which is marked as such, and flushes just those records in
+   one sequential write. However many operations went into the batch,
+   that is all it takes to make them durable.
+
+   Mounting replays the journal: the UNDO records take every unit
+   touched since the last checkpoint back to how it was then, and the
+   REDO records of complete commits bring it forward again. Once the
+   journal runs full, a checkpoint flushes every unit changed since the
+   one before and starts the journal over under a new journal_gen, which turns the old
+   records invalid without erasing them.
+
+   A block of metadata that is freed may be reused for file data, which
+   does not go through the journal. Its copies in the journal must then
+   no longer be replayed: it is logged before it is freed, like any
+   other change, and the next commit appends a REVOKE record for it.
+   Copies of a unit older than a committed REVOKE record for it are
+   skipped on replay. A block newly taken for metadata is not logged,
+   as whatever it held before does not matter.
+
+   File data is not journaled: after a crash, the data blocks written
+   since the last checkpoint may hold their old or their new contents.
+*/
+struct __myfs_journal_desc {
+    uint64_t magic;
+    uint32_t generation;
+    uint32_t tid;
+    uint32_t type;
+    uint32_t count;
+    uint32_t last;
+    uint32_t unused;
+    uint64_t check;
+    uint64_t units[];
+};
+
+// Number of units a descriptor block has room for
+size_t __myfs_journal_desc_units(void *fsptr, size_t fssize, int *errnoptr) {
+    return (__myfs_block_size(fsptr, fssize, errnoptr) - sizeof(struct __myfs_journal_desc)) / sizeof(uint64_t);
 }
 
-/* Finds dir entry at path
-   If none is found errno is populated as necessary
+/* What the journal needs while the filesystem is mounted. It is set up
+   afresh by every mount, in blocks of its own that are never journaled.
+   head is the first free block of the journal, dirty the number of
+   dirty units and unsynced the number of units of file data waiting to
+   be written back. The block is followed by three bitmaps with a bit per
+   unit: the units logged since the last checkpoint, the units dirty
+   since the last commit, and the units of file data changed since they
+   were last written back (see __myfs_sync_mark).
+   lock serializes the UNDO records of concurrent writers. Commits and
+   checkpoints run under the exclusive lock, with nothing else going on.
 */
-int __myfs_write_path(void *fsptr, size_t fssize, int *errnoptr, const char *path, struct __myfs_dir_entry to_write) {
-    // Hardcode Root
-    if (strcmp(path, "/") == 0) {
-        *errnoptr = ENOTDIR;
-        return -1;
+struct __myfs_journal_state {
+    pthread_mutex_t lock;
+    uint32_t head;
+    uint32_t tid;
+    uint32_t dirty;
+    uint32_t overflow;
+    uint64_t unsynced;
+};
+
+struct __myfs_journal_state *__myfs_journal_get_state(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    return (struct __myfs_journal_state *) __myfs_get_block(fsptr, fssize, errnoptr, sb->journal_state_block);
+}
+
+// Number of units the part of the image before block 0 is cut into
+size_t __myfs_journal_header_units(void *fsptr, size_t fssize, int *errnoptr) {
+    size_t header = (char *) __myfs_get_block(fsptr, fssize, errnoptr, 0) - (char *) fsptr;
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    return (header + block_size - 1) / block_size;
+}
+
+/* The bitmaps have room for the units of every block the FAT has room
+   for. They move to a larger place when the FAT gets another slice,
+   see __myfs_grow.
+*/
+size_t __myfs_journal_map_words(void *fsptr, size_t fssize, int *errnoptr) {
+    size_t units = __myfs_journal_header_units(fsptr, fssize, errnoptr) + __myfs_get_superblock(fsptr, fssize, errnoptr)->fat_capacity;
+    return (units + MYFS_BITMAP_WORD_BITS - 1) / MYFS_BITMAP_WORD_BITS;
+}
+
+// Returns the bitmap of logged units, followed by the ones of dirty and unsynced units
+uint64_t *__myfs_journal_get_maps(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    return (uint64_t *) __myfs_get_block(fsptr, fssize, errnoptr, sb->journal_state_block + 1);
+}
+
+// Returns unit u and puts its length into *len
+char *__myfs_journal_unit(void *fsptr, size_t fssize, int *errnoptr, size_t u, size_t *len) {
+    size_t header_units = __myfs_journal_header_units(fsptr, fssize, errnoptr);
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    if (u < header_units) {
+        size_t header = (char *) __myfs_get_block(fsptr, fssize, errnoptr, 0) - (char *) fsptr;
+        *len = min(block_size, header - u * block_size);
+        return (char *) fsptr + u * block_size;
     }
-    size_t current_block = 0;
-    if (path[0] != '/') {
-        *errnoptr = EINVAL;
+    *len = block_size;
+    return __myfs_get_block(fsptr, fssize, errnoptr, u - header_units);
+}
+
+uint64_t __myfs_journal_check(const void *data, size_t len, uint64_t hash) {
+    const uint64_t *words = data;
+    for (size_t i = 0; i < len / sizeof(uint64_t); i++) {
+        hash ^= words[i];
+        hash *= MYFS_HASH_PRIME;
+    }
+    return hash;
+}
+
+// Writes the pages holding the len bytes at ptr back to the disk
+int __myfs_journal_sync(void *fsptr, size_t fssize, int *errnoptr, void *ptr, size_t len) {
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) ptr & ~(page - 1);
+    uintptr_t end = ((uintptr_t) ptr + len + page - 1) & ~(page - 1);
+    if (msync((void *) start, end - start, MS_SYNC) != 0) {
+        *errnoptr = EIO;
         return -1;
     }
-    struct __myfs_dir_entry *dir = NULL;
-    size_t dir_size = 0;
-    char *t_path = calloc(MYFS_MAX_NAME_SIZE, sizeof(char));
-    if (t_path == NULL) {
-        *errnoptr = ENOMEM;
+    return 0;
+}
+
+/* Appends a record of type type for the count units at units: a
+   descriptor block and, but for a REVOKE record, a copy of each unit.
+   Returns the journal block the record starts at, or -1 if the
+   journal has no room for it. Nothing is flushed yet.
+*/
+ssize_t __myfs_journal_append(void *fsptr, size_t fssize, int *errnoptr, uint32_t type, const uint64_t *units, size_t count, int last) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    struct __myfs_journal_state *state = __myfs_journal_get_state(fsptr, fssize, errnoptr);
+    size_t pos = state->head;
+    size_t blocks = 1 + ((type == MYFS_JOURNAL_REVOKE) ? 0 : count);
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    struct __myfs_journal_desc *desc;
+    char *copy;
+    uint64_t hash;
+    if (pos + blocks > sb->journal_blocks) {
         return -1;
     }
-    strncpy(t_path, path, MYFS_MAX_NAME_SIZE);
-    char *fname = strtok(t_path, "/");
-    dir = __myfs_load_mem(fsptr, fssize, errnoptr, current_block, &dir_size);
-    dir_size /= sizeof(struct __myfs_dir_entry);
-    while (fname != NULL) {
-        int found = 0;
-        for (ssize_t i = 0; i < dir_size; i++) {
-            if (strncmp(fname, dir[i].file_name, MYFS_MAX_NAME_SIZE) == 0) {
-                if (dir[i].file_type == DIRECTORY) {
-                    current_block = dir[i].file_block;
-                    free(dir);
-                    dir = (struct __myfs_dir_entry*) __myfs_load_mem(fsptr, fssize, errnoptr, current_block, &dir_size);
-                    dir_size /= sizeof(struct __myfs_dir_entry);
-                    found = 1;
-                } else {
-                    *errnoptr = ENOTDIR;
-                    return -1;
-                }
-            }
-        }
-        if (found == 0) {
-            *errnoptr = ENOTDIR;
-            return -1;
-        }
-        char *temp = strtok(NULL, "/");
-        if (temp == NULL) {
-            break;
-        } else {
-            fname = temp;
-        }
+    desc = __myfs_get_block(fsptr, fssize, errnoptr, sb->journal_block + pos);
+    memset(desc, 0, block_size);
+    desc->magic = MYFS_JOURNAL_MAGIC;
+    desc->generation = sb->journal_gen;
+    desc->tid = state->tid;
+    desc->type = type;
+    desc->count = count;
+    desc->last = last;
+    memcpy(desc->units, units, count * sizeof(uint64_t));
+    hash = __myfs_journal_check(desc, block_size, MYFS_HASH_INIT);
+    copy = (char *) desc + block_size;
+    for (size_t i = 0; i + 1 < blocks; i++, copy += block_size) {
+        size_t len;
+        char *unit = __myfs_journal_unit(fsptr, fssize, errnoptr, units[i], &len);
+        memcpy(copy, unit, len);
+        memset(copy + len, 0, block_size - len);
+        hash = __myfs_journal_check(copy, block_size, hash);
     }
-    for (ssize_t i = 0; i < dir_size; i++) {
-        if (strcmp(fname, dir[i].file_name) == 0) {
-            if (dir[i].file_type == DIRECTORY) {
-                __myfs_copy_dir_entry(dir + i, &to_write);
-                return 0;
-            } else {
-                *errnoptr = ENOTDIR;
-                return -1;
-            }
+    desc->check = hash;
+    __atomic_store_n(&state->head, pos + blocks, __ATOMIC_RELAXED);
+    return pos;
+}
+
+/* Appends an UNDO record for unit u and flushes it, unless somebody
+   else got there first. If the journal has no room left, the unit
+   goes unlogged and the next commit becomes a checkpoint.
+*/
+void __myfs_journal_log(void *fsptr, size_t fssize, int *errnoptr, size_t u) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    struct __myfs_journal_state *state = __myfs_journal_get_state(fsptr, fssize, errnoptr);
+    uint64_t *logged = __myfs_journal_get_maps(fsptr, fssize, errnoptr);
+    uint64_t bit = ((uint64_t) 1) << (u % MYFS_BITMAP_WORD_BITS);
+    uint64_t unit = u;
+    ssize_t pos;
+    int saved = *errnoptr;
+    pthread_mutex_lock(&state->lock);
+    if ((__atomic_load_n(logged + u / MYFS_BITMAP_WORD_BITS, __ATOMIC_ACQUIRE) & bit) == 0) {
+        pos = __myfs_journal_append(fsptr, fssize, errnoptr, MYFS_JOURNAL_UNDO, &unit, 1, 0);
+        if ((pos < 0) ||
+            (__myfs_journal_sync(fsptr, fssize, errnoptr, __myfs_get_block(fsptr, fssize, errnoptr, sb->journal_block + pos),
+                                 2 * __myfs_block_size(fsptr, fssize, errnoptr)) < 0)) {
+            __atomic_store_n(&state->overflow, 1, __ATOMIC_RELAXED);
         }
+        __atomic_fetch_or(logged + u / MYFS_BITMAP_WORD_BITS, bit, __ATOMIC_RELEASE);
     }
-    errnoptr[0] = ENOTDIR;
-    return -1;
+    pthread_mutex_unlock(&state->lock);
+    *errnoptr = saved;
 }
 
-char *__myfs_get_parent_path(const char *str) {
-    size_t last = 0;
-    for (size_t i = 0; str[i] != 0; i++) {
-        if (str[i] == '/') {
-            last = i;
-        }
+void __myfs_journal_touch(void *fsptr, size_t fssize, int *errnoptr, size_t u) {
+    struct __myfs_journal_state *state = __myfs_journal_get_state(fsptr, fssize, errnoptr);
+    uint64_t *logged = __myfs_journal_get_maps(fsptr, fssize, errnoptr);
+    uint64_t *dirty = logged + __myfs_journal_map_words(fsptr, fssize, errnoptr);
+    uint64_t bit = ((uint64_t) 1) << (u % MYFS_BITMAP_WORD_BITS);
+    if ((__atomic_load_n(logged + u / MYFS_BITMAP_WORD_BITS, __ATOMIC_ACQUIRE) & bit) == 0) {
+        __myfs_journal_log(fsptr, fssize, errnoptr, u);
     }
-    char *data = calloc(last + 1, sizeof(char));
-    if (last != 0) {
-        memcpy(data, str, last);
-        data[last] = 0;
-    } else {
-        data[0] = 0;
+    if (((__atomic_load_n(dirty + u / MYFS_BITMAP_WORD_BITS, __ATOMIC_RELAXED) & bit) == 0) &&
+        ((__atomic_fetch_or(dirty + u / MYFS_BITMAP_WORD_BITS, bit, __ATOMIC_RELAXED) & bit) == 0)) {
+        __atomic_fetch_add(&state->dirty, 1, __ATOMIC_RELAXED);
     }
-    return data;
 }
 
-char *__myfs_get_child_path(const char *str) {
-    size_t last = 0;
-    for (size_t i = 0; str[i] != 0; i++) {
-        if (str[i] == '/') {
-            last = i;
-        }
+/* Puts the first and the last unit holding the len bytes at ptr into
+   *first and *last. Returns -1 if there are none, as for an empty range
+   or a pointer outside of the image, such as to a map on the stack.
+*/
+int __myfs_journal_units(void *fsptr, size_t fssize, int *errnoptr, const void *ptr, size_t len, size_t *first, size_t *last) {
+    uintptr_t p = (uintptr_t) ptr, base = (uintptr_t) fsptr;
+    uintptr_t blocks = (uintptr_t) __myfs_get_block(fsptr, fssize, errnoptr, 0);
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    if ((len == 0) || (p < base) || (p + len > base + fssize)) {
+        return -1;
     }
-    size_t data_size = strlen(str) - last;
-    char *data = calloc(data_size, sizeof(char));
-    memcpy(data, str + (last + 1), data_size - 1);
-    data[data_size - 1] = 0;
-    return data;
+    if (p < blocks) {
+        *first = (p - base) / block_size;
+        *last = (p + len - 1 - base) / block_size;
+    } else {
+        size_t header_units = __myfs_journal_header_units(fsptr, fssize, errnoptr);
+        *first = header_units + (p - blocks) / block_size;
+        *last = header_units + (p + len - 1 - blocks) / block_size;
+    }
+    return 0;
 }
 
-/* Finds dir entry at path
-   If none is found, errno is populated as necessary
+/* To be called right before the len bytes of metadata at ptr change.
+   The superblock is part of every change, if only for the counters
+   in it, so its unit is always marked along.
 */
-struct __myfs_dir_entry __myfs_find_path(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
-    *errnoptr = 0;
-    // Hardcode Root
-    if (strcmp(path, "/") == 0 || strcmp(path, "") == 0) {
-        struct __myfs_dir_entry root;
-        root.file_type = DIRECTORY;
-        root.file_block = 0;
-        memset(root.file_name, 0, MYFS_MAX_NAME_SIZE);
-        return root;
-    }
-    size_t current_block = 0;
-    struct __myfs_dir_entry *dir = NULL;
-    size_t dir_size = 0;
-    char *t_path = __myfs_get_parent_path(path);
-    char *fname = strtok(t_path, "/");
-    char *child_name = __myfs_get_child_path(path);
-    if (fname == NULL) {
-        // Loading root block
-        dir = __myfs_load_mem(fsptr, fssize, errnoptr, 0, &dir_size);
-        dir_size /= sizeof(struct __myfs_dir_entry);
-    }
-    dir = __myfs_load_mem(fsptr, fssize, errnoptr, current_block, &dir_size);
-    dir_size /= sizeof(struct __myfs_dir_entry);
-    while (fname != NULL) {
-        int found = 0;
-        for (ssize_t i = 0; i < dir_size; i++) {
-            if (strcmp(fname, dir[i].file_name) == 0) {
-                if (dir[i].file_type == DIRECTORY) {
-                    current_block = dir[i].file_block;
-                    free(dir);
-                    dir = __myfs_load_mem(fsptr, fssize, errnoptr, current_block, &dir_size);
-                    dir_size /= sizeof(struct __myfs_dir_entry);
-                    found = 1;
-                } else {
-                    *errnoptr = ENOTDIR;
-                    struct __myfs_dir_entry t;
-                    t.file_block = (size_t) 0;
-                    free(t_path);
-                    free(child_name);
-                    return t;
-                }
-            }
-        }
-        if (found == 0) {
-            *errnoptr = ENOTDIR;
-            struct __myfs_dir_entry t;
-            t.file_block = (size_t) 0;
-            free(t_path);
-            return t;
-        }
-        char *temp = strtok(NULL, "/");
-        if (temp == NULL) {
-            break;
-        } else {
-            fname = temp;
-        }
+void __myfs_journal_dirty(void *fsptr, size_t fssize, int *errnoptr, const void *ptr, size_t len) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t first, last;
+    if ((sb->journal_blocks == 0) || (__myfs_journal_units(fsptr, fssize, errnoptr, ptr, len, &first, &last) < 0)) {
+        return;
     }
-    for (size_t i = 0; i < dir_size; i++) {
-        if (strcmp(child_name, dir[i].file_name) == 0) {
-            if (dir[i].file_type == DIRECTORY) {
-                struct __myfs_dir_entry ret = dir[i];
-                free(dir);
-                free(t_path);
-                free(child_name);
-                return ret;
-            } else {
-                struct __myfs_dir_entry ret = dir[i];
-                free(dir);
-                free(t_path);
-                free(child_name);
-                return ret;
-            }
-        }
+    __myfs_journal_touch(fsptr, fssize, errnoptr, 0);
+    for (size_t u = first; u <= last; u++) {
+        __myfs_journal_touch(fsptr, fssize, errnoptr, u);
     }
-    errnoptr[0] = ENOENT;
-    struct __myfs_dir_entry t;
-    t.file_block = (size_t) 0;
-    free(t_path);
-    free(child_name);
-    return t;
 }
 
-// Removes data
-void __myfs_remove_data(void *fsptr, size_t fssize, int *errnoptr, size_t *block, size_t start_index, size_t size_remove) {
-    size_t size_read = (size_t) 0;
-    void *data = __myfs_load_mem(fsptr, fssize, errnoptr, *block, &size_read);
-    if (*errnoptr != 0) {
+// Marks block, just taken for metadata, as dirty without logging it
+void __myfs_journal_fresh(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    uint64_t *logged = __myfs_journal_get_maps(fsptr, fssize, errnoptr);
+    size_t u = __myfs_journal_header_units(fsptr, fssize, errnoptr) + block;
+    if (sb->journal_blocks == 0) {
         return;
     }
-    // Moving data
-    if (size_read < (start_index + size_remove)) {
-        *errnoptr = EIO;
+    __atomic_fetch_or(logged + u / MYFS_BITMAP_WORD_BITS, ((uint64_t) 1) << (u % MYFS_BITMAP_WORD_BITS), __ATOMIC_RELEASE);
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, __myfs_get_block(fsptr, fssize, errnoptr, block), __myfs_block_size(fsptr, fssize, errnoptr));
+}
+
+/* Writeback of file data
+
+   File data does not go through the journal, but fsync still has to
+   write it to the disk. Rather than flushing the whole image, which
+   makes the kernel walk every page of the mapping, the units holding
+   file data are marked in a third bitmap as they change, and fsync
+   flushes just the marked ones, a run of adjacent units at a time.
+   The metadata needs no such map: a commit makes it durable through
+   the journal, and a checkpoint flushes the units logged since the one
+   before.
+
+   A unit is marked after the change, not before, so that a flush
+   running at the same time either catches the change or leaves the
+   mark for the next one. Images without a journal have no bitmaps and
+   are flushed whole.
+*/
+uint64_t *__myfs_sync_get_map(void *fsptr, size_t fssize, int *errnoptr) {
+    return __myfs_journal_get_maps(fsptr, fssize, errnoptr) + 2 * __myfs_journal_map_words(fsptr, fssize, errnoptr);
+}
+
+// To be called right after the len bytes of file data at ptr changed
+void __myfs_sync_mark(void *fsptr, size_t fssize, int *errnoptr, const void *ptr, size_t len) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    uint64_t *map;
+    size_t first, last;
+    if ((sb->journal_blocks == 0) || (__myfs_journal_units(fsptr, fssize, errnoptr, ptr, len, &first, &last) < 0)) {
         return;
     }
-    memmove(data + start_index, data + (start_index + size_remove), size_read - (start_index + size_remove));
-    __myfs_free_data(fsptr, fssize, errnoptr, *block);
-    if (*errnoptr != 0) {
+    map = __myfs_sync_get_map(fsptr, fssize, errnoptr);
+    for (size_t u = first; u <= last; u++) {
+        uint64_t bit = ((uint64_t) 1) << (u % MYFS_BITMAP_WORD_BITS);
+        if (((__atomic_load_n(map + u / MYFS_BITMAP_WORD_BITS, __ATOMIC_RELAXED) & bit) == 0) &&
+            ((__atomic_fetch_or(map + u / MYFS_BITMAP_WORD_BITS, bit, __ATOMIC_RELEASE) & bit) == 0)) {
+            __atomic_fetch_add(&__myfs_journal_get_state(fsptr, fssize, errnoptr)->unsynced, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Puts the marks of the units first to first + count - 1 back
+void __myfs_sync_remark(uint64_t *map, size_t first, size_t count, uint64_t *pending) {
+    for (size_t u = first; u < first + count; u++) {
+        __atomic_fetch_or(map + u / MYFS_BITMAP_WORD_BITS, ((uint64_t) 1) << (u % MYFS_BITMAP_WORD_BITS), __ATOMIC_RELAXED);
+    }
+    if (pending != NULL) {
+        __atomic_fetch_add(pending, count, __ATOMIC_RELAXED);
+    }
+}
+
+// Writes the units first to first + count - 1 back to the disk
+int __myfs_sync_run(void *fsptr, size_t fssize, int *errnoptr, size_t first, size_t count) {
+    size_t len;
+    char *start = __myfs_journal_unit(fsptr, fssize, errnoptr, first, &len);
+    char *end = __myfs_journal_unit(fsptr, fssize, errnoptr, first + count - 1, &len) + len;
+    return __myfs_journal_sync(fsptr, fssize, errnoptr, start, end - start);
+}
+
+/* Writes the units marked in map between first and last - 1 back to
+   the disk and clears their marks, adjacent units with one msync. The
+   marks of a run that could not be written are put back. pending, if
+   not NULL, is counted down by the number of marks cleared.
+*/
+int __myfs_sync_units(void *fsptr, size_t fssize, int *errnoptr, uint64_t *map, size_t first, size_t last, uint64_t *pending) {
+    size_t run = 0, count = 0;
+    size_t w = first / MYFS_BITMAP_WORD_BITS;
+    while (w * MYFS_BITMAP_WORD_BITS < last) {
+        size_t base = w * MYFS_BITMAP_WORD_BITS;
+        uint64_t mask = ~((uint64_t) 0);
+        uint64_t bits;
+        if (first > base) {
+            mask &= ~((((uint64_t) 1) << (first - base)) - 1);
+        }
+        if (last - base < MYFS_BITMAP_WORD_BITS) {
+            mask &= (((uint64_t) 1) << (last - base)) - 1;
+        }
+        bits = 0;
+        if (__atomic_load_n(map + w, __ATOMIC_RELAXED) & mask) {
+            bits = __atomic_fetch_and(map + w, ~mask, __ATOMIC_ACQUIRE) & mask;
+            if (pending != NULL) {
+                __atomic_fetch_sub(pending, __builtin_popcountll(bits), __ATOMIC_RELAXED);
+            }
+        }
+        while (bits != 0) {
+            size_t u = base + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if ((count != 0) && (run + count == u)) {
+                count++;
+                continue;
+            }
+            if ((count != 0) && (__myfs_sync_run(fsptr, fssize, errnoptr, run, count) < 0)) {
+                __myfs_sync_remark(map, run, count, pending);
+                __myfs_sync_remark(map, u, 1, pending);
+                __atomic_fetch_or(map + w, bits, __ATOMIC_RELAXED);
+                if (pending != NULL) {
+                    __atomic_fetch_add(pending, __builtin_popcountll(bits), __ATOMIC_RELAXED);
+                }
+                return -1;
+            }
+            run = u;
+            count = 1;
+        }
+        w++;
+    }
+    if ((count != 0) && (__myfs_sync_run(fsptr, fssize, errnoptr, run, count) < 0)) {
+        __myfs_sync_remark(map, run, count, pending);
+        return -1;
+    }
+    return 0;
+}
+
+// Writes all the file data changed since it was last written back to the disk
+int __myfs_sync_all(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t units = __myfs_journal_header_units(fsptr, fssize, errnoptr) + __myfs_get_fat_size(fsptr, fssize, errnoptr);
+    if (sb->journal_blocks == 0) {
+        if (msync(fsptr, fssize, MS_SYNC) != 0) {
+            *errnoptr = EIO;
+            return -1;
+        }
+        return 0;
+    }
+    return __myfs_sync_units(fsptr, fssize, errnoptr, __myfs_sync_get_map(fsptr, fssize, errnoptr), 0, units,
+                             &__myfs_journal_get_state(fsptr, fssize, errnoptr)->unsynced);
+}
+
+/* Writes file data back, starting at unit *cursor, until at least max
+   marked units are written or the end of the image is reached. *cursor
+   is left where the next call is to go on, or at 0 once the whole
+   image was covered. Needs no lock, see __myfs_writeback_implem.
+*/
+int __myfs_sync_some(void *fsptr, size_t fssize, int *errnoptr, size_t *cursor, size_t max) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t units = __myfs_journal_header_units(fsptr, fssize, errnoptr) + __myfs_get_fat_size(fsptr, fssize, errnoptr);
+    size_t w, found = 0;
+    uint64_t *map;
+    if (__atomic_load_n(&sb->journal_blocks, __ATOMIC_RELAXED) == 0) {
+        *cursor = 0;
+        return __myfs_sync_all(fsptr, fssize, errnoptr);
+    }
+    map = __myfs_sync_get_map(fsptr, fssize, errnoptr);
+    w = *cursor / MYFS_BITMAP_WORD_BITS;
+    // One range covering max marks, so that runs are not cut up
+    while ((w * MYFS_BITMAP_WORD_BITS < units) && (found < max)) {
+        found += __builtin_popcountll(__atomic_load_n(map + w, __ATOMIC_RELAXED));
+        w++;
+    }
+    if (__myfs_sync_units(fsptr, fssize, errnoptr, map, *cursor, min(w * MYFS_BITMAP_WORD_BITS, units),
+                          &__myfs_journal_get_state(fsptr, fssize, errnoptr)->unsynced) < 0) {
+        return -1;
+    }
+    *cursor = (w * MYFS_BITMAP_WORD_BITS < units) ? w * MYFS_BITMAP_WORD_BITS : 0;
+    return 0;
+}
+
+/* Flushes every unit changed since the last checkpoint and starts the
+   journal over. Must be called under the exclusive lock.
+*/
+int __myfs_journal_checkpoint(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    struct __myfs_journal_state *state;
+    if (sb->journal_blocks == 0) {
+        if (msync(fsptr, fssize, MS_SYNC) != 0) {
+            *errnoptr = EIO;
+            return -1;
+        }
+        return 0;
+    }
+    state = __myfs_journal_get_state(fsptr, fssize, errnoptr);
+    if ((__myfs_sync_units(fsptr, fssize, errnoptr, __myfs_journal_get_maps(fsptr, fssize, errnoptr), 0,
+                           __myfs_journal_header_units(fsptr, fssize, errnoptr) + __myfs_get_fat_size(fsptr, fssize, errnoptr), NULL) < 0) ||
+        (__myfs_sync_all(fsptr, fssize, errnoptr) < 0)) {
+        __atomic_store_n(&state->overflow, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    // Everything logged so far is on the disk: the records can go
+    sb->journal_gen++;
+    if (__myfs_journal_sync(fsptr, fssize, errnoptr, sb, sizeof(struct __myfs_superblock)) < 0) {
+        __atomic_store_n(&state->overflow, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    // The counters are read without the lock by __myfs_journal_due_implem
+    __atomic_store_n(&state->head, 0, __ATOMIC_RELAXED);
+    state->tid++;
+    __atomic_store_n(&state->dirty, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&state->overflow, 0, __ATOMIC_RELAXED);
+    memset(__myfs_journal_get_maps(fsptr, fssize, errnoptr), 0, 2 * __myfs_journal_map_words(fsptr, fssize, errnoptr) * sizeof(uint64_t));
+    return 0;
+}
+
+/* Makes every change since the last commit durable, see above. Must be
+   called under the exclusive lock. Turns into a checkpoint when the
+   journal is running full or an UNDO record did not fit.
+
+   A unit of a block that no longer holds metadata gets revoked instead
+   of copied, and will be logged again if it is ever touched again.
+*/
+int __myfs_journal_commit(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    struct __myfs_journal_state *state;
+    size_t words, header_units, candidates = 0, revokes = 0, redos = 0, need, start;
+    size_t desc_units = __myfs_journal_desc_units(fsptr, fssize, errnoptr);
+    uint64_t *logged, *dirty, *revoke, *redo;
+    if (sb->journal_blocks == 0) {
+        return 0;
+    }
+    state = __myfs_journal_get_state(fsptr, fssize, errnoptr);
+    if (state->overflow) {
+        return __myfs_journal_checkpoint(fsptr, fssize, errnoptr);
+    }
+    if (state->dirty == 0) {
+        return 0;
+    }
+    words = __myfs_journal_map_words(fsptr, fssize, errnoptr);
+    header_units = __myfs_journal_header_units(fsptr, fssize, errnoptr);
+    logged = __myfs_journal_get_maps(fsptr, fssize, errnoptr);
+    dirty = logged + words;
+    for (size_t w = 0; w < words; w++) {
+        candidates += __builtin_popcountll(logged[w] | dirty[w]);
+    }
+    revoke = malloc(2 * candidates * sizeof(uint64_t));
+    if (revoke == NULL) {
+        return __myfs_journal_checkpoint(fsptr, fssize, errnoptr);
+    }
+    redo = revoke + candidates;
+    for (size_t w = 0; w < words; w++) {
+        uint64_t bits = logged[w] | dirty[w];
+        while (bits != 0) {
+            size_t u = w * MYFS_BITMAP_WORD_BITS + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if ((u >= header_units) && (__myfs_get_fat(fsptr, fssize, errnoptr, u - header_units)->is_used != MYFS_FAT_META)) {
+                revoke[revokes++] = u;
+            } else if ((dirty[w] >> (u % MYFS_BITMAP_WORD_BITS)) & 1) {
+                redo[redos++] = u;
+            }
+        }
+    }
+    need = (revokes + desc_units - 1) / desc_units + redos + (redos + desc_units - 1) / desc_units;
+    if (state->head + need > sb->journal_blocks / 4 * 3) {
+        free(revoke);
+        return __myfs_journal_checkpoint(fsptr, fssize, errnoptr);
+    }
+    start = state->head;
+    for (size_t i = 0; i < revokes; i += desc_units) {
+        size_t n = min(revokes - i, desc_units);
+        __myfs_journal_append(fsptr, fssize, errnoptr, MYFS_JOURNAL_REVOKE, revoke + i, n, (redos == 0) && (i + n == revokes));
+    }
+    for (size_t i = 0; i < redos; i += desc_units) {
+        size_t n = min(redos - i, desc_units);
+        __myfs_journal_append(fsptr, fssize, errnoptr, MYFS_JOURNAL_REDO, redo + i, n, i + n == redos);
+    }
+    if (__myfs_journal_sync(fsptr, fssize, errnoptr, __myfs_get_block(fsptr, fssize, errnoptr, sb->journal_block + start),
+                            (state->head - start) * __myfs_block_size(fsptr, fssize, errnoptr)) < 0) {
+        free(revoke);
+        return -1;
+    }
+    memset(dirty, 0, words * sizeof(uint64_t));
+    for (size_t i = 0; i < revokes; i++) {
+        logged[revoke[i] / MYFS_BITMAP_WORD_BITS] &= ~(((uint64_t) 1) << (revoke[i] % MYFS_BITMAP_WORD_BITS));
+    }
+    __atomic_store_n(&state->dirty, 0, __ATOMIC_RELAXED);
+    state->tid++;
+    free(revoke);
+    return 0;
+}
+
+/* A unit revoked by a committed REVOKE record, and the last record
+   that revoked it.
+*/
+struct __myfs_journal_revoke {
+    uint64_t unit;
+    size_t record;
+};
+
+int __myfs_journal_revoke_cmp(const void *a, const void *b) {
+    const struct __myfs_journal_revoke *x = a, *y = b;
+    if (x->unit != y->unit) {
+        return (x->unit < y->unit) ? -1 : 1;
+    }
+    return (x->record < y->record) ? -1 : (x->record > y->record);
+}
+
+// Returns 1 if the copy of unit u in record number record is revoked
+int __myfs_journal_revoked(struct __myfs_journal_revoke *revokes, size_t count, uint64_t u, size_t record) {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (revokes[mid].unit < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    // The entries for u are sorted by record, the last one counts
+    while ((lo < count) && (revokes[lo].unit == u)) {
+        if (revokes[lo].record > record) {
+            return 1;
+        }
+        lo++;
+    }
+    return 0;
+}
+
+// Copies the units of the record at desc back into the image
+void __myfs_journal_apply(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_journal_desc *desc, size_t record,
+                          struct __myfs_journal_revoke *revokes, size_t revoke_count, size_t units) {
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    char *copy = (char *) desc + block_size;
+    for (size_t i = 0; i < desc->count; i++, copy += block_size) {
+        size_t len;
+        char *unit;
+        if ((desc->units[i] >= units) || __myfs_journal_revoked(revokes, revoke_count, desc->units[i], record)) {
+            continue;
+        }
+        unit = __myfs_journal_unit(fsptr, fssize, errnoptr, desc->units[i], &len);
+        memcpy(unit, copy, len);
+    }
+}
+
+/* Returns the number of blocks of the record at block pos of the
+   journal, or 0 if there is none: it has to carry the current
+   journal_gen and its checksum has to match. The checksum is taken
+   with the check itself as 0, without writing it, so that the journal
+   can be looked at without changing the image.
+*/
+size_t __myfs_journal_record(void *fsptr, size_t fssize, int *errnoptr, size_t pos) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    struct __myfs_journal_desc *desc = __myfs_get_block(fsptr, fssize, errnoptr, sb->journal_block + pos);
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    size_t blocks = 1 + ((desc->type == MYFS_JOURNAL_REVOKE) ? 0 : desc->count);
+    uint64_t zero = 0, hash;
+    if ((desc->magic != MYFS_JOURNAL_MAGIC) || (desc->generation != sb->journal_gen) ||
+        (desc->type < MYFS_JOURNAL_UNDO) || (desc->type > MYFS_JOURNAL_REVOKE) ||
+        (desc->count > __myfs_journal_desc_units(fsptr, fssize, errnoptr)) || (pos + blocks > sb->journal_blocks)) {
+        return 0;
+    }
+    hash = __myfs_journal_check(desc, offsetof(struct __myfs_journal_desc, check), MYFS_HASH_INIT);
+    hash = __myfs_journal_check(&zero, sizeof(uint64_t), hash);
+    hash = __myfs_journal_check(desc->units, blocks * block_size - offsetof(struct __myfs_journal_desc, units), hash);
+    return (hash == desc->check) ? blocks : 0;
+}
+
+/* Brings the metadata back to how it was at the end of the last
+   commit, see above. The first block that does not hold a record ends
+   the journal.
+*/
+int __myfs_journal_replay(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    /* A record may be for a block the image grew by, as long as it is in
+       the mapping. The slices of the FAT the superblock knows of may be
+       behind the records, so they do not count.
+    */
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    size_t header = __myfs_layout_header(sb->block_capacity);
+    size_t units = __myfs_journal_header_units(fsptr, fssize, errnoptr) + ((fssize > header) ? (fssize - header) / block_size : 0);
+    size_t journal_blocks = sb->journal_blocks, pos = 0, count = 0, committed = 0, revoke_count = 0;
+    struct __myfs_journal_revoke *revokes = NULL;
+    size_t *records = malloc(journal_blocks * sizeof(size_t));
+    if (records == NULL) {
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    while (pos < journal_blocks) {
+        struct __myfs_journal_desc *desc = __myfs_get_block(fsptr, fssize, errnoptr, sb->journal_block + pos);
+        size_t blocks = __myfs_journal_record(fsptr, fssize, errnoptr, pos);
+        if (blocks == 0) {
+            break;
+        }
+        records[count++] = pos;
+        if (desc->last) {
+            committed = count;
+        }
+        if (desc->type == MYFS_JOURNAL_REVOKE) {
+            revoke_count += desc->count;
+        }
+        pos += blocks;
+    }
+    if (revoke_count > 0) {
+        revokes = malloc(revoke_count * sizeof(struct __myfs_journal_revoke));
+        if (revokes == NULL) {
+            free(records);
+            *errnoptr = ENOMEM;
+            return -1;
+        }
+    }
+    // Only the revokes of complete commits count
+    revoke_count = 0;
+    for (size_t r = 0; r < committed; r++) {
+        struct __myfs_journal_desc *desc = __myfs_get_block(fsptr, fssize, errnoptr, sb->journal_block + records[r]);
+        if (desc->type == MYFS_JOURNAL_REVOKE) {
+            for (size_t i = 0; i < desc->count; i++) {
+                revokes[revoke_count].unit = desc->units[i];
+                revokes[revoke_count].record = r;
+                revoke_count++;
+            }
+        }
+    }
+    if (revoke_count > 0) {
+        qsort(revokes, revoke_count, sizeof(struct __myfs_journal_revoke), __myfs_journal_revoke_cmp);
+    }
+    for (size_t r = 0; r < count; r++) {
+        struct __myfs_journal_desc *desc = __myfs_get_block(fsptr, fssize, errnoptr, sb->journal_block + records[r]);
+        if (desc->type == MYFS_JOURNAL_UNDO) {
+            __myfs_journal_apply(fsptr, fssize, errnoptr, desc, r, revokes, revoke_count, units);
+        }
+    }
+    for (size_t r = 0; r < committed; r++) {
+        struct __myfs_journal_desc *desc = __myfs_get_block(fsptr, fssize, errnoptr, sb->journal_block + records[r]);
+        if (desc->type == MYFS_JOURNAL_REDO) {
+            __myfs_journal_apply(fsptr, fssize, errnoptr, desc, r, revokes, revoke_count, units);
+        }
+    }
+    free(revokes);
+    free(records);
+    return 0;
+}
+
+/* Called before block is freed: a block of metadata is logged first,
+   see above.
+*/
+void __myfs_journal_release(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
+    if (__myfs_get_fat(fsptr, fssize, errnoptr, block)->is_used == MYFS_FAT_META) {
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, __myfs_get_block(fsptr, fssize, errnoptr, block), __myfs_block_size(fsptr, fssize, errnoptr));
+    }
+}
+
+/* Marks a block as in use in both the bitmap and the FAT.
+   Returns 0 if it was free before, or -1 if somebody else has it.
+*/
+int __myfs_claim_block(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
+    struct __myfs_fat_entry* fat = __myfs_get_fat(fsptr, fssize, errnoptr, block);
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, __myfs_bitmap_word(fsptr, fssize, errnoptr, block), sizeof(uint64_t));
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, fat, MYFS_FAT_SIZE);
+    if (__myfs_bitmap_set(fsptr, fssize, errnoptr, block)) {
+        return -1;
+    }
+    __atomic_fetch_sub(&__myfs_get_superblock(fsptr, fssize, errnoptr)->free_count, 1, __ATOMIC_RELAXED);
+    fat->is_used = 1;
+    return 0;
+}
+
+/* Marks a block as free in both the bitmap and the FAT. The FAT entry
+   is cleared first: once the bit is clear, the block may be handed
+   to another writer straight away.
+*/
+void __myfs_release_block(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
+    struct __myfs_fat_entry* fat = __myfs_get_fat(fsptr, fssize, errnoptr, block);
+    __myfs_journal_release(fsptr, fssize, errnoptr, block);
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, fat, MYFS_FAT_SIZE);
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, __myfs_bitmap_word(fsptr, fssize, errnoptr, block), sizeof(uint64_t));
+    fat->used_size = 0;
+    fat->is_used = 0;
+    fat->next_block = 0;
+    if (__myfs_bitmap_clear(fsptr, fssize, errnoptr, block)) {
+        __atomic_fetch_add(&__myfs_get_superblock(fsptr, fssize, errnoptr)->free_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Number of blocks a new image of fssize bytes gets, with room in the
+   FAT for as many blocks as an image of max_size bytes holds, but
+   taking no more than a 1/MYFS_GROW_HEADER of the image for that. The
+   number of FAT entries goes into *capacity, a multiple of
+   MYFS_BITMAP_WORD_BITS so that the slices added later line up with the
+   words of the bitmap.
+*/
+size_t __myfs_layout_fat(size_t fssize, size_t max_size, size_t block_size, size_t *capacity) {
+    size_t room = fssize / MYFS_GROW_HEADER;
+    *capacity = __myfs_layout_capacity(max(max_size, fssize), block_size);
+    if (room > MYFS_HEADER_SIZE + sizeof(uint64_t)) {
+        *capacity = min(*capacity, (room - MYFS_HEADER_SIZE - sizeof(uint64_t)) * 8 / (8 * MYFS_FAT_SIZE + 1));
+    }
+    *capacity = max(*capacity, __myfs_layout_capacity(fssize, block_size));
+    *capacity = (*capacity + MYFS_BITMAP_WORD_BITS - 1) / MYFS_BITMAP_WORD_BITS * MYFS_BITMAP_WORD_BITS;
+    return __myfs_layout_blocks(fssize, *capacity, block_size);
+}
+
+// Slots of the lookup cache for fat_size blocks: about one a block, a power of two, none for tiny images
+size_t __myfs_layout_slots(size_t fat_size) {
+    size_t slots = 0;
+    if (fat_size >= 64) {
+        slots = 16;
+        while ((slots * 2 <= fat_size) && (slots * 2 <= MYFS_DCACHE_MAX_SLOTS)) {
+            slots *= 2;
+        }
+    }
+    return slots;
+}
+
+// Inodes in the table for fat_size blocks: one every MYFS_INODE_RATIO bytes, the root at least
+size_t __myfs_layout_inodes(size_t fat_size, size_t block_size) {
+    return min(max(fat_size * block_size / MYFS_INODE_RATIO, (size_t) MYFS_ROOT_INODE + 1), (size_t) UINT32_MAX);
+}
+
+/* Returns the smallest size __myfs_build makes a filesystem of, with
+   blocks of block_size bytes and room to grow to max_size bytes: one
+   with a block for data besides block 0, the lookup cache and the
+   inode table. Returns 0 if block_size is not a valid block size.
+*/
+size_t __myfs_min_size_implem(size_t max_size, size_t block_size) {
+    size_t size, capacity, fat_size, meta;
+    if ((block_size < MYFS_MIN_BLOCK_SIZE) || (block_size > MYFS_MAX_BLOCK_SIZE) || ((block_size & (block_size - 1)) != 0)) {
+        return 0;
+    }
+    for (size = MYFS_HEADER_SIZE + block_size; ; size += block_size) {
+        fat_size = __myfs_layout_fat(size, max_size, block_size, &capacity);
+        meta = 1 + (__myfs_layout_slots(fat_size) * sizeof(struct __myfs_dcache_slot) + block_size - 1) / block_size +
+               (__myfs_layout_inodes(fat_size, block_size) * sizeof(struct __myfs_inode) + block_size - 1) / block_size;
+        if ((fat_size != 0) && (meta < fat_size)) {
+            return size;
+        }
+    }
+}
+
+/* BLOCK LAYOUT
+   Builds the filesystem.
+
+   magic | superblock | free-space bitmap | FAT | blocks
+
+   Block 0 is never handed out, so that 0 can stand for "no block".
+
+   Blocks are block_size bytes, a power of two from MYFS_MIN_BLOCK_SIZE
+   to MYFS_MAX_BLOCK_SIZE, and everything after the superblock is laid
+   out in them; the inode table gets an inode for every
+   MYFS_INODE_RATIO bytes of blocks, whatever their size.
+
+   The bitmap and the FAT have room for as many blocks as an image of
+   max_size bytes holds, so that the image can grow up to that without
+   block 0 moving, see __myfs_grow. They take at most a
+   1/MYFS_GROW_HEADER of the image as built, though; past that, the
+   image grows them by another slice. The part of them past the last
+   block is not touched until the image grows, so a backup-file does
+   not store it.
+*/
+void __myfs_build(void *fsptr, size_t fssize, int *errnoptr, size_t max_size, size_t block_size) {
+    unsigned long long *ul_fsptr = fsptr;
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    if ((block_size < MYFS_MIN_BLOCK_SIZE) || (block_size > MYFS_MAX_BLOCK_SIZE) || ((block_size & (block_size - 1)) != 0)) {
+        *errnoptr = EINVAL;
+        return;
+    }
+    size_t capacity;
+    size_t fat_size = __myfs_layout_fat(fssize, max_size, block_size, &capacity);
+    // Everything that finds its way around the image goes by these three
+    sb->block_size = block_size;
+    sb->block_capacity = capacity;
+    sb->block_count = fat_size;
+    sb->fat_capacity = capacity;
+    sb->fat_slices = 1;
+    sb->fat_first[0] = 0;
+    sb->fat_block[0] = 0;
+    // The lookup cache gets about a slot for every block, in blocks right after block 0
+    size_t slots = __myfs_layout_slots(fat_size);
+    size_t cache_blocks = (slots * sizeof(struct __myfs_dcache_slot) + block_size - 1) / block_size;
+    // The inode table comes right after the cache
+    size_t inodes = __myfs_layout_inodes(fat_size, block_size);
+    size_t inode_blocks = (inodes * sizeof(struct __myfs_inode) + block_size - 1) / block_size;
+    // Then the journal and its state; images too small for them go without
+    size_t journal_blocks = min(max(fat_size / MYFS_JOURNAL_RATIO, MYFS_JOURNAL_MIN_BLOCKS), MYFS_JOURNAL_MAX_BLOCKS);
+    size_t state_blocks = 1 + (3 * __myfs_journal_map_words(fsptr, fssize, errnoptr) * sizeof(uint64_t) + block_size - 1) / block_size;
+    if (1 + cache_blocks + inode_blocks + journal_blocks + state_blocks >= fat_size) {
+        journal_blocks = 0;
+        state_blocks = 0;
+    }
+    if ((fat_size == 0) || (1 + cache_blocks + inode_blocks >= fat_size)) {
+        *errnoptr = ENOSPC;
+        return;
+    }
+    ul_fsptr[0] = MYFS_MAGIC;
+    struct __myfs_fat_entry* fat_fsptr = __myfs_get_fat(fsptr, fssize, errnoptr, 0);
+    for (size_t i = 0; i < fat_size; i++) {
+        fat_fsptr[i].used_size = 0;
+        fat_fsptr[i].is_used = 0;
+        fat_fsptr[i].next_block = 0;
+    }
+    uint64_t *bitmap = __myfs_get_bitmap(fsptr, fssize, errnoptr);
+    size_t words = __myfs_get_bitmap_words(fsptr, fssize, errnoptr);
+    memset(bitmap, 0, words * sizeof(uint64_t));
+    // Bits past the last block are marked used so they are never handed out
+    if (fat_size % MYFS_BITMAP_WORD_BITS != 0) {
+        bitmap[words - 1] = ~((((uint64_t) 1) << (fat_size % MYFS_BITMAP_WORD_BITS)) - 1);
+    }
+    sb->version = MYFS_VERSION;
+    sb->free_count = fat_size - 1;
+    fat_fsptr[0].used_size = 0;
+    fat_fsptr[0].is_used = 1;
+    __myfs_bitmap_set(fsptr, fssize, errnoptr, 0);
+    sb->dcache_block = 1;
+    sb->dcache_slots = slots;
+    sb->dcache_epoch = 1;
+    sb->inode_groups = 1;
+    sb->inode_first[0] = 0;
+    sb->inode_block[0] = sb->dcache_block + cache_blocks;
+    sb->inode_count = inodes;
+    sb->journal_block = sb->inode_block[0] + inode_blocks;
+    sb->journal_blocks = 0;
+    sb->journal_state_block = sb->journal_block + journal_blocks;
+    sb->journal_gen = 1;
+    sb->journal_next_blocks = 0;
+    sb->journal_old_blocks = 0;
+    for (size_t i = 0; i < cache_blocks + inode_blocks + journal_blocks + state_blocks; i++) {
+        __myfs_claim_block(fsptr, fssize, errnoptr, sb->dcache_block + i);
+    }
+    for (size_t i = 0; i < inode_blocks; i++) {
+        fat_fsptr[sb->inode_block[0] + i].is_used = MYFS_FAT_META;
+    }
+    memset(__myfs_get_block(fsptr, fssize, errnoptr, sb->dcache_block), 0, (cache_blocks + inode_blocks) * block_size);
+    if (journal_blocks != 0) {
+        // An empty first block ends the journal right away
+        memset(__myfs_get_block(fsptr, fssize, errnoptr, sb->journal_block), 0, block_size);
+        memset(__myfs_journal_get_state(fsptr, fssize, errnoptr), 0, state_blocks * block_size);
+        pthread_mutex_init(&__myfs_journal_get_state(fsptr, fssize, errnoptr)->lock, NULL);
+    }
+    sb->next_free = sb->journal_state_block + state_blocks;
+    sb->frag_list = 0;
+    sb->frag_lock = 0;
+    sb->shared_count = 0;
+    // Inode 0 is never handed out, like block 0
+    ((struct __myfs_inode *) __myfs_get_block(fsptr, fssize, errnoptr, sb->inode_block[0]))->nlink = 1;
+    struct __myfs_inode *root = __myfs_get_inode(fsptr, fssize, errnoptr, MYFS_ROOT_INODE);
+    root->file_type = DIRECTORY;
+    root->nlink = 1;
+    root->map.flags = MYFS_MAP_FIXED | MYFS_MAP_META;
+    clock_gettime(CLOCK_REALTIME, &root->atime);
+    root->mtime = root->atime;
+    sb->inode_free = inodes - 2;
+    sb->next_inode = MYFS_ROOT_INODE + 1;
+    memset(&sb->root, 0, sizeof(struct __myfs_dir_entry));
+    sb->root.inode = MYFS_ROOT_INODE;
+    // Changes are journaled from here on
+    sb->journal_blocks = journal_blocks;
+}
+
+/* Checks if the fs is built.
+   If it is invalid, then try to build it, with no room to grow and
+   blocks of MYFS_DEFAULT_BLOCK_SIZE bytes.
+*/
+void __myfs_try_build(void *fsptr, size_t fssize, int *errnoptr) {
+    unsigned long long *ul_fsptr = fsptr;
+    if (ul_fsptr[0] == MYFS_MAGIC) {
+        // Already set up, do nothing unless it is a layout we do not know
+        if (__myfs_get_superblock(fsptr, fssize, errnoptr)->version != MYFS_VERSION) {
+            *errnoptr = EFAULT;
+        }
         return;
     }
-    struct __myfs_fat_entry* fat = __myfs_get_fat(fsptr, fssize, errnoptr, *block);
-    if (*errnoptr != 0) {
+    __myfs_build(fsptr, fssize, errnoptr, fssize, MYFS_DEFAULT_BLOCK_SIZE);
+}
+
+/* Growing the image
+
+   The image grows at its end: once fssize reaches further than the
+   last block, the blocks in between are taken in. Past what the bitmap
+   and the FAT have room for, they get another slice, at least as large
+   as all the ones before, until there are MYFS_FAT_SLICES. A slice is
+   kept in the first of the blocks it is for, and the state of the
+   journal, whose bitmaps need a bit more for every block, moves to a
+   larger place right after it. Part of the new blocks goes to a new
+   group of inodes, so that the inode table grows along with the
+   blocks, until there are MYFS_INODE_GROUPS groups. Once the image is
+   big enough for a journal twice the size of its own, another part is
+   set aside for one, which is taken up at the next checkpoint, see
+   __myfs_journal_switch: a journal too small for the image overflows
+   all the time. The lookup cache keeps the size it was built with.
+
+   Nothing past the last block can be trusted: it is what the
+   backup-file was extended with, but it may as well be left over from
+   a growth that a crash undid. So the new parts of the bitmap, the FAT
+   and the inode table are cleared first, and written straight to the
+   disk rather than through the journal, which would need a copy of
+   them all. Only the units they share with the old end of the image
+   are journaled, along with the superblock, which takes the blocks in.
+   A crash before the next commit leaves the image as small as it was.
+
+   Must be called under the exclusive lock.
+*/
+int __myfs_grow(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t old = sb->block_count, first = sb->fat_capacity;
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    size_t header = __myfs_layout_header(sb->block_capacity);
+    size_t count = (fssize > header) ? (fssize - header) / block_size : 0;
+    size_t slice = 0, slice_blocks = 0, state_blocks = 0, base = old, old_words = 0, new_words = 0;
+    size_t inodes = 0, inode_blocks = 0, journal_blocks = 0, b, n;
+    uint64_t *word = NULL;
+    uint64_t saved = 0;
+    if (count > first) {
+        slice = (max(count - first, first) + MYFS_BITMAP_WORD_BITS - 1) / MYFS_BITMAP_WORD_BITS * MYFS_BITMAP_WORD_BITS;
+        slice_blocks = __myfs_fat_slice_blocks(slice, block_size);
+        if (sb->journal_blocks != 0) {
+            old_words = __myfs_journal_map_words(fsptr, fssize, errnoptr);
+            new_words = old_words + slice / MYFS_BITMAP_WORD_BITS;
+            state_blocks = 1 + (3 * new_words * sizeof(uint64_t) + block_size - 1) / block_size;
+        }
+        // Without another slice, the image only grows as far as the ones it has
+        if ((sb->fat_slices == MYFS_FAT_SLICES) || (first + slice_blocks + state_blocks >= count)) {
+            count = first;
+            slice = 0;
+            slice_blocks = 0;
+            state_blocks = 0;
+        } else {
+            base = first + slice_blocks + state_blocks;
+        }
+    }
+    if (count <= old) {
+        return 0;
+    }
+    if (sb->inode_groups < MYFS_INODE_GROUPS) {
+        inodes = min((count - old) * block_size / MYFS_INODE_RATIO, (size_t) (UINT32_MAX - sb->inode_count));
+        inode_blocks = (inodes * sizeof(struct __myfs_inode) + block_size - 1) / block_size;
+        if (inode_blocks >= count - base) {
+            inodes = 0;
+            inode_blocks = 0;
+        }
+    }
+    if ((sb->journal_blocks != 0) && (sb->journal_next_blocks == 0) && (sb->journal_old_blocks == 0)) {
+        journal_blocks = min(max(count / MYFS_JOURNAL_RATIO, MYFS_JOURNAL_MIN_BLOCKS), MYFS_JOURNAL_MAX_BLOCKS);
+        if ((journal_blocks < 2 * sb->journal_blocks) || (2 * (inode_blocks + journal_blocks) > count - base)) {
+            journal_blocks = 0;
+        }
+    }
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, sb, sizeof(struct __myfs_superblock));
+    // The last word of the bitmap and entry of the FAT may share a unit with the new ones
+    if (old < first) {
+        word = __myfs_bitmap_word(fsptr, fssize, errnoptr, old);
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, word, sizeof(uint64_t));
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, __myfs_get_fat(fsptr, fssize, errnoptr, old), MYFS_FAT_SIZE);
+        saved = *word;
+    }
+    // Nothing is journaled from here until the state of the journal has moved
+    if (slice != 0) {
+        sb->fat_first[sb->fat_slices] = first;
+        sb->fat_block[sb->fat_slices] = first;
+        sb->fat_slices++;
+        sb->fat_capacity = first + slice;
+    }
+    for (b = old; b < count; b += n) {
+        uint64_t *bits = __myfs_bitmap_word(fsptr, fssize, errnoptr, b);
+        size_t words;
+        n = min(__myfs_fat_span(fsptr, fssize, errnoptr, b), count - b);
+        words = (b + n + MYFS_BITMAP_WORD_BITS - 1) / MYFS_BITMAP_WORD_BITS - b / MYFS_BITMAP_WORD_BITS;
+        bits[0] &= (((uint64_t) 1) << (b % MYFS_BITMAP_WORD_BITS)) - 1;
+        memset(bits + 1, 0, (words - 1) * sizeof(uint64_t));
+        // Bits past the last block are marked used so they are never handed out
+        if ((b + n) % MYFS_BITMAP_WORD_BITS != 0) {
+            bits[words - 1] |= ~((((uint64_t) 1) << ((b + n) % MYFS_BITMAP_WORD_BITS)) - 1);
+        }
+        memset(__myfs_get_fat(fsptr, fssize, errnoptr, b), 0, n * MYFS_FAT_SIZE);
+    }
+    // The slice and the state of the journal go into the first of the blocks of the slice
+    for (size_t i = first; i < base; i++) {
+        __myfs_bitmap_set(fsptr, fssize, errnoptr, i);
+        __myfs_get_fat(fsptr, fssize, errnoptr, i)->is_used = (i < first + slice_blocks) ? MYFS_FAT_META : 1;
+    }
+    // The new inodes go after them, or into the first of the new blocks
+    for (size_t i = base; i < base + inode_blocks; i++) {
+        __myfs_bitmap_set(fsptr, fssize, errnoptr, i);
+        __myfs_get_fat(fsptr, fssize, errnoptr, i)->is_used = MYFS_FAT_META;
+    }
+    memset(__myfs_get_block(fsptr, fssize, errnoptr, base), 0, inode_blocks * block_size);
+    // And the new journal after them
+    for (size_t i = base + inode_blocks; i < base + inode_blocks + journal_blocks; i++) {
+        __myfs_bitmap_set(fsptr, fssize, errnoptr, i);
+        __myfs_get_fat(fsptr, fssize, errnoptr, i)->is_used = 1;
+    }
+    for (b = old; b < count; b += n) {
+        n = min(__myfs_fat_span(fsptr, fssize, errnoptr, b), count - b);
+        if ((__myfs_journal_sync(fsptr, fssize, errnoptr, __myfs_bitmap_word(fsptr, fssize, errnoptr, b),
+                                 ((b + n + MYFS_BITMAP_WORD_BITS - 1) / MYFS_BITMAP_WORD_BITS - b / MYFS_BITMAP_WORD_BITS) * sizeof(uint64_t)) < 0) ||
+            (__myfs_journal_sync(fsptr, fssize, errnoptr, __myfs_get_fat(fsptr, fssize, errnoptr, b), n * MYFS_FAT_SIZE) < 0)) {
+            break;
+        }
+    }
+    if ((b < count) ||
+        ((inode_blocks != 0) &&
+         (__myfs_journal_sync(fsptr, fssize, errnoptr, __myfs_get_block(fsptr, fssize, errnoptr, base), inode_blocks * block_size) < 0))) {
+        // The blocks are not there yet, and must not be handed out
+        if (word != NULL) {
+            *word = saved;
+        }
+        if (slice != 0) {
+            sb->fat_slices--;
+            sb->fat_capacity = first;
+        }
+        return -1;
+    }
+    if (state_blocks != 0) {
+        struct __myfs_journal_state *state = __myfs_journal_get_state(fsptr, fssize, errnoptr);
+        struct __myfs_journal_state *moved = __myfs_get_block(fsptr, fssize, errnoptr, first + slice_blocks);
+        uint64_t *maps = __myfs_journal_get_maps(fsptr, fssize, errnoptr);
+        uint64_t *moved_maps = __myfs_get_block(fsptr, fssize, errnoptr, first + slice_blocks + 1);
+        size_t state_block = sb->journal_state_block;
+        size_t old_state_blocks = 1 + (3 * old_words * sizeof(uint64_t) + block_size - 1) / block_size;
+        memcpy(moved, state, sizeof(struct __myfs_journal_state));
+        pthread_mutex_init(&moved->lock, NULL);
+        for (size_t m = 0; m < 3; m++) {
+            memcpy(moved_maps + m * new_words, maps + m * old_words, old_words * sizeof(uint64_t));
+            memset(moved_maps + m * new_words + old_words, 0, (new_words - old_words) * sizeof(uint64_t));
+        }
+        // __myfs_journal_due_implem reads the state without a lock
+        __atomic_store_n(&sb->journal_state_block, first + slice_blocks, __ATOMIC_RELEASE);
+        for (size_t i = 0; i < old_state_blocks; i++) {
+            __myfs_release_block(fsptr, fssize, errnoptr, state_block + i);
+        }
+    }
+    // getattr runs without a lock: the inodes and the blocks are filled in before they count
+    if (inodes != 0) {
+        sb->inode_first[sb->inode_groups] = sb->inode_count;
+        sb->inode_block[sb->inode_groups] = base;
+        __atomic_store_n(&sb->inode_groups, sb->inode_groups + 1, __ATOMIC_RELEASE);
+        sb->inode_free += inodes;
+        __atomic_store_n(&sb->inode_count, sb->inode_count + inodes, __ATOMIC_RELEASE);
+    }
+    if (journal_blocks != 0) {
+        sb->journal_next_block = base + inode_blocks;
+        sb->journal_next_blocks = journal_blocks;
+    }
+    __atomic_fetch_add(&sb->free_count, count - old - slice_blocks - state_blocks - inode_blocks - journal_blocks, __ATOMIC_RELAXED);
+    __atomic_store_n(&sb->next_free, base + inode_blocks + journal_blocks, __ATOMIC_RELAXED);
+    __atomic_store_n(&sb->block_count, count, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* allocates block and returns the allocated block
+
+   Next-fit over the bitmap: starts at the word holding the cursor,
+   skips full words with a single compare and wraps around once.
+   It takes no lock: a free bit is claimed with an atomic or, and a
+   caller that loses the race for it just looks at the word again.
+*/
+size_t __myfs_alloc_block(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t fat_size = __myfs_get_fat_size(fsptr, fssize, errnoptr);
+    size_t words = __myfs_get_bitmap_words(fsptr, fssize, errnoptr);
+    if (__myfs_get_num_free_blocks(fsptr, fssize, errnoptr) == 0) {
+        *errnoptr = ENOSPC;
+        return 0;
+    }
+    size_t start = __atomic_load_n(&sb->next_free, __ATOMIC_RELAXED);
+    if (start >= fat_size) {
+        start = 0;
+    }
+    size_t word = start / MYFS_BITMAP_WORD_BITS;
+    // Ignore the blocks before the cursor in the first word
+    uint64_t mask = (((uint64_t) 1) << (start % MYFS_BITMAP_WORD_BITS)) - 1;
+    for (size_t n = 0; n <= words; n++) {
+        uint64_t *bitmap = __myfs_bitmap_word(fsptr, fssize, errnoptr, word * MYFS_BITMAP_WORD_BITS);
+        uint64_t bits = __atomic_load_n(bitmap, __ATOMIC_ACQUIRE) | mask;
+        while (bits != ~((uint64_t) 0)) {
+            size_t block = word * MYFS_BITMAP_WORD_BITS + __builtin_ctzll(~bits);
+            if (__myfs_claim_block(fsptr, fssize, errnoptr, block) == 0) {
+                __atomic_store_n(&sb->next_free, block + 1, __ATOMIC_RELAXED);
+                return block;
+            }
+            bits = __atomic_load_n(bitmap, __ATOMIC_ACQUIRE) | mask;
+        }
+        mask = 0;
+        word++;
+        if (word == words) {
+            word = 0;
+        }
+    }
+    *errnoptr = ENOSPC;
+    return 0;
+}
+
+/* Claims up to want free blocks in a row, starting at block, which
+   has to be free for anything to be claimed at all. The run ends at
+   the first block in use. Like __myfs_alloc_block, it takes no lock:
+   a word of the bitmap is claimed with a compare-and-swap, so writers
+   racing for the same blocks each get a part of them.
+   Returns the number of blocks claimed.
+*/
+size_t __myfs_claim_run(void *fsptr, size_t fssize, int *errnoptr, size_t block, size_t want) {
+    size_t fat_size = __myfs_get_fat_size(fsptr, fssize, errnoptr);
+    size_t got = 0;
+    if (block >= fat_size) {
+        return 0;
+    }
+    want = min(want, fat_size - block);
+    while (got < want) {
+        size_t b = block + got;
+        size_t shift = b % MYFS_BITMAP_WORD_BITS;
+        size_t n = min(want - got, MYFS_BITMAP_WORD_BITS - shift);
+        uint64_t *word = __myfs_bitmap_word(fsptr, fssize, errnoptr, b);
+        uint64_t old, mask;
+        size_t run;
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, word, sizeof(uint64_t));
+        old = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+        do {
+            // The free bits in a row from b on, at most n of them
+            uint64_t used = old >> shift;
+            run = (used == 0) ? MYFS_BITMAP_WORD_BITS - shift : (size_t) __builtin_ctzll(used);
+            run = min(run, n);
+            if (run == 0) {
+                break;
+            }
+            mask = (run == MYFS_BITMAP_WORD_BITS) ? ~((uint64_t) 0) : ((((uint64_t) 1) << run) - 1) << shift;
+        } while (!__atomic_compare_exchange_n(word, &old, old | mask, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+        if (run == 0) {
+            break;
+        }
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, __myfs_get_fat(fsptr, fssize, errnoptr, b), run * MYFS_FAT_SIZE);
+        for (size_t i = 0; i < run; i++) {
+            __myfs_get_fat(fsptr, fssize, errnoptr, b + i)->is_used = 1;
+        }
+        got += run;
+        if (run < n) {
+            break;
+        }
+    }
+    __atomic_fetch_sub(&__myfs_get_superblock(fsptr, fssize, errnoptr)->free_count, got, __ATOMIC_RELAXED);
+    return got;
+}
+
+/* Looks for a window of MYFS_ALLOC_WINDOW free blocks, aligned to its
+   size, starting at the one after block and looking at no more than
+   MYFS_ALLOC_SCAN of them. Returns the first block of the window, or
+   0 if there is none.
+*/
+size_t __myfs_find_window(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
+    size_t windows = __myfs_get_fat_size(fsptr, fssize, errnoptr) / MYFS_ALLOC_WINDOW;
+    size_t words = MYFS_ALLOC_WINDOW / MYFS_BITMAP_WORD_BITS;
+    size_t w = (block + MYFS_ALLOC_WINDOW - 1) / MYFS_ALLOC_WINDOW;
+    for (size_t n = 0; n < min(windows, MYFS_ALLOC_SCAN); n++, w++) {
+        size_t i;
+        if (w >= windows) {
+            w = 0;
+        }
+        for (i = 0; i < words; i++) {
+            if (__atomic_load_n(__myfs_bitmap_word(fsptr, fssize, errnoptr, (w * words + i) * MYFS_BITMAP_WORD_BITS), __ATOMIC_RELAXED) != 0) {
+                break;
+            }
+        }
+        if (i == words) {
+            return w * MYFS_ALLOC_WINDOW;
+        }
+    }
+    return 0;
+}
+
+/* Allocates a run of up to want blocks for the data of a file, and
+   puts the number of blocks it got into *got. goal is the block right
+   after the block of the file that comes before, or 0 if there is
+   none, and the run starts there whenever it can, so that a file
+   written front to back ends up in one piece.
+
+   Writers that append to several files at once would still take
+   turns at the blocks after the next-fit cursor and interleave their
+   files block by block. So the image is cut into windows of
+   MYFS_ALLOC_WINDOW blocks, and the cursor hands them out: a file
+   whose goal is taken, or that needs more than one block, gets a
+   free window of its own and the cursor moves past it, so that the
+   next writer looks for its window further on. Within its window, a
+   file just continues at its goal. At the end of the window, it only
+   carries on into the next one if the cursor has not handed that out
+   to somebody else yet. The windows are not written down anywhere;
+   another file may still take blocks from one if it has to.
+   Small files, which take one block at a time, are packed together
+   after the cursor as before.
+
+   Returns the first block of the run. On failure, *errnoptr is set to
+   ENOSPC and 0 is returned.
+*/
+size_t __myfs_alloc_run(void *fsptr, size_t fssize, int *errnoptr, size_t goal, size_t want, size_t *got) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t cursor = __atomic_load_n(&sb->next_free, __ATOMIC_RELAXED);
+    size_t block;
+    *got = 0;
+    if (__myfs_get_num_free_blocks(fsptr, fssize, errnoptr) == 0) {
+        *errnoptr = ENOSPC;
+        return 0;
+    }
+    block = goal;
+    if ((goal != 0) && ((goal % MYFS_ALLOC_WINDOW != 0) || (goal >= cursor))) {
+        *got = __myfs_claim_run(fsptr, fssize, errnoptr, goal, want);
+    }
+    if ((*got == 0) && ((goal != 0) || (want > 1))) {
+        block = __myfs_find_window(fsptr, fssize, errnoptr, cursor);
+        if (block != 0) {
+            *got = __myfs_claim_run(fsptr, fssize, errnoptr, block, want);
+        }
+    }
+    if (*got == 0) {
+        block = __myfs_alloc_block(fsptr, fssize, errnoptr);
+        if (*errnoptr != 0) {
+            return 0;
+        }
+        *got = 1 + __myfs_claim_run(fsptr, fssize, errnoptr, block + 1, want - 1);
+        if (*got == 1) {
+            return block;
+        }
+    }
+    // Hand out the rest of the window the run ends in
+    if (block + *got > cursor) {
+        __atomic_store_n(&sb->next_free, (block + *got + MYFS_ALLOC_WINDOW - 1) / MYFS_ALLOC_WINDOW * MYFS_ALLOC_WINDOW, __ATOMIC_RELAXED);
+    }
+    return block;
+}
+
+/* Allocates a block for metadata: its FAT entry says so, and the
+   journal treats it as dirty from here on.
+*/
+size_t __myfs_alloc_meta_block(void *fsptr, size_t fssize, int *errnoptr) {
+    size_t block = __myfs_alloc_block(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return 0;
+    }
+    __myfs_get_fat(fsptr, fssize, errnoptr, block)->is_used = MYFS_FAT_META;
+    __myfs_journal_fresh(fsptr, fssize, errnoptr, block);
+    return block;
+}
+
+/* Frees length blocks, starting at block start. The FAT entries of
+   the run are cleared with one memset and the bitmap a whole word at
+   a time, a slice of them at a time, so freeing a long run costs one
+   step per 64 blocks.
+*/
+void __myfs_release_run(void *fsptr, size_t fssize, int *errnoptr, size_t start, size_t length) {
+    size_t freed = 0;
+    if (length == 0) {
+        return;
+    }
+    for (size_t i = 0; i < length; i++) {
+        __myfs_journal_release(fsptr, fssize, errnoptr, start + i);
+    }
+    while (length > 0) {
+        size_t span = min(length, __myfs_fat_span(fsptr, fssize, errnoptr, start));
+        uint64_t *bitmap = __myfs_bitmap_word(fsptr, fssize, errnoptr, start);
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, __myfs_get_fat(fsptr, fssize, errnoptr, start), span * MYFS_FAT_SIZE);
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, bitmap,
+                             ((start + span - 1) / MYFS_BITMAP_WORD_BITS - start / MYFS_BITMAP_WORD_BITS + 1) * sizeof(uint64_t));
+        memset(__myfs_get_fat(fsptr, fssize, errnoptr, start), 0, span * MYFS_FAT_SIZE);
+        while (span > 0) {
+            size_t shift = start % MYFS_BITMAP_WORD_BITS;
+            size_t n = min(span, MYFS_BITMAP_WORD_BITS - shift);
+            uint64_t mask = (n == MYFS_BITMAP_WORD_BITS) ? ~((uint64_t) 0) : ((((uint64_t) 1) << n) - 1) << shift;
+            uint64_t old = __atomic_fetch_and(bitmap++, ~mask, __ATOMIC_ACQ_REL);
+            freed += __builtin_popcountll(old & mask);
+            start += n;
+            span -= n;
+            length -= n;
+        }
+    }
+    __atomic_fetch_add(&__myfs_get_superblock(fsptr, fssize, errnoptr)->free_count, freed, __ATOMIC_RELAXED);
+}
+
+/* Shared blocks
+
+   A snapshot does not copy the data of the files, it takes another
+   reference on their blocks. The FAT entry of a block of file data has
+   no use for used_size otherwise, so it counts the references besides
+   the first: 0 for a block held by one file, as every block is when it
+   is claimed. A file about to change a shared block gets a copy of its
+   own first, see __myfs_map_unshare.
+*/
+
+// Takes another reference on length blocks of file data, starting at block start
+void __myfs_share_run(void *fsptr, size_t fssize, int *errnoptr, size_t start, size_t length) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    if (length == 0) {
+        return;
+    }
+    for (size_t i = 0, span; i < length; i += span) {
+        span = min(length - i, __myfs_fat_span(fsptr, fssize, errnoptr, start + i));
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, __myfs_get_fat(fsptr, fssize, errnoptr, start + i), span * MYFS_FAT_SIZE);
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (__atomic_fetch_add(&__myfs_get_fat(fsptr, fssize, errnoptr, start + i)->used_size, 1, __ATOMIC_RELAXED) == 0) {
+            __atomic_fetch_add(&sb->shared_count, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Drops a reference on length blocks of file data, starting at block
+   start. The blocks nobody else holds are freed, a run at a time; the
+   others just lose the reference. Without any shared blocks, this is
+   __myfs_release_run.
+*/
+void __myfs_release_data(void *fsptr, size_t fssize, int *errnoptr, size_t start, size_t length) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t run = 0;
+    if (__atomic_load_n(&sb->shared_count, __ATOMIC_RELAXED) == 0) {
+        __myfs_release_run(fsptr, fssize, errnoptr, start, length);
+        return;
+    }
+    for (size_t i = 0; i < length; i++) {
+        struct __myfs_fat_entry *fat = __myfs_get_fat(fsptr, fssize, errnoptr, start + i);
+        if (fat->used_size == 0) {
+            run++;
+            continue;
+        }
+        __myfs_release_run(fsptr, fssize, errnoptr, start + i - run, run);
+        run = 0;
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, fat, MYFS_FAT_SIZE);
+        if (__atomic_sub_fetch(&fat->used_size, 1, __ATOMIC_RELAXED) == 0) {
+            __atomic_fetch_sub(&sb->shared_count, 1, __ATOMIC_RELAXED);
+        }
+    }
+    __myfs_release_run(fsptr, fssize, errnoptr, start + length - run, run);
+}
+
+/* Moves over to the journal set aside when the image grew. This is
+   only done right after a checkpoint, when the old journal holds
+   nothing that is still needed: the superblock goes straight to the
+   disk with the new journal in it, so a crash finds one or the other,
+   both empty. The blocks of the old journal are freed through the new
+   one; journal_old_blocks stays set until that is committed, so that a
+   crash before then frees them on the next mount instead of leaking
+   them. Must be called under the exclusive lock.
+*/
+int __myfs_journal_switch(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    if (sb->journal_next_blocks != 0) {
+        // An empty first block ends the journal right away
+        size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+        memset(__myfs_get_block(fsptr, fssize, errnoptr, sb->journal_next_block), 0, block_size);
+        if (__myfs_journal_sync(fsptr, fssize, errnoptr, __myfs_get_block(fsptr, fssize, errnoptr, sb->journal_next_block), block_size) < 0) {
+            return -1;
+        }
+        sb->journal_old_block = sb->journal_block;
+        sb->journal_old_blocks = sb->journal_blocks;
+        sb->journal_block = sb->journal_next_block;
+        // Read without the lock by the flusher and __myfs_journal_due_implem
+        __atomic_store_n(&sb->journal_blocks, sb->journal_next_blocks, __ATOMIC_RELAXED);
+        sb->journal_next_blocks = 0;
+        if (__myfs_journal_sync(fsptr, fssize, errnoptr, sb, sizeof(struct __myfs_superblock)) < 0) {
+            return -1;
+        }
+    }
+    if (sb->journal_old_blocks != 0) {
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, sb, sizeof(struct __myfs_superblock));
+        __myfs_release_run(fsptr, fssize, errnoptr, sb->journal_old_block, sb->journal_old_blocks);
+        sb->journal_old_blocks = 0;
+    }
+    return 0;
+}
+
+/* Fragment blocks
+
+   Files too big to go inline but of at most MYFS_FRAG_MAX bytes share
+   blocks: a fragment block is cut into MYFS_FRAG_SLOTS slots, and such
+   a file takes a run of consecutive slots in one of them, so with 4KB
+   blocks a 1KB file costs a quarter of a block. With small blocks, the
+   files that go into fragments are smaller too, as they may take no
+   more than three quarters of a block, see __myfs_frag_max.
+
+   The FAT entry of a fragment block has used_size set to the bitmap
+   of its slots in use. Fragment blocks with free slots are kept on a
+   list through next_block, which starts at frag_list in the superblock;
+   is_used is MYFS_FAT_FRAG for the blocks on the list and
+   MYFS_FAT_FRAG_OFF for the others. A block leaves the list when it
+   fills up, or when a search finds it too full to be of use, and goes
+   back onto it when one of its slots is freed. It is freed itself
+   when its last slot is.
+
+   Writers to different files allocate fragments at the same time, so
+   the list and the slot bitmaps are only touched under frag_lock. It
+   is a spinlock kept in the superblock, as nothing may live outside
+   of the image, and it is never held for more than a few steps.
+*/
+_Static_assert(MYFS_FRAG_SLOTS < 32, "the slots of a fragment block must fit into used_size");
+
+// Size of a slot of a fragment block
+size_t __myfs_frag_size(void *fsptr, size_t fssize, int *errnoptr) {
+    return __myfs_block_size(fsptr, fssize, errnoptr) / MYFS_FRAG_SLOTS;
+}
+
+// Largest file that goes into fragments
+size_t __myfs_frag_max(void *fsptr, size_t fssize, int *errnoptr) {
+    return min(MYFS_FRAG_MAX, __myfs_frag_size(fsptr, fssize, errnoptr) * (MYFS_FRAG_SLOTS / 4 * 3));
+}
+
+void __myfs_frag_lock(struct __myfs_superblock *sb) {
+    while (__atomic_exchange_n(&sb->frag_lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (__atomic_load_n(&sb->frag_lock, __ATOMIC_RELAXED) != 0) {
+        }
+    }
+}
+
+void __myfs_frag_unlock(struct __myfs_superblock *sb) {
+    __atomic_store_n(&sb->frag_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Claims a run of slots consecutive slots of a fragment block.
+   Only the first MYFS_FRAG_SCAN blocks of the list are tried, so the
+   cost does not grow with the number of small files; if none of them
+   has room, a new fragment block is started. A block passed over with
+   less than a quarter of its slots free leaves the list, so that such
+   leftovers do not crowd out the blocks that still have room.
+   Returns the block and puts the first slot of the run into *slot,
+   or returns 0 with ENOSPC.
+*/
+size_t __myfs_frag_alloc(void *fsptr, size_t fssize, int *errnoptr, size_t slots, size_t *slot) {
+    struct __myfs_superblock *sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    uint32_t full = (((uint32_t) 1) << MYFS_FRAG_SLOTS) - 1;
+    uint32_t mask = (((uint32_t) 1) << slots) - 1;
+    uint64_t *link;
+    struct __myfs_fat_entry *fat;
+    size_t block;
+    __myfs_frag_lock(sb);
+    link = &sb->frag_list;
+    for (int n = 0; (*link != 0) && (n < MYFS_FRAG_SCAN); n++) {
+        fat = __myfs_get_fat(fsptr, fssize, errnoptr, *link);
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, fat, MYFS_FAT_SIZE);
+        for (size_t s = 0; s + slots <= MYFS_FRAG_SLOTS; s++) {
+            if ((fat->used_size & (mask << s)) == 0) {
+                block = *link;
+                fat->used_size |= mask << s;
+                if (fat->used_size == full) {
+                    *link = fat->next_block;
+                    fat->next_block = 0;
+                    fat->is_used = MYFS_FAT_FRAG_OFF;
+                }
+                __myfs_frag_unlock(sb);
+                *slot = s;
+                return block;
+            }
+        }
+        if (__builtin_popcount(fat->used_size) > MYFS_FRAG_SLOTS * 3 / 4) {
+            *link = fat->next_block;
+            fat->next_block = 0;
+            fat->is_used = MYFS_FAT_FRAG_OFF;
+            continue;
+        }
+        link = &fat->next_block;
+    }
+    __myfs_frag_unlock(sb);
+    block = __myfs_alloc_block(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return 0;
+    }
+    fat = __myfs_get_fat(fsptr, fssize, errnoptr, block);
+    __myfs_frag_lock(sb);
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, fat, MYFS_FAT_SIZE);
+    fat->is_used = MYFS_FAT_FRAG_OFF;
+    fat->used_size = mask;
+    fat->next_block = 0;
+    if (mask != full) {
+        fat->is_used = MYFS_FAT_FRAG;
+        fat->next_block = sb->frag_list;
+        sb->frag_list = block;
+    }
+    __myfs_frag_unlock(sb);
+    *slot = 0;
+    return block;
+}
+
+/* Gives back slots slots of the fragment block block, starting at
+   slot slot. A block that was off the list goes back onto it, and one
+   that is left empty is taken off it and freed. Finding its place in
+   the list is the only step that walks the list.
+*/
+void __myfs_frag_release(void *fsptr, size_t fssize, int *errnoptr, size_t block, size_t slot, size_t slots) {
+    struct __myfs_superblock *sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    struct __myfs_fat_entry *fat = __myfs_get_fat(fsptr, fssize, errnoptr, block);
+    uint32_t mask = ((((uint32_t) 1) << slots) - 1) << slot;
+    if (slots == 0) {
+        return;
+    }
+    __myfs_frag_lock(sb);
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, fat, MYFS_FAT_SIZE);
+    fat->used_size &= ~mask;
+    if ((fat->used_size == 0) && (fat->is_used == MYFS_FAT_FRAG)) {
+        uint64_t *link = &sb->frag_list;
+        while ((*link != 0) && (*link != block)) {
+            link = &__myfs_get_fat(fsptr, fssize, errnoptr, *link)->next_block;
+        }
+        if (*link == block) {
+            __myfs_journal_dirty(fsptr, fssize, errnoptr, link, sizeof(uint64_t));
+            *link = fat->next_block;
+        }
+    }
+    if (fat->used_size == 0) {
+        __myfs_frag_unlock(sb);
+        __myfs_release_block(fsptr, fssize, errnoptr, block);
+        return;
+    }
+    if (fat->is_used == MYFS_FAT_FRAG_OFF) {
+        fat->is_used = MYFS_FAT_FRAG;
+        fat->next_block = sb->frag_list;
+        sb->frag_list = block;
+    }
+    __myfs_frag_unlock(sb);
+}
+
+struct __myfs_extent_node* __myfs_get_extent_node(void *fsptr, size_t fssize, int *errnoptr, size_t block) {
+    return (struct __myfs_extent_node*) __myfs_get_block(fsptr, fssize, errnoptr, block);
+}
+
+/* Binary search in a sorted level of an extent tree.
+   Returns the index of the last entry starting at or before logical,
+   or 0 if every entry starts after it.
+*/
+uint32_t __myfs_extent_search(struct __myfs_extent *entries, uint32_t count, size_t logical) {
+    uint32_t lo = 0, hi = count;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].logical <= logical) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Returns the rightmost leaf level of the extent tree of map, which
+   holds the end of the file, and puts its number of entries into
+   *count. The leaf is found through map->tail without descending the
+   tree. Returns NULL if the leaf is empty or tail does not point at
+   a leaf, in which case the caller has to walk the tree.
+*/
+struct __myfs_extent *__myfs_extent_tail(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, uint32_t *count) {
+    struct __myfs_extent_node *node;
+    if (map->depth == 0) {
+        *count = map->count;
+        return (map->count > 0) ? map->root : NULL;
+    }
+    if ((map->tail == 0) || (map->tail >= __myfs_get_fat_size(fsptr, fssize, errnoptr))) {
+        return NULL;
+    }
+    node = __myfs_get_extent_node(fsptr, fssize, errnoptr, map->tail);
+    if ((node->depth != 0) || (node->count == 0) || (node->count > __myfs_node_extents(fsptr, fssize, errnoptr))) {
+        return NULL;
+    }
+    *count = node->count;
+    return node->entries;
+}
+
+/* Points map->tail at the rightmost leaf again, after the shape of
+   the tree changed.
+*/
+void __myfs_extent_find_tail(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map) {
+    struct __myfs_extent *entries = map->root;
+    uint32_t count = map->count;
+    uint32_t depth = map->depth;
+    map->tail = 0;
+    while ((depth > 0) && (count > 0)) {
+        struct __myfs_extent_node *node;
+        map->tail = entries[count - 1].start;
+        node = __myfs_get_extent_node(fsptr, fssize, errnoptr, map->tail);
+        entries = node->entries;
+        count = node->count;
+        depth--;
+    }
+}
+
+/* Finds the extent holding file block logical, descending the extent
+   tree in O(log extents). Returns NULL if the block is not mapped.
+
+   getattr walks directories while they may be changing under it, so
+   nothing read from the tree is trusted to stay inside the image.
+*/
+struct __myfs_extent* __myfs_extent_lookup(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t logical) {
+    uint64_t block_count = __myfs_get_fat_size(fsptr, fssize, errnoptr);
+    struct __myfs_extent *entries = map->root;
+    uint32_t count = map->count;
+    uint32_t depth = map->depth;
+    uint32_t i;
+    struct __myfs_extent *tail;
+    uint32_t tail_count;
+    if ((map->flags & MYFS_MAP_SMALL) || (count > MYFS_INLINE_EXTENTS) || (depth > MYFS_MAX_DEPTH)) {
+        return NULL;
+    }
+    // Offsets near the end of the file are found in the tail leaf
+    tail = __myfs_extent_tail(fsptr, fssize, errnoptr, map, &tail_count);
+    if ((tail != NULL) && (logical >= tail[0].logical)) {
+        entries = tail;
+        count = tail_count;
+        depth = 0;
+    }
+    while (depth > 0) {
+        struct __myfs_extent_node *node;
+        if (count == 0) {
+            return NULL;
+        }
+        i = __myfs_extent_search(entries, count, logical);
+        if (entries[i].start >= block_count) {
+            return NULL;
+        }
+        node = __myfs_get_extent_node(fsptr, fssize, errnoptr, entries[i].start);
+        entries = node->entries;
+        count = node->count;
+        if (count > __myfs_node_extents(fsptr, fssize, errnoptr)) {
+            return NULL;
+        }
+        depth--;
+    }
+    if (count == 0) {
+        return NULL;
+    }
+    if (logical >= entries[count - 1].logical) {
+        i = count - 1;
+    } else {
+        i = __myfs_extent_search(entries, count, logical);
+    }
+    if ((logical < entries[i].logical) || (logical >= (size_t) entries[i].logical + entries[i].length)) {
+        return NULL;
+    }
+    if ((uint64_t) entries[i].start + entries[i].length > block_count) {
+        return NULL;
+    }
+    return entries + i;
+}
+
+/* Returns the first mapped file block at or after logical in one
+   level of an extent tree, or SIZE_MAX if there is none.
+*/
+size_t __myfs_extent_next_level(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent *entries,
+                                uint32_t count, uint32_t depth, size_t logical) {
+    uint32_t i;
+    if (count == 0) {
+        return SIZE_MAX;
+    }
+    for (i = __myfs_extent_search(entries, count, logical); i < count; i++) {
+        if (depth > 0) {
+            struct __myfs_extent_node *node = __myfs_get_extent_node(fsptr, fssize, errnoptr, entries[i].start);
+            size_t next = __myfs_extent_next_level(fsptr, fssize, errnoptr, node->entries, node->count, depth - 1, logical);
+            if (next != SIZE_MAX) {
+                return next;
+            }
+        } else if ((size_t) entries[i].logical + entries[i].length > logical) {
+            return max(logical, (size_t) entries[i].logical);
+        }
+    }
+    return SIZE_MAX;
+}
+
+/* Returns the first file block at or after logical that is mapped,
+   or SIZE_MAX if the rest of the file is a hole.
+*/
+size_t __myfs_extent_next_data(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t logical) {
+    return __myfs_extent_next_level(fsptr, fssize, errnoptr, map->root, map->count, map->depth, logical);
+}
+
+/* Inserts ext into one level of the extent tree of map.
+
+   Leaves grow an adjacent extent when ext continues it both in the
+   file and on the image, so contiguous files stay a single extent.
+   A full node is split in half: the new right sibling's index entry
+   goes to *split and 1 is returned, for the caller to insert one
+   level up. A full root is pushed down into a new node instead,
+   which makes the tree one level deeper.
+*/
+int __myfs_extent_insert_level(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map,
+                               struct __myfs_extent *entries, uint32_t *count, uint32_t capacity, uint32_t depth,
+                               struct __myfs_extent ext, struct __myfs_extent *split) {
+    struct __myfs_extent item;
+    uint32_t i = 0, pos;
+    if (*count > 0) {
+        i = __myfs_extent_search(entries, *count, ext.logical);
+    }
+    if (depth > 0) {
+        struct __myfs_extent child_split;
+        struct __myfs_extent_node *node = __myfs_get_extent_node(fsptr, fssize, errnoptr, entries[i].start);
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, node, __myfs_block_size(fsptr, fssize, errnoptr));
+        int res = __myfs_extent_insert_level(fsptr, fssize, errnoptr, map, node->entries, &node->count,
+                                             __myfs_node_extents(fsptr, fssize, errnoptr), depth - 1, ext, &child_split);
+        if (res < 0) {
+            return -1;
+        }
+        if (ext.logical < entries[i].logical) {
+            entries[i].logical = ext.logical;
+        }
+        if (res == 0) {
+            return 0;
+        }
+        item = child_split;
+        pos = i + 1;
+    } else {
+        if ((*count == 0) || (ext.logical < entries[0].logical)) {
+            pos = 0;
+        } else {
+            pos = i + 1;
+        }
+        if (pos > 0) {
+            struct __myfs_extent *prev = entries + (pos - 1);
+            if ((prev->logical + prev->length == ext.logical) && (prev->start + prev->length == ext.start)) {
+                prev->length += ext.length;
+                return 0;
+            }
+        }
+        if (pos < *count) {
+            struct __myfs_extent *next = entries + pos;
+            if ((ext.logical + ext.length == next->logical) && (ext.start + ext.length == next->start)) {
+                next->logical = ext.logical;
+                next->start = ext.start;
+                next->length += ext.length;
+                return 0;
+            }
+        }
+        item = ext;
+    }
+    if (*count < capacity) {
+        memmove(entries + pos + 1, entries + pos, (*count - pos) * sizeof(struct __myfs_extent));
+        entries[pos] = item;
+        (*count)++;
+        return 0;
+    }
+    size_t block = __myfs_alloc_meta_block(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    map->blocks++;
+    struct __myfs_extent_node *node = __myfs_get_extent_node(fsptr, fssize, errnoptr, block);
+    node->depth = depth;
+    if (entries == map->root) {
+        // Push the root down into a node of its own
+        node->count = *count;
+        memcpy(node->entries, entries, *count * sizeof(struct __myfs_extent));
+        memmove(node->entries + pos + 1, node->entries + pos, (node->count - pos) * sizeof(struct __myfs_extent));
+        node->entries[pos] = item;
+        node->count++;
+        entries[0].logical = node->entries[0].logical;
+        entries[0].start = block;
+        entries[0].length = 0;
+        *count = 1;
+        map->depth++;
+        return 0;
+    }
+    uint32_t half = *count / 2;
+    node->count = *count - half;
+    memcpy(node->entries, entries + half, node->count * sizeof(struct __myfs_extent));
+    *count = half;
+    if (pos <= half) {
+        memmove(entries + pos + 1, entries + pos, (*count - pos) * sizeof(struct __myfs_extent));
+        entries[pos] = item;
+        (*count)++;
+    } else {
+        pos -= half;
+        memmove(node->entries + pos + 1, node->entries + pos, (node->count - pos) * sizeof(struct __myfs_extent));
+        node->entries[pos] = item;
+        node->count++;
+    }
+    split->logical = node->entries[0].logical;
+    split->start = block;
+    split->length = 0;
+    return 1;
+}
+
+/* Inserts ext into the extent tree of map. An extent past the end of
+   the file goes straight into the tail leaf while that has room, so
+   appending costs the same however large the file is.
+*/
+int __myfs_extent_insert(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, struct __myfs_extent ext) {
+    struct __myfs_extent split;
+    struct __myfs_extent *tail;
+    uint32_t count;
+    int res;
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, map, sizeof(struct __myfs_extent_map));
+    tail = __myfs_extent_tail(fsptr, fssize, errnoptr, map, &count);
+    if ((map->depth > 0) && (tail != NULL) && (ext.logical >= tail[count - 1].logical + tail[count - 1].length)) {
+        struct __myfs_extent *last = tail + (count - 1);
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, tail, __myfs_block_size(fsptr, fssize, errnoptr) - sizeof(struct __myfs_extent_node));
+        if ((last->logical + last->length == ext.logical) && (last->start + last->length == ext.start)) {
+            last->length += ext.length;
+            return 0;
+        }
+        if (count < __myfs_node_extents(fsptr, fssize, errnoptr)) {
+            tail[count] = ext;
+            __myfs_get_extent_node(fsptr, fssize, errnoptr, map->tail)->count++;
+            return 0;
+        }
+    }
+    count = map->count;
+    res = __myfs_extent_insert_level(fsptr, fssize, errnoptr, map, map->root, &count,
+                                     MYFS_INLINE_EXTENTS, map->depth, ext, &split);
+    map->count = count;
+    __myfs_extent_find_tail(fsptr, fssize, errnoptr, map);
+    if (res < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Drops every file block at or beyond logical from one level of an
+   extent tree. Nodes no longer needed are freed, and so are data
+   blocks, unless a snapshot still holds them.
+   Returns how many blocks were freed.
+*/
+size_t __myfs_extent_truncate_level(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent *entries,
+                                    uint32_t *count, uint32_t depth, size_t logical) {
+    size_t freed = 0;
+    while (*count > 0) {
+        struct __myfs_extent *e = entries + (*count - 1);
+        if (e->logical >= logical) {
+            if (depth > 0) {
+                struct __myfs_extent_node *node = __myfs_get_extent_node(fsptr, fssize, errnoptr, e->start);
+                __myfs_journal_dirty(fsptr, fssize, errnoptr, node, __myfs_block_size(fsptr, fssize, errnoptr));
+                freed += __myfs_extent_truncate_level(fsptr, fssize, errnoptr, node->entries, &node->count, depth - 1, 0);
+                __myfs_release_block(fsptr, fssize, errnoptr, e->start);
+                freed++;
+            } else {
+                __myfs_release_data(fsptr, fssize, errnoptr, e->start, e->length);
+                freed += e->length;
+            }
+            (*count)--;
+            continue;
+        }
+        if (depth > 0) {
+            struct __myfs_extent_node *node = __myfs_get_extent_node(fsptr, fssize, errnoptr, e->start);
+            __myfs_journal_dirty(fsptr, fssize, errnoptr, node, __myfs_block_size(fsptr, fssize, errnoptr));
+            freed += __myfs_extent_truncate_level(fsptr, fssize, errnoptr, node->entries, &node->count, depth - 1, logical);
+        } else if (e->logical + e->length > logical) {
+            __myfs_release_data(fsptr, fssize, errnoptr, e->start + (logical - e->logical), e->logical + e->length - logical);
+            freed += e->logical + e->length - logical;
+            e->length = logical - e->logical;
+        }
+        break;
+    }
+    return freed;
+}
+
+/* Unmaps and frees every file block at or beyond logical. Once the
+   remaining extents fit into the map again, the tree is pulled back
+   into it.
+*/
+void __myfs_extent_truncate(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t logical) {
+    uint32_t count = map->count;
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, map, sizeof(struct __myfs_extent_map));
+    map->blocks -= __myfs_extent_truncate_level(fsptr, fssize, errnoptr, map->root, &count, map->depth, logical);
+    map->count = count;
+    while (map->depth > 0) {
+        if (map->count == 0) {
+            map->depth = 0;
+            break;
+        }
+        if (map->count > 1) {
+            break;
+        }
+        size_t block = map->root[0].start;
+        struct __myfs_extent_node *node = __myfs_get_extent_node(fsptr, fssize, errnoptr, block);
+        if (node->count > MYFS_INLINE_EXTENTS) {
+            break;
+        }
+        memcpy(map->root, node->entries, node->count * sizeof(struct __myfs_extent));
+        map->count = node->count;
+        map->depth--;
+        __myfs_release_block(fsptr, fssize, errnoptr, block);
+        map->blocks--;
+    }
+    __myfs_extent_find_tail(fsptr, fssize, errnoptr, map);
+}
+
+/* Points the count file blocks from logical on, which must lie in one
+   extent, at the blocks from start on instead. The extent is cut
+   around them as needed; the blocks it pointed at are left alone.
+   Returns -1 on failure, which takes a full filesystem: cutting the
+   extent in pieces may need another node.
+*/
+int __myfs_extent_remap(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t logical, size_t count,
+                        size_t start) {
+    struct __myfs_extent *e = __myfs_extent_lookup(fsptr, fssize, errnoptr, map, logical);
+    struct __myfs_extent old, piece;
+    if ((e == NULL) || (logical + count > (size_t) e->logical + e->length)) {
+        *errnoptr = EIO;
+        return -1;
+    }
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, map, sizeof(struct __myfs_extent_map));
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, e, sizeof(struct __myfs_extent));
+    old = *e;
+    if ((old.logical == logical) && (old.length == count)) {
+        e->start = start;
+        return 0;
+    }
+    // The extent keeps its part before logical, or else the one after
+    if (old.logical < logical) {
+        e->length = logical - old.logical;
+    } else {
+        e->logical += count;
+        e->start += count;
+        e->length -= count;
+    }
+    piece.logical = logical;
+    piece.length = count;
+    piece.start = start;
+    if (__myfs_extent_insert(fsptr, fssize, errnoptr, map, piece) < 0) {
+        return -1;
+    }
+    if ((old.logical == logical) || (logical + count == (size_t) old.logical + old.length)) {
+        return 0;
+    }
+    piece.logical = logical + count;
+    piece.length = old.logical + old.length - piece.logical;
+    piece.start = old.start + (piece.logical - old.logical);
+    return __myfs_extent_insert(fsptr, fssize, errnoptr, map, piece);
+}
+
+/* Like __myfs_extent_lookup, but first tries hint, a copy of the
+   extent the caller used last, and remembers the extent found in it.
+   An open file's handle keeps its hint between calls, so sequential
+   reads and writes never go back to the tree within an extent.
+*/
+struct __myfs_extent* __myfs_extent_lookup_hint(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map,
+                                                size_t logical, struct __myfs_extent *hint) {
+    struct __myfs_extent *e;
+    if (hint == NULL) {
+        return __myfs_extent_lookup(fsptr, fssize, errnoptr, map, logical);
+    }
+    if ((logical >= hint->logical) && (logical < (size_t) hint->logical + hint->length)) {
+        return hint;
+    }
+    e = __myfs_extent_lookup(fsptr, fssize, errnoptr, map, logical);
+    if (e != NULL) {
+        *hint = *e;
+    }
+    return e;
+}
+
+/* Returns a pointer to the byte at offset of the file described by
+   map and puts into *avail how many bytes from there on are stored
+   contiguously in the image. Returns NULL if offset is not mapped.
+   hint may be NULL, see __myfs_extent_lookup_hint.
+*/
+char *__myfs_map_span(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t offset, size_t *avail,
+                      struct __myfs_extent *hint) {
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    size_t frag_size = __myfs_frag_size(fsptr, fssize, errnoptr);
+    size_t logical = offset / block_size;
+    struct __myfs_extent *e;
+    if (map->flags & MYFS_MAP_INLINE) {
+        if (offset >= MYFS_INLINE_DATA) {
+            *avail = 0;
+            return NULL;
+        }
+        *avail = MYFS_INLINE_DATA - offset;
+        return map->data + offset;
+    }
+    if (map->flags & MYFS_MAP_FRAG) {
+        if ((offset >= (size_t) map->frag_slots * frag_size) || (map->frag_slot + map->frag_slots > MYFS_FRAG_SLOTS) ||
+            (map->frag_block >= __myfs_get_fat_size(fsptr, fssize, errnoptr))) {
+            *avail = 0;
+            return NULL;
+        }
+        *avail = (size_t) map->frag_slots * frag_size - offset;
+        return (char *) __myfs_get_block(fsptr, fssize, errnoptr, map->frag_block) + map->frag_slot * frag_size + offset;
+    }
+    e = __myfs_extent_lookup_hint(fsptr, fssize, errnoptr, map, logical, hint);
+    if (e == NULL) {
+        *avail = 0;
+        return NULL;
+    }
+    size_t in_extent = (logical - e->logical) * block_size + offset % block_size;
+    *avail = e->length * block_size - in_extent;
+    return (char *) __myfs_get_block(fsptr, fssize, errnoptr, e->start) + in_extent;
+}
+
+/* Walks the bytes start to start + len of a file in place, one
+   contiguous span of the image at a time, without copying anything.
+*/
+struct __myfs_span_iter {
+    struct __myfs_extent_map *map;
+    size_t offset;
+    size_t end;
+    struct __myfs_extent *hint;
+};
+
+void __myfs_iter_init(struct __myfs_span_iter *iter, struct __myfs_extent_map *map, size_t start, size_t len) {
+    iter->map = map;
+    iter->offset = start;
+    iter->end = start + len;
+    iter->hint = NULL;
+}
+
+/* Returns a pointer to the next span and puts its length into *len.
+   Returns NULL once the range is used up, or with EIO if part of it
+   is not mapped.
+*/
+char *__myfs_iter_next(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_span_iter *iter, size_t *len) {
+    size_t avail;
+    char *span;
+    if (iter->offset >= iter->end) {
+        *len = 0;
+        return NULL;
+    }
+    span = __myfs_map_span(fsptr, fssize, errnoptr, iter->map, iter->offset, &avail, iter->hint);
+    if (span == NULL) {
+        *errnoptr = EIO;
+        *len = 0;
+        return NULL;
+    }
+    *len = min(avail, iter->end - iter->offset);
+    iter->offset += *len;
+    return span;
+}
+
+/* Returns the block that file block logical of map had best go to:
+   the one right after the block holding logical - 1. Past the end of
+   the file, room is left for the hole in between, so that filling it
+   in later keeps the file in one piece. Returns 0 if there is no good
+   place, as for a file without blocks.
+*/
+size_t __myfs_map_goal(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t logical,
+                       struct __myfs_extent *hint) {
+    struct __myfs_extent *e = NULL;
+    uint32_t count;
+    if (logical > 0) {
+        e = __myfs_extent_lookup_hint(fsptr, fssize, errnoptr, map, logical - 1, hint);
+    }
+    if (e != NULL) {
+        return e->start + (logical - e->logical);
+    }
+    e = __myfs_extent_tail(fsptr, fssize, errnoptr, map, &count);
+    if ((e != NULL) && (logical >= (size_t) e[count - 1].logical + e[count - 1].length)) {
+        return e[count - 1].start + (logical - e[count - 1].logical);
+    }
+    return 0;
+}
+
+/* Makes sure every block holding a byte of start to end - 1 is
+   mapped, leaving the rest of the file alone, so that the blocks of a
+   hole stay unallocated. Blocks mapped here are zeroed outside of the
+   range, which the caller is about to fill. Every gap in the mapping
+   is filled with as few runs of blocks as the allocator can find,
+   starting right after the blocks before it, see __myfs_alloc_run.
+   Returns the offset up to which the range is mapped, which is less
+   than end if the filesystem ran full.
+*/
+size_t __myfs_map_reserve(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t start, size_t end,
+                          struct __myfs_extent *hint) {
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    size_t logical = start / block_size;
+    size_t last = (end + block_size - 1) / block_size;
+    while (logical < last) {
+        struct __myfs_extent ext;
+        struct __myfs_extent *e = __myfs_extent_lookup_hint(fsptr, fssize, errnoptr, map, logical, hint);
+        size_t block, got = 1;
+        char *data;
+        if (e != NULL) {
+            logical = (size_t) e->logical + e->length;
+            continue;
+        }
+        if (map->flags & MYFS_MAP_META) {
+            block = __myfs_alloc_meta_block(fsptr, fssize, errnoptr);
+        } else {
+            size_t want = min(last, __myfs_extent_next_data(fsptr, fssize, errnoptr, map, logical)) - logical;
+            block = __myfs_alloc_run(fsptr, fssize, errnoptr, __myfs_map_goal(fsptr, fssize, errnoptr, map, logical, hint), want, &got);
+        }
+        if (*errnoptr != 0) {
+            return max(start, logical * block_size);
+        }
+        ext.logical = logical;
+        ext.start = block;
+        ext.length = got;
+        map->blocks += got;
+        if (__myfs_extent_insert(fsptr, fssize, errnoptr, map, ext) < 0) {
+            __myfs_release_run(fsptr, fssize, errnoptr, block, got);
+            map->blocks -= got;
+            return max(start, logical * block_size);
+        }
+        data = __myfs_get_block(fsptr, fssize, errnoptr, block);
+        if (logical * block_size < start) {
+            memset(data, 0, start - logical * block_size);
+        }
+        logical += got;
+        if (logical * block_size > end) {
+            data = __myfs_get_block(fsptr, fssize, errnoptr, logical - 1 - ext.logical + block);
+            memset(data + (end - (logical - 1) * block_size), 0, logical * block_size - end);
+        }
+    }
+    return end;
+}
+
+/* Copies len bytes from data into the file at start, or zeros if data
+   is NULL. The range must already be mapped. Each contiguous run is
+   handled with a single memcpy.
+*/
+void __myfs_fill_data(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t start, size_t len, const char *data,
+                      struct __myfs_extent *hint) {
+    struct __myfs_span_iter iter;
+    size_t n, done = 0;
+    char *span;
+    __myfs_iter_init(&iter, map, start, len);
+    iter.hint = hint;
+    while ((span = __myfs_iter_next(fsptr, fssize, errnoptr, &iter, &n)) != NULL) {
+        if (map->flags & MYFS_MAP_META) {
+            __myfs_journal_dirty(fsptr, fssize, errnoptr, span, n);
+        }
+        if (data == NULL) {
+            memset(span, 0, n);
+        } else {
+            memcpy(span, data + done, n);
+        }
+        if (!(map->flags & MYFS_MAP_META)) {
+            __myfs_sync_mark(fsptr, fssize, errnoptr, span, n);
+        }
+        done += n;
+    }
+}
+
+/* Gives the file with map blocks of its own in place of the shared
+   ones holding a byte of start to end - 1, with their data copied
+   over, so that changing them does not show in a snapshot. The copies
+   go to the disk before the file is switched over to them, as the rest
+   of their blocks has to read as before after a crash. Holes and the
+   blocks the file holds alone are left as they are. If anything moved,
+   hint is reset, and so are the hints of the open handles, through seq.
+   Returns -1 with ENOSPC if there is no room for the copies, with the
+   blocks copied so far kept.
+*/
+int __myfs_map_unshare(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t start, size_t end,
+                       struct __myfs_extent *hint) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    size_t logical = start / block_size;
+    size_t last = (end + block_size - 1) / block_size;
+    int moved = 0, res = 0;
+    if ((map->flags & (MYFS_MAP_SMALL | MYFS_MAP_META)) || (__atomic_load_n(&sb->shared_count, __ATOMIC_RELAXED) == 0)) {
+        return 0;
+    }
+    while (logical < last) {
+        struct __myfs_extent *e = __myfs_extent_lookup(fsptr, fssize, errnoptr, map, logical);
+        // Room for the nodes that cutting the extent in three may take
+        size_t nodes = 2 * ((size_t) map->depth + 2);
+        size_t block, stop, count = 1, copy, got, free_blocks;
+        int shared;
+        if (e == NULL) {
+            logical = __myfs_extent_next_data(fsptr, fssize, errnoptr, map, logical);
+            continue;
+        }
+        // The blocks in a row from here on that are all shared, or all not
+        block = e->start + (logical - e->logical);
+        stop = min(last, (size_t) e->logical + e->length);
+        shared = (__myfs_get_fat(fsptr, fssize, errnoptr, block)->used_size != 0);
+        while ((logical + count < stop) && ((__myfs_get_fat(fsptr, fssize, errnoptr, block + count)->used_size != 0) == shared)) {
+            count++;
+        }
+        if (!shared) {
+            logical += count;
+            continue;
+        }
+        free_blocks = __myfs_get_num_free_blocks(fsptr, fssize, errnoptr);
+        if (free_blocks <= nodes) {
+            *errnoptr = ENOSPC;
+            res = -1;
+            break;
+        }
+        copy = __myfs_alloc_run(fsptr, fssize, errnoptr, __myfs_map_goal(fsptr, fssize, errnoptr, map, logical, NULL),
+                                min(count, free_blocks - nodes), &got);
+        if (*errnoptr != 0) {
+            res = -1;
+            break;
+        }
+        memcpy(__myfs_get_block(fsptr, fssize, errnoptr, copy), __myfs_get_block(fsptr, fssize, errnoptr, block), got * block_size);
+        if (__myfs_journal_sync(fsptr, fssize, errnoptr, __myfs_get_block(fsptr, fssize, errnoptr, copy), got * block_size) < 0) {
+            __myfs_release_run(fsptr, fssize, errnoptr, copy, got);
+            res = -1;
+            break;
+        }
+        // A remap that fails half way may have the copy mapped already, so it is not freed
+        if (__myfs_extent_remap(fsptr, fssize, errnoptr, map, logical, got, copy) < 0) {
+            res = -1;
+            moved = 1;
+            break;
+        }
+        __myfs_release_data(fsptr, fssize, errnoptr, block, got);
+        logical += got;
+        moved = 1;
+    }
+    if (moved) {
+        if (hint != NULL) {
+            memset(hint, 0, sizeof(struct __myfs_extent));
+        }
+        __atomic_fetch_add(&sb->seq, 2, __ATOMIC_RELEASE);
+    }
+    return res;
+}
+
+/* Zeros the rest of the block holding offset, if it is mapped. Bytes
+   past the end of a file may be stale, so this is done before the end
+   moves up over them. Returns -1 if the block is shared and there is
+   no room for a copy.
+*/
+int __myfs_zero_tail(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t offset) {
+    size_t avail, rest = __myfs_block_size(fsptr, fssize, errnoptr);
+    char *span;
+    rest -= offset % rest;
+    if (rest == __myfs_block_size(fsptr, fssize, errnoptr)) {
+        return 0;
+    }
+    if (__myfs_map_unshare(fsptr, fssize, errnoptr, map, offset, offset + 1, NULL) < 0) {
+        return -1;
+    }
+    span = __myfs_map_span(fsptr, fssize, errnoptr, map, offset, &avail, NULL);
+    if (span != NULL) {
+        if (map->flags & MYFS_MAP_META) {
+            __myfs_journal_dirty(fsptr, fssize, errnoptr, span, min(avail, rest));
+        }
+        memset(span, 0, min(avail, rest));
+        if (!(map->flags & MYFS_MAP_META)) {
+            __myfs_sync_mark(fsptr, fssize, errnoptr, span, min(avail, rest));
+        }
+    }
+    return 0;
+}
+
+/* Writes the changed data of the file with map back to the disk, see
+   __myfs_sync_mark. The data of a directory is metadata, which the
+   journal takes care of, and so is data kept inline.
+*/
+int __myfs_sync_map(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    uint64_t *sync, *pending;
+    size_t header_units, logical = 0;
+    if (sb->journal_blocks == 0) {
+        return __myfs_sync_all(fsptr, fssize, errnoptr);
+    }
+    if (map->flags & (MYFS_MAP_META | MYFS_MAP_INLINE)) {
+        return 0;
+    }
+    sync = __myfs_sync_get_map(fsptr, fssize, errnoptr);
+    pending = &__myfs_journal_get_state(fsptr, fssize, errnoptr)->unsynced;
+    header_units = __myfs_journal_header_units(fsptr, fssize, errnoptr);
+    if (map->flags & MYFS_MAP_FRAG) {
+        return __myfs_sync_units(fsptr, fssize, errnoptr, sync, header_units + map->frag_block, header_units + map->frag_block + 1, pending);
+    }
+    while ((logical = __myfs_extent_next_data(fsptr, fssize, errnoptr, map, logical)) != SIZE_MAX) {
+        struct __myfs_extent *e = __myfs_extent_lookup(fsptr, fssize, errnoptr, map, logical);
+        if (e == NULL) {
+            break;
+        }
+        if (__myfs_sync_units(fsptr, fssize, errnoptr, sync, header_units + e->start, header_units + e->start + e->length, pending) < 0) {
+            return -1;
+        }
+        logical = (size_t) e->logical + e->length;
+    }
+    return 0;
+}
+
+/* Reads up to read_len bytes at start into buff. Returns the number of
+   bytes read. hint may be NULL, see __myfs_extent_lookup_hint.
+*/
+ssize_t __myfs_read_data(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t start, size_t read_len, void *buff,
+                         struct __myfs_extent *hint) {
+    size_t n, done = 0, block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    char *span;
+    if (start >= map->size) {
+        return 0;
+    }
+    read_len = min(read_len, map->size - start);
+    while (done < read_len) {
+        span = __myfs_map_span(fsptr, fssize, errnoptr, map, start + done, &n, hint);
+        if (span != NULL) {
+            n = min(n, read_len - done);
+            memcpy((char *) buff + done, span, n);
+        } else {
+            // A hole reads as zeros up to the next mapped block
+            size_t next = __myfs_extent_next_data(fsptr, fssize, errnoptr, map, (start + done) / block_size);
+            n = read_len - done;
+            if (next != SIZE_MAX) {
+                n = min(n, next * block_size - (start + done));
+            }
+            memset((char *) buff + done, 0, n);
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* Frees whatever holds the data of a file, be it blocks or fragment
+   slots, but leaves its size alone.
+*/
+void __myfs_map_release(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map) {
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, map, sizeof(struct __myfs_extent_map));
+    if (map->flags & MYFS_MAP_FRAG) {
+        __myfs_frag_release(fsptr, fssize, errnoptr, map->frag_block, map->frag_slot, map->frag_slots);
+    } else if (!(map->flags & MYFS_MAP_INLINE)) {
+        __myfs_extent_truncate(fsptr, fssize, errnoptr, map, 0);
+    }
+    memset(map->data, 0, MYFS_INLINE_DATA);
+    map->flags &= ~MYFS_MAP_SMALL;
+}
+
+/* Frees all the data of a file */
+void __myfs_free_data(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map) {
+    __myfs_map_release(fsptr, fssize, errnoptr, map);
+    map->size = 0;
+}
+
+/* Returns how many bytes a small file can hold where it is now: 0 for
+   a file without inline data or fragments.
+*/
+size_t __myfs_small_capacity(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map) {
+    if (map->flags & MYFS_MAP_INLINE) {
+        return MYFS_INLINE_DATA;
+    }
+    if (map->flags & MYFS_MAP_FRAG) {
+        return (size_t) map->frag_slots * __myfs_frag_size(fsptr, fssize, errnoptr);
+    }
+    return 0;
+}
+
+/* Makes the size bytes at data, at most __myfs_frag_max of them, the
+   whole content of the file, kept inline if they fit and in a run of
+   fragment slots otherwise. Whatever held the data before is freed,
+   so data must not point into it. An empty file is left as an empty
+   extent map. Returns -1 with ENOSPC, leaving the file as it was, if
+   there is no room for the slots.
+*/
+int __myfs_map_make_small(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, const char *data, size_t size) {
+    size_t slots = 0, slot = 0, block = 0, frag_size = __myfs_frag_size(fsptr, fssize, errnoptr);
+    char *dest = map->data;
+    if (size > MYFS_INLINE_DATA) {
+        slots = (size + frag_size - 1) / frag_size;
+        block = __myfs_frag_alloc(fsptr, fssize, errnoptr, slots, &slot);
+        if (block == 0) {
+            return -1;
+        }
+    }
+    __myfs_map_release(fsptr, fssize, errnoptr, map);
+    if (slots > 0) {
+        map->frag_block = block;
+        map->frag_slot = slot;
+        map->frag_slots = slots;
+        map->flags |= MYFS_MAP_FRAG;
+        dest = (char *) __myfs_get_block(fsptr, fssize, errnoptr, block) + slot * frag_size;
+        memset(dest + size, 0, slots * frag_size - size);
+    } else if (size > 0) {
+        map->flags |= MYFS_MAP_INLINE;
+    }
+    memcpy(dest, data, size);
+    if (slots > 0) {
+        __myfs_sync_mark(fsptr, fssize, errnoptr, dest, slots * frag_size);
+    }
+    map->size = size;
+    return 0;
+}
+
+/* Moves the data of a small file out into blocks of its own, before
+   the file grows past __myfs_frag_max bytes.
+*/
+int __myfs_map_spill(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map) {
+    char data[MYFS_FRAG_MAX];
+    struct __myfs_extent_map small = *map;
+    size_t size = map->size;
+    if (__myfs_read_data(fsptr, fssize, errnoptr, map, 0, size, data, NULL) < 0) {
+        return -1;
+    }
+    memset(map->data, 0, MYFS_INLINE_DATA);
+    map->flags &= ~MYFS_MAP_SMALL;
+    if (__myfs_map_reserve(fsptr, fssize, errnoptr, map, 0, size, NULL) < size) {
+        __myfs_extent_truncate(fsptr, fssize, errnoptr, map, 0);
+        *map = small;
+        return -1;
+    }
+    __myfs_fill_data(fsptr, fssize, errnoptr, map, 0, size, data, NULL);
+    __myfs_map_release(fsptr, fssize, errnoptr, &small);
+    return 0;
+}
+
+/* Gives to, the empty map of a new file, the data of the file with map
+   from. Blocks of data are not copied but shared, each getting another
+   reference, while a small file is copied outright, as it takes no
+   more than __myfs_frag_max bytes. Returns -1 on failure, with to left
+   holding what it got so far, for the caller to free.
+*/
+int __myfs_map_share(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *from, struct __myfs_extent_map *to) {
+    char data[MYFS_FRAG_MAX];
+    size_t logical = 0;
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, to, sizeof(struct __myfs_extent_map));
+    if (from->flags & MYFS_MAP_SMALL) {
+        if (__myfs_read_data(fsptr, fssize, errnoptr, from, 0, from->size, data, NULL) < 0) {
+            return -1;
+        }
+        return __myfs_map_make_small(fsptr, fssize, errnoptr, to, data, from->size);
+    }
+    while ((logical = __myfs_extent_next_data(fsptr, fssize, errnoptr, from, logical)) != SIZE_MAX) {
+        struct __myfs_extent *e = __myfs_extent_lookup(fsptr, fssize, errnoptr, from, logical);
+        struct __myfs_extent ext;
+        if (e == NULL) {
+            *errnoptr = EIO;
+            return -1;
+        }
+        ext = *e;
+        __myfs_share_run(fsptr, fssize, errnoptr, ext.start, ext.length);
+        to->blocks += ext.length;
+        if (__myfs_extent_insert(fsptr, fssize, errnoptr, to, ext) < 0) {
+            __myfs_release_data(fsptr, fssize, errnoptr, ext.start, ext.length);
+            to->blocks -= ext.length;
+            return -1;
+        }
+        logical = (size_t) ext.logical + ext.length;
+    }
+    to->size = from->size;
+    return 0;
+}
+
+/* Writes write_len bytes at start, growing the file as needed. A gap
+   between the old end of the file and start is left as a hole, which
+   takes no blocks and reads as zeros.
+   Returns the number of bytes written, which may be short if the
+   filesystem runs full. hint may be NULL, see __myfs_extent_lookup_hint.
+*/
+ssize_t __myfs_write_data(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t start, size_t write_len, const char *to_write,
+                          struct __myfs_extent *hint) {
+    size_t end = start + write_len, block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    size_t mapped;
+    if ((end < start) || ((end + block_size - 1) / block_size > UINT32_MAX)) {
+        *errnoptr = EFBIG;
+        return -1;
+    }
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, map, sizeof(struct __myfs_extent_map));
+    // A file without any blocks that stays small enough goes inline or into fragments
+    if (!(map->flags & MYFS_MAP_FIXED) && (map->count == 0) && (max(end, map->size) <= __myfs_frag_max(fsptr, fssize, errnoptr))) {
+        size_t size = max(end, map->size);
+        if (size > __myfs_small_capacity(fsptr, fssize, errnoptr, map)) {
+            char data[MYFS_FRAG_MAX];
+            if (__myfs_read_data(fsptr, fssize, errnoptr, map, 0, map->size, data, NULL) < 0) {
+                return -1;
+            }
+            memset(data + map->size, 0, size - map->size);
+            if (__myfs_map_make_small(fsptr, fssize, errnoptr, map, data, size) < 0) {
+                return -1;
+            }
+        }
+        if (map->flags & MYFS_MAP_FRAG) {
+            char *dest = (char *) __myfs_get_block(fsptr, fssize, errnoptr, map->frag_block) + map->frag_slot * __myfs_frag_size(fsptr, fssize, errnoptr) + start;
+            memcpy(dest, to_write, write_len);
+            __myfs_sync_mark(fsptr, fssize, errnoptr, dest, write_len);
+        } else {
+            memcpy(map->data + start, to_write, write_len);
+        }
+        map->size = size;
+        return write_len;
+    }
+    if ((map->flags & MYFS_MAP_SMALL) && (__myfs_map_spill(fsptr, fssize, errnoptr, map) < 0)) {
+        return -1;
+    }
+    // Blocks shared with a snapshot are copied before anything in them changes
+    if ((__myfs_map_unshare(fsptr, fssize, errnoptr, map, start, end, hint) < 0) ||
+        ((start > map->size) && (__myfs_zero_tail(fsptr, fssize, errnoptr, map, map->size) < 0))) {
+        return -1;
+    }
+    mapped = __myfs_map_reserve(fsptr, fssize, errnoptr, map, start, end, hint);
+    if (mapped < end) {
+        if (mapped <= start) {
+            return -1;
+        }
+        *errnoptr = 0;
+        end = mapped;
+    }
+    __myfs_fill_data(fsptr, fssize, errnoptr, map, start, end - start, to_write, hint);
+    if (end > map->size) {
+        map->size = end;
+    }
+    return end - start;
+}
+
+/* Appends data to the end of the file */
+int __myfs_append_data(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t append_size, const void *new_data) {
+    ssize_t written = __myfs_write_data(fsptr, fssize, errnoptr, map, map->size, append_size, new_data, NULL);
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    if (written < 0) {
+        return -1;
+    }
+    if ((size_t) written < append_size) {
+        // Do not leave half of a record behind
+        __myfs_extent_truncate(fsptr, fssize, errnoptr, map, (map->size - written + block_size - 1) / block_size);
+        map->size -= written;
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+    return 0;
+}
+
+/* Sets the size of a small file to new_size, at most __myfs_frag_max.
+   Shrinking never needs new space: a file in fragments gives back its
+   slots past the new end, or goes inline once it fits.
+*/
+int __myfs_truncate_small(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t new_size) {
+    char data[MYFS_FRAG_MAX];
+    size_t avail, frag_size = __myfs_frag_size(fsptr, fssize, errnoptr);
+    size_t slots = (new_size + frag_size - 1) / frag_size;
+    char *span;
+    if (new_size > __myfs_small_capacity(fsptr, fssize, errnoptr, map)) {
+        if (__myfs_read_data(fsptr, fssize, errnoptr, map, 0, map->size, data, NULL) < 0) {
+            return -1;
+        }
+        memset(data + map->size, 0, new_size - map->size);
+        return __myfs_map_make_small(fsptr, fssize, errnoptr, map, data, new_size);
+    }
+    if ((map->flags & MYFS_MAP_FRAG) && (new_size <= MYFS_INLINE_DATA)) {
+        if (__myfs_read_data(fsptr, fssize, errnoptr, map, 0, new_size, data, NULL) < 0) {
+            return -1;
+        }
+        return __myfs_map_make_small(fsptr, fssize, errnoptr, map, data, new_size);
+    }
+    if (new_size < map->size) {
+        span = __myfs_map_span(fsptr, fssize, errnoptr, map, new_size, &avail, NULL);
+        if (span != NULL) {
+            memset(span, 0, min(avail, map->size - new_size));
+            if (map->flags & MYFS_MAP_FRAG) {
+                __myfs_sync_mark(fsptr, fssize, errnoptr, span, min(avail, map->size - new_size));
+            }
+        }
+    }
+    if ((map->flags & MYFS_MAP_FRAG) && (slots < map->frag_slots)) {
+        __myfs_frag_release(fsptr, fssize, errnoptr, map->frag_block, map->frag_slot + slots, map->frag_slots - slots);
+        map->frag_slots = slots;
+    }
+    map->size = new_size;
+    return 0;
+}
+
+/* Sets the size of the file, freeing the blocks past a smaller size.
+   Growing the file only moves its end: the new part is a hole.
+   A file that shrinks to at most __myfs_frag_max bytes moves inline or
+   into fragments, unless there is no room for them.
+*/
+int __myfs_truncate_data(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *map, size_t new_size) {
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    size_t frag_max = __myfs_frag_max(fsptr, fssize, errnoptr);
+    size_t new_blocks = (new_size + block_size - 1) / block_size;
+    if (new_blocks > UINT32_MAX) {
+        *errnoptr = EFBIG;
+        return -1;
+    }
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, map, sizeof(struct __myfs_extent_map));
+    if (map->flags & MYFS_MAP_SMALL) {
+        if (new_size <= frag_max) {
+            return __myfs_truncate_small(fsptr, fssize, errnoptr, map, new_size);
+        }
+        if (__myfs_map_spill(fsptr, fssize, errnoptr, map) < 0) {
+            return -1;
+        }
+    } else if (!(map->flags & MYFS_MAP_FIXED) && (map->count > 0) && (new_size <= frag_max) && (new_size < map->size)) {
+        char data[MYFS_FRAG_MAX];
+        if (__myfs_read_data(fsptr, fssize, errnoptr, map, 0, new_size, data, NULL) < 0) {
+            return -1;
+        }
+        if (__myfs_map_make_small(fsptr, fssize, errnoptr, map, data, new_size) == 0) {
+            return 0;
+        }
+        // Without room for the slots, the file just keeps its blocks
+        *errnoptr = 0;
+    }
+    if (new_size <= map->size) {
+        __myfs_extent_truncate(fsptr, fssize, errnoptr, map, new_blocks);
+        map->size = new_size;
+        return 0;
+    }
+    if (__myfs_zero_tail(fsptr, fssize, errnoptr, map, map->size) < 0) {
+        return -1;
+    }
+    map->size = new_size;
+    return 0;
+}
+
+char *__myfs_get_parent_path(const char *str) {
+    size_t last = 0;
+    for (size_t i = 0; str[i] != 0; i++) {
+        if (str[i] == '/') {
+            last = i;
+        }
+    }
+    char *data = calloc(last + 1, sizeof(char));
+    if (data == NULL) {
+        return NULL;
+    }
+    if (last != 0) {
+        memcpy(data, str, last);
+        data[last] = 0;
+    } else {
+        data[0] = 0;
+    }
+    return data;
+}
+
+char *__myfs_get_child_path(const char *str) {
+    size_t last = 0;
+    for (size_t i = 0; str[i] != 0; i++) {
+        if (str[i] == '/') {
+            last = i;
+        }
+    }
+    size_t data_size = strlen(str) - last;
+    char *data = calloc(data_size, sizeof(char));
+    if (data == NULL) {
+        return NULL;
+    }
+    memcpy(data, str + (last + 1), data_size - 1);
+    data[data_size - 1] = 0;
+    return data;
+}
+
+
+/* Extends the hash of a path by one more component. The hash of a
+   path is built component by component, so that "", "/" and "//"
+   all hash like the root and the hash of a parent directory can be
+   extended to the hash of any of its entries.
+*/
+uint64_t __myfs_hash_name(uint64_t hash, const char *name, size_t len) {
+    hash ^= (uint64_t) '/';
+    hash *= MYFS_HASH_PRIME;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint64_t) (unsigned char) name[i];
+        hash *= MYFS_HASH_PRIME;
+    }
+    return hash;
+}
+
+uint64_t __myfs_hash_path(const char *path) {
+    uint64_t hash = MYFS_HASH_INIT;
+    while (1) {
+        while (*path == '/') {
+            path++;
+        }
+        if (*path == '\0') {
+            return hash;
+        }
+        size_t len = strcspn(path, "/");
+        hash = __myfs_hash_name(hash, path, len);
+        path += len;
+    }
+}
+
+/* The cache is two-way set associative: a path hash may sit in either
+   slot of the pair it maps to.
+*/
+struct __myfs_dcache_slot* __myfs_dcache_get_set(void *fsptr, size_t fssize, int *errnoptr, uint64_t hash) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    struct __myfs_dcache_slot *slots;
+    if (sb->dcache_slots == 0) {
+        return NULL;
+    }
+    slots = (struct __myfs_dcache_slot *) __myfs_get_block(fsptr, fssize, errnoptr, sb->dcache_block);
+    return slots + ((hash & (sb->dcache_slots - 1)) & ~((uint64_t) 1));
+}
+
+uint32_t __myfs_dcache_check(uint64_t hash, uint64_t offset, uint32_t epoch) {
+    uint64_t x = (hash ^ (offset * MYFS_HASH_PRIME) ^ epoch) * MYFS_HASH_PRIME;
+    return (uint32_t) (x >> 32);
+}
+
+/* Copies a slot field by field with atomic loads. Returns 1 if the
+   copy is a live, untorn slot, 0 otherwise.
+*/
+int __myfs_dcache_load(struct __myfs_dcache_slot *slot, struct __myfs_dcache_slot *copy) {
+    copy->hash = __atomic_load_n(&slot->hash, __ATOMIC_RELAXED);
+    copy->offset = __atomic_load_n(&slot->offset, __ATOMIC_RELAXED);
+    copy->epoch = __atomic_load_n(&slot->epoch, __ATOMIC_RELAXED);
+    copy->check = __atomic_load_n(&slot->check, __ATOMIC_RELAXED);
+    return (copy->offset != 0) && (copy->check == __myfs_dcache_check(copy->hash, copy->offset, copy->epoch));
+}
+
+/* Returns the cached entry for a path hash, or NULL on a miss. The
+   entry's name must match the last component of the path, which
+   guards against stale slots and hash collisions between names.
+*/
+struct __myfs_dir_entry *__myfs_dcache_lookup(void *fsptr, size_t fssize, int *errnoptr, uint64_t hash, const char *name, size_t len) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    struct __myfs_dcache_slot *set = __myfs_dcache_get_set(fsptr, fssize, errnoptr, hash);
+    struct __myfs_dcache_slot slot;
+    struct __myfs_dir_entry *entry;
+    if (set == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (!__myfs_dcache_load(set + i, &slot) || (slot.hash != hash) || (slot.epoch != sb->dcache_epoch)) {
+            continue;
+        }
+        if (slot.offset > fssize - MYFS_DIR_ENTRY_SIZE) {
+            continue;
+        }
+        entry = (struct __myfs_dir_entry *) ((char *) fsptr + slot.offset);
+        if ((strncmp(entry->file_name, name, len) != 0) || (entry->file_name[len] != '\0')) {
+            continue;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+void __myfs_dcache_insert(void *fsptr, size_t fssize, int *errnoptr, uint64_t hash, struct __myfs_dir_entry *entry) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    struct __myfs_dcache_slot *slot = __myfs_dcache_get_set(fsptr, fssize, errnoptr, hash);
+    struct __myfs_dcache_slot old[2];
+    uint64_t offset = (uint64_t) ((char *) entry - (char *) fsptr);
+    int live[2];
+    if (slot == NULL) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        live[i] = __myfs_dcache_load(slot + i, old + i) && (old[i].epoch == sb->dcache_epoch);
+    }
+    // Prefer the slot already holding this path, then a free one
+    if (live[0] && (old[0].hash != hash)) {
+        if (!live[1] || (old[1].hash == hash)) {
+            slot++;
+        } else {
+            slot += (hash >> 63);
+        }
+    }
+    __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->offset, offset, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->epoch, sb->dcache_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->check, __myfs_dcache_check(hash, offset, sb->dcache_epoch), __ATOMIC_RELAXED);
+}
+
+/* Drops the cached location for one path hash. Only called under the
+   exclusive lock, so no lookup can be reading the slot.
+*/
+void __myfs_dcache_forget(void *fsptr, size_t fssize, int *errnoptr, uint64_t hash) {
+    struct __myfs_dcache_slot *set = __myfs_dcache_get_set(fsptr, fssize, errnoptr, hash);
+    if (set == NULL) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (set[i].hash == hash) {
+            set[i].offset = 0;
+        }
+    }
+}
+
+/* Drops every cached location at once, for changes that affect a
+   whole subtree of paths.
+*/
+void __myfs_dcache_flush(void *fsptr, size_t fssize, int *errnoptr) {
+    __myfs_get_superblock(fsptr, fssize, errnoptr)->dcache_epoch++;
+}
+
+/* Takes a free inode and makes it an empty file of type file_type
+   with a single link, stamped with the current time. Returns its
+   number, or 0 with ENOSPC once the table is full.
+*/
+uint32_t __myfs_alloc_inode(void *fsptr, size_t fssize, int *errnoptr, enum FileType file_type) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    if (sb->inode_free == 0) {
+        *errnoptr = ENOSPC;
+        return 0;
+    }
+    for (uint32_t n = 0; n < sb->inode_count; n++) {
+        uint32_t ino = sb->next_inode;
+        struct __myfs_inode *node = __myfs_get_inode(fsptr, fssize, errnoptr, ino);
+        uint32_t generation;
+        sb->next_inode = (ino + 1 < sb->inode_count) ? ino + 1 : 1;
+        if ((node == NULL) || (node->nlink != 0)) {
+            continue;
+        }
+        generation = node->generation;
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, node, sizeof(struct __myfs_inode));
+        memset(node, 0, sizeof(struct __myfs_inode));
+        node->generation = generation;
+        node->file_type = file_type;
+        node->nlink = 1;
+        if (file_type == DIRECTORY) {
+            node->map.flags = MYFS_MAP_FIXED | MYFS_MAP_META;
+        } else if (file_type == DIR_INDEX) {
+            node->map.flags = MYFS_MAP_META;
+        }
+        clock_gettime(CLOCK_REALTIME, &node->atime);
+        node->mtime = node->atime;
+        sb->inode_free--;
+        return ino;
+    }
+    *errnoptr = ENOSPC;
+    return 0;
+}
+
+/* Drops a link to inode ino. The last one frees the inode along with
+   its data.
+*/
+void __myfs_unlink_inode(void *fsptr, size_t fssize, int *errnoptr, uint32_t ino) {
+    struct __myfs_inode *node = __myfs_get_inode(fsptr, fssize, errnoptr, ino);
+    if ((node == NULL) || (node->nlink == 0)) {
+        return;
+    }
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, node, sizeof(struct __myfs_inode));
+    node->nlink--;
+    if (node->nlink > 0) {
+        return;
+    }
+    __myfs_free_data(fsptr, fssize, errnoptr, &node->map);
+    node->generation++;
+    __myfs_get_superblock(fsptr, fssize, errnoptr)->inode_free++;
+}
+
+struct __myfs_dir_entry *__myfs_dir_entry_at(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_inode *dir, size_t index) {
+    size_t avail;
+    return (struct __myfs_dir_entry *) __myfs_map_span(fsptr, fssize, errnoptr, &dir->map, index * MYFS_DIR_ENTRY_SIZE, &avail, NULL);
+}
+
+// The entry of the index is the only one without a name
+int __myfs_dir_is_indexed(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_inode *dir) {
+    struct __myfs_dir_entry *first;
+    if (dir->map.size == 0) {
+        return 0;
+    }
+    first = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, 0);
+    return (first != NULL) && (first->file_name[0] == '\0');
+}
+
+// Returns the inode holding the index of an indexed directory
+struct __myfs_inode *__myfs_dir_index_inode(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_inode *dir) {
+    struct __myfs_dir_entry *first = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, 0);
+    if (first == NULL) {
+        return NULL;
+    }
+    return __myfs_get_inode(fsptr, fssize, errnoptr, first->inode);
+}
+
+// Number of entries in a directory, not counting its index
+size_t __myfs_dir_count(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_inode *dir) {
+    size_t count = dir->map.size / MYFS_DIR_ENTRY_SIZE;
+    if (__myfs_dir_is_indexed(fsptr, fssize, errnoptr, dir)) {
+        count--;
+    }
+    return count;
+}
+
+struct __myfs_dir_index_header *__myfs_dir_index_header(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *table) {
+    size_t avail;
+    return (struct __myfs_dir_index_header *) __myfs_map_span(fsptr, fssize, errnoptr, table, 0, &avail, NULL);
+}
+
+struct __myfs_dir_index_slot *__myfs_dir_index_slot(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *table, size_t slot) {
+    size_t avail;
+    return (struct __myfs_dir_index_slot *) __myfs_map_span(fsptr, fssize, errnoptr, table,
+            sizeof(struct __myfs_dir_index_header) + slot * sizeof(struct __myfs_dir_index_slot), &avail, NULL);
+}
+
+uint64_t __myfs_dir_index_hash(const char *name) {
+    return __myfs_hash_name(MYFS_HASH_INIT, name, strlen(name));
+}
+
+/* Returns the slot of table pointing at the entry of dir called name,
+   or NULL if there is none. Like the extent tree, the table is checked
+   against its own size before it is used, for the sake of getattr.
+*/
+struct __myfs_dir_index_slot *__myfs_dir_index_find(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_inode *dir,
+                                                    struct __myfs_extent_map *table, const char *name) {
+    struct __myfs_dir_index_header *header = __myfs_dir_index_header(fsptr, fssize, errnoptr, table);
+    uint64_t hash = __myfs_dir_index_hash(name);
+    size_t entries = dir->map.size / MYFS_DIR_ENTRY_SIZE;
+    size_t capacity, mask;
+    if (header == NULL) {
+        return NULL;
+    }
+    capacity = header->capacity;
+    if ((capacity == 0) || ((capacity & (capacity - 1)) != 0) ||
+        (sizeof(struct __myfs_dir_index_header) + capacity * sizeof(struct __myfs_dir_index_slot) > table->size)) {
+        return NULL;
+    }
+    mask = capacity - 1;
+    for (size_t i = hash & mask, n = 0; n < capacity; i = (i + 1) & mask, n++) {
+        struct __myfs_dir_index_slot *slot = __myfs_dir_index_slot(fsptr, fssize, errnoptr, table, i);
+        if ((slot == NULL) || (slot->entry == 0)) {
+            return NULL;
+        }
+        if ((slot->entry < entries) && (slot->tag == (uint32_t) (hash >> 32))) {
+            struct __myfs_dir_entry *entry = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, slot->entry);
+            if ((entry != NULL) && (strncmp(name, entry->file_name, MYFS_MAX_NAME_SIZE) == 0)) {
+                return slot;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Adds entry index under name to table, which must have room for it
+void __myfs_dir_index_put(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_extent_map *table, const char *name, size_t index) {
+    struct __myfs_dir_index_header *header = __myfs_dir_index_header(fsptr, fssize, errnoptr, table);
+    uint64_t hash = __myfs_dir_index_hash(name);
+    size_t mask = header->capacity - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct __myfs_dir_index_slot *slot = __myfs_dir_index_slot(fsptr, fssize, errnoptr, table, i);
+        if ((slot->entry == 0) || (slot->entry == MYFS_DIR_INDEX_TOMBSTONE)) {
+            __myfs_journal_dirty(fsptr, fssize, errnoptr, header, sizeof(struct __myfs_dir_index_header));
+            __myfs_journal_dirty(fsptr, fssize, errnoptr, slot, sizeof(struct __myfs_dir_index_slot));
+            if (slot->entry == MYFS_DIR_INDEX_TOMBSTONE) {
+                header->tombstones--;
+            }
+            slot->tag = (uint32_t) (hash >> 32);
+            slot->entry = index;
+            header->used++;
+            return;
+        }
+    }
+}
+
+/* Builds a fresh table over entries 1 and up of dir, sized so that it
+   is at most a quarter full.
+*/
+int __myfs_dir_index_build(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_inode *dir, struct __myfs_extent_map *table) {
+    size_t slots = dir->map.size / MYFS_DIR_ENTRY_SIZE;
+    size_t capacity = MYFS_DIR_INDEX_MIN_SLOTS;
+    while (capacity < 4 * slots) {
+        capacity *= 2;
+    }
+    size_t size = sizeof(struct __myfs_dir_index_header) + capacity * sizeof(struct __myfs_dir_index_slot);
+    memset(table, 0, sizeof(struct __myfs_extent_map));
+    table->flags = MYFS_MAP_META;
+    if (__myfs_map_reserve(fsptr, fssize, errnoptr, table, 0, size, NULL) < size) {
+        __myfs_free_data(fsptr, fssize, errnoptr, table);
+        return -1;
+    }
+    table->size = size;
+    __myfs_fill_data(fsptr, fssize, errnoptr, table, 0, size, NULL, NULL);
+    __myfs_dir_index_header(fsptr, fssize, errnoptr, table)->capacity = capacity;
+    for (size_t i = 1; i < slots; i++) {
+        __myfs_dir_index_put(fsptr, fssize, errnoptr, table, __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, i)->file_name, i);
+    }
+    return 0;
+}
+
+/* Replaces the table of an indexed directory with a freshly built one */
+int __myfs_dir_index_rebuild(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_inode *dir) {
+    struct __myfs_extent_map table;
+    struct __myfs_inode *node;
+    if (__myfs_dir_index_build(fsptr, fssize, errnoptr, dir, &table) < 0) {
+        return -1;
+    }
+    node = __myfs_dir_index_inode(fsptr, fssize, errnoptr, dir);
+    __myfs_free_data(fsptr, fssize, errnoptr, &node->map);
+    node->map = table;
+    return 0;
+}
+
+/* Looks name up in the directory dir, through its index if it has one
+   or by scanning its blocks in place otherwise.
+   Nothing is copied or allocated either way.
+   Returns a pointer to the entry inside the image and its index in
+   the directory, or NULL if there is no such entry.
+*/
+struct __myfs_dir_entry *__myfs_dir_lookup(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_inode *dir, const char *name, size_t *index) {
+    struct __myfs_span_iter iter;
+    struct __myfs_dir_entry *entries;
+    size_t avail, offset = 0;
+    if (__myfs_dir_is_indexed(fsptr, fssize, errnoptr, dir)) {
+        struct __myfs_inode *table = __myfs_dir_index_inode(fsptr, fssize, errnoptr, dir);
+        struct __myfs_dir_index_slot *slot;
+        uint32_t found;
+        if (table == NULL) {
+            return NULL;
+        }
+        slot = __myfs_dir_index_find(fsptr, fssize, errnoptr, dir, &table->map, name);
+        if (slot == NULL) {
+            return NULL;
+        }
+        found = slot->entry;
+        if (index != NULL) {
+            *index = found;
+        }
+        return __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, found);
+    }
+    __myfs_iter_init(&iter, &dir->map, 0, dir->map.size);
+    while ((entries = (struct __myfs_dir_entry *) __myfs_iter_next(fsptr, fssize, errnoptr, &iter, &avail)) != NULL) {
+        for (size_t i = 0; i < avail / MYFS_DIR_ENTRY_SIZE; i++) {
+            if (strncmp(name, entries[i].file_name, MYFS_MAX_NAME_SIZE) == 0) {
+                if (index != NULL) {
+                    *index = offset + i;
+                }
+                return entries + i;
+            }
+        }
+        offset += avail / MYFS_DIR_ENTRY_SIZE;
+    }
+    return NULL;
+}
+
+/* Adds entry to the directory dir, whose path hashes to dir_hash.
+   Fails with EEXIST if dir already holds an entry of the same name.
+   A directory that outgrows MYFS_DIR_INDEX_THRESHOLD gets an index:
+   its first entry moves to the end to make room for it.
+*/
+int __myfs_dir_add(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_inode *dir, uint64_t dir_hash, struct __myfs_dir_entry *entry) {
+    struct __myfs_dir_entry *first;
+    struct __myfs_inode *index;
+    struct __myfs_extent_map table;
+    size_t slots;
+    uint32_t ino;
+    if (__myfs_dir_lookup(fsptr, fssize, errnoptr, dir, entry->file_name, NULL) != NULL) {
+        *errnoptr = EEXIST;
+        return -1;
+    }
+    if (__myfs_append_data(fsptr, fssize, errnoptr, &dir->map, MYFS_DIR_ENTRY_SIZE, entry) < 0) {
+        return -1;
+    }
+    slots = dir->map.size / MYFS_DIR_ENTRY_SIZE;
+    if (__myfs_dir_is_indexed(fsptr, fssize, errnoptr, dir)) {
+        index = __myfs_dir_index_inode(fsptr, fssize, errnoptr, dir);
+        struct __myfs_dir_index_header *header = __myfs_dir_index_header(fsptr, fssize, errnoptr, &index->map);
+        if (2 * (header->used + header->tombstones + 1) <= header->capacity) {
+            __myfs_dir_index_put(fsptr, fssize, errnoptr, &index->map, entry->file_name, slots - 1);
+            return 0;
+        }
+        if (__myfs_dir_index_rebuild(fsptr, fssize, errnoptr, dir) < 0) {
+            __myfs_truncate_data(fsptr, fssize, errnoptr, &dir->map, dir->map.size - MYFS_DIR_ENTRY_SIZE);
+            return -1;
+        }
+        return 0;
+    }
+    if (slots <= MYFS_DIR_INDEX_THRESHOLD) {
+        return 0;
+    }
+    // Without room for an index the directory just stays flat
+    first = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, 0);
+    if (__myfs_append_data(fsptr, fssize, errnoptr, &dir->map, MYFS_DIR_ENTRY_SIZE, first) < 0) {
+        *errnoptr = 0;
+        return 0;
+    }
+    if (__myfs_dir_index_build(fsptr, fssize, errnoptr, dir, &table) < 0) {
+        __myfs_truncate_data(fsptr, fssize, errnoptr, &dir->map, dir->map.size - MYFS_DIR_ENTRY_SIZE);
+        *errnoptr = 0;
+        return 0;
+    }
+    ino = __myfs_alloc_inode(fsptr, fssize, errnoptr, DIR_INDEX);
+    if (ino == 0) {
+        __myfs_free_data(fsptr, fssize, errnoptr, &table);
+        __myfs_truncate_data(fsptr, fssize, errnoptr, &dir->map, dir->map.size - MYFS_DIR_ENTRY_SIZE);
+        *errnoptr = 0;
+        return 0;
+    }
+    __myfs_get_inode(fsptr, fssize, errnoptr, ino)->map = table;
+    first = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, 0);
+    __myfs_dcache_forget(fsptr, fssize, errnoptr, __myfs_hash_name(dir_hash, first->file_name, strlen(first->file_name)));
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, first, MYFS_DIR_ENTRY_SIZE);
+    memset(first, 0, MYFS_DIR_ENTRY_SIZE);
+    first->inode = ino;
+    return 0;
+}
+
+/* Removes the entry at index from the directory dir, whose path
+   hashes to dir_hash. The data of the entry must already be freed.
+   The gap is closed by moving the last entry into it, so removing
+   costs the same in a directory of any size. An indexed directory
+   that runs empty loses its index.
+*/
+int __myfs_dir_remove(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_inode *dir, uint64_t dir_hash, size_t index) {
+    size_t last = dir->map.size / MYFS_DIR_ENTRY_SIZE - 1;
+    struct __myfs_dir_entry *removed, *moved, *first;
+    struct __myfs_inode *table;
+    struct __myfs_dir_index_header *header;
+    struct __myfs_dir_index_slot *slot;
+    if (!__myfs_dir_is_indexed(fsptr, fssize, errnoptr, dir)) {
+        if (index != last) {
+            removed = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, index);
+            moved = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, last);
+            __myfs_dcache_forget(fsptr, fssize, errnoptr, __myfs_hash_name(dir_hash, moved->file_name, strlen(moved->file_name)));
+            __myfs_journal_dirty(fsptr, fssize, errnoptr, removed, MYFS_DIR_ENTRY_SIZE);
+            memcpy(removed, moved, MYFS_DIR_ENTRY_SIZE);
+        }
+        return __myfs_truncate_data(fsptr, fssize, errnoptr, &dir->map, last * MYFS_DIR_ENTRY_SIZE);
+    }
+    first = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, 0);
+    table = __myfs_get_inode(fsptr, fssize, errnoptr, first->inode);
+    header = __myfs_dir_index_header(fsptr, fssize, errnoptr, &table->map);
+    removed = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, index);
+    if (last == 1) {
+        __myfs_unlink_inode(fsptr, fssize, errnoptr, first->inode);
+        return __myfs_truncate_data(fsptr, fssize, errnoptr, &dir->map, 0);
+    }
+    slot = __myfs_dir_index_find(fsptr, fssize, errnoptr, dir, &table->map, removed->file_name);
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, slot, sizeof(struct __myfs_dir_index_slot));
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, header, sizeof(struct __myfs_dir_index_header));
+    slot->entry = MYFS_DIR_INDEX_TOMBSTONE;
+    header->used--;
+    header->tombstones++;
+    if (index != last) {
+        moved = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, last);
+        __myfs_dcache_forget(fsptr, fssize, errnoptr, __myfs_hash_name(dir_hash, moved->file_name, strlen(moved->file_name)));
+        slot = __myfs_dir_index_find(fsptr, fssize, errnoptr, dir, &table->map, moved->file_name);
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, slot, sizeof(struct __myfs_dir_index_slot));
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, removed, MYFS_DIR_ENTRY_SIZE);
+        slot->entry = index;
+        memcpy(removed, moved, MYFS_DIR_ENTRY_SIZE);
+    }
+    return __myfs_truncate_data(fsptr, fssize, errnoptr, &dir->map, last * MYFS_DIR_ENTRY_SIZE);
+}
+
+/* Sequence counter around changes to directories and metadata
+
+   Changes only ever happen under the exclusive lock; the counter lets
+   getattr, which takes no lock at all, see whether one overlapped with
+   it. A change makes the counter odd while it runs.
+*/
+void __myfs_seq_write_begin(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    __atomic_store_n(&sb->seq, sb->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void __myfs_seq_write_end(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    __atomic_store_n(&sb->seq, sb->seq + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t __myfs_seq_read_begin(void *fsptr, size_t fssize, int *errnoptr) {
+    return __atomic_load_n(&__myfs_get_superblock(fsptr, fssize, errnoptr)->seq, __ATOMIC_ACQUIRE);
+}
+
+/* Returns 1 if whatever was read since __myfs_seq_read_begin returned
+   seq may have been changed under the reader.
+*/
+int __myfs_seq_read_retry(void *fsptr, size_t fssize, int *errnoptr, uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return ((seq & 1) != 0) || (__atomic_load_n(&__myfs_get_superblock(fsptr, fssize, errnoptr)->seq, __ATOMIC_RELAXED) != seq);
+}
+
+/* Finds dir entry at path
+   Returns a pointer to the entry inside the image; the entry of the
+   root directory is the one in the superblock. The pointer is only
+   good until the next change to the directory holding the entry.
+   If none is found, NULL is returned and errno is populated as necessary
+   Without any lock held, fill_cache must be 0: the directories may
+   change during the walk, and what was found must not be cached.
+*/
+struct __myfs_dir_entry *__myfs_lookup_path(void *fsptr, size_t fssize, int *errnoptr, const char *path, int fill_cache) {
+    struct __myfs_dir_entry *entry = &__myfs_get_superblock(fsptr, fssize, errnoptr)->root;
+    struct __myfs_inode *dir;
+    char name[MYFS_MAX_NAME_SIZE];
+    const char *p, *last = NULL, *parent_last = NULL;
+    size_t last_len = 0, parent_last_len = 0;
+    uint64_t hash = MYFS_HASH_INIT, parent_hash = MYFS_HASH_INIT;
+    *errnoptr = 0;
+    // Hash the full path and its parent in one pass
+    p = path;
+    while (1) {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        size_t len = strcspn(p, "/");
+        if (len >= MYFS_MAX_NAME_SIZE) {
+            *errnoptr = ENAMETOOLONG;
+            return NULL;
+        }
+        parent_hash = hash;
+        parent_last = last;
+        parent_last_len = last_len;
+        hash = __myfs_hash_name(hash, p, len);
+        last = p;
+        last_len = len;
+        p += len;
+    }
+    if (last == NULL) {
+        return entry;
+    }
+    struct __myfs_dir_entry *cached = __myfs_dcache_lookup(fsptr, fssize, errnoptr, hash, last, last_len);
+    if (cached != NULL) {
+        return cached;
+    }
+    // A hit on the parent leaves a single directory to search
+    if (parent_last != NULL) {
+        cached = __myfs_dcache_lookup(fsptr, fssize, errnoptr, parent_hash, parent_last, parent_last_len);
+        if (cached != NULL) {
+            dir = __myfs_get_inode(fsptr, fssize, errnoptr, cached->inode);
+            if ((dir == NULL) || (dir->file_type != DIRECTORY)) {
+                *errnoptr = ENOTDIR;
+                return NULL;
+            }
+            memcpy(name, last, last_len);
+            name[last_len] = '\0';
+            entry = __myfs_dir_lookup(fsptr, fssize, errnoptr, dir, name, NULL);
+            if (entry == NULL) {
+                *errnoptr = ENOENT;
+                return NULL;
+            }
+            if (fill_cache) {
+                __myfs_dcache_insert(fsptr, fssize, errnoptr, hash, entry);
+            }
+            return entry;
+        }
+    }
+    // Walk down from the root, caching every directory on the way
+    hash = MYFS_HASH_INIT;
+    while (1) {
+        while (*path == '/') {
+            path++;
+        }
+        if (*path == '\0') {
+            return entry;
+        }
+        size_t len = strcspn(path, "/");
+        dir = __myfs_get_inode(fsptr, fssize, errnoptr, entry->inode);
+        if ((dir == NULL) || (dir->file_type != DIRECTORY)) {
+            *errnoptr = ENOTDIR;
+            return NULL;
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+        entry = __myfs_dir_lookup(fsptr, fssize, errnoptr, dir, name, NULL);
+        if (entry == NULL) {
+            *errnoptr = ENOENT;
+            return NULL;
+        }
+        hash = __myfs_hash_name(hash, path, len);
+        if (fill_cache) {
+            __myfs_dcache_insert(fsptr, fssize, errnoptr, hash, entry);
+        }
+        path += len;
+    }
+}
+
+struct __myfs_dir_entry *__myfs_find_path(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    return __myfs_lookup_path(fsptr, fssize, errnoptr, path, 1);
+}
+
+// Returns the inode of the file or directory at path
+struct __myfs_inode *__myfs_find_inode(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    struct __myfs_dir_entry *entry = __myfs_find_path(fsptr, fssize, errnoptr, path);
+    struct __myfs_inode *node;
+    if (entry == NULL) {
+        return NULL;
+    }
+    node = __myfs_get_inode(fsptr, fssize, errnoptr, entry->inode);
+    if (node == NULL) {
+        *errnoptr = EIO;
+    }
+    return node;
+}
+
+/* Finds the directory that is to hold the last component of path,
+   and puts that component into name and the hash of the directory's
+   path into *dir_hash.
+*/
+struct __myfs_inode *__myfs_find_parent(void *fsptr, size_t fssize, int *errnoptr, const char *path, char *name, uint64_t *dir_hash) {
+    char *t_path, *child;
+    struct __myfs_inode *parent;
+    t_path = __myfs_get_parent_path(path);
+    child = __myfs_get_child_path(path);
+    if ((t_path == NULL) || (child == NULL)) {
+        free(t_path);
+        free(child);
+        *errnoptr = ENOMEM;
+        return NULL;
+    }
+    if (strlen(child) >= MYFS_MAX_NAME_SIZE) {
+        free(t_path);
+        free(child);
+        *errnoptr = ENAMETOOLONG;
+        return NULL;
+    }
+    memset(name, 0, MYFS_MAX_NAME_SIZE);
+    strcpy(name, child);
+    free(child);
+    parent = __myfs_find_inode(fsptr, fssize, errnoptr, t_path);
+    *dir_hash = __myfs_hash_path(t_path);
+    free(t_path);
+    if ((parent != NULL) && (parent->file_type != DIRECTORY)) {
+        *errnoptr = ENOTDIR;
+        return NULL;
+    }
+    return parent;
+}
+
+/* Adds a new, empty file or directory at path */
+int __myfs_make_entry(void *fsptr, size_t fssize, int *errnoptr, const char *path, enum FileType file_type) {
+    struct __myfs_inode *parent;
+    struct __myfs_dir_entry new_f;
+    uint64_t parent_hash;
+    parent = __myfs_find_parent(fsptr, fssize, errnoptr, path, new_f.file_name, &parent_hash);
+    if (parent == NULL) {
+        return -1;
+    }
+    if (__myfs_dir_lookup(fsptr, fssize, errnoptr, parent, new_f.file_name, NULL) != NULL) {
+        *errnoptr = EEXIST;
+        return -1;
+    }
+    new_f.inode = __myfs_alloc_inode(fsptr, fssize, errnoptr, file_type);
+    if (new_f.inode == 0) {
+        return -1;
+    }
+    if (__myfs_dir_add(fsptr, fssize, errnoptr, parent, parent_hash, &new_f) < 0) {
+        __myfs_unlink_inode(fsptr, fssize, errnoptr, new_f.inode);
+        return -1;
+    }
+    if (file_type == DIRECTORY) {
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, parent, sizeof(struct __myfs_inode));
+        parent->subdirs++;
+    }
+    return 0;
+}
+
+/* Takes the entry at path out of its parent directory and puts the
+   inode it named into *ino. The inode itself is left alone.
+*/
+int __myfs_detach_entry(void *fsptr, size_t fssize, int *errnoptr, const char *path, uint32_t *ino) {
+    char name[MYFS_MAX_NAME_SIZE];
+    struct __myfs_inode *parent, *node;
+    struct __myfs_dir_entry *f;
+    size_t index;
+    uint64_t parent_hash;
+    parent = __myfs_find_parent(fsptr, fssize, errnoptr, path, name, &parent_hash);
+    if (parent == NULL) {
+        return -1;
+    }
+    f = __myfs_dir_lookup(fsptr, fssize, errnoptr, parent, name, &index);
+    if (f == NULL) {
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    *ino = f->inode;
+    node = __myfs_get_inode(fsptr, fssize, errnoptr, f->inode);
+    if ((node != NULL) && (node->file_type == DIRECTORY)) {
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, parent, sizeof(struct __myfs_inode));
+        parent->subdirs--;
+    }
+    __myfs_dcache_forget(fsptr, fssize, errnoptr, __myfs_hash_path(path));
+    return __myfs_dir_remove(fsptr, fssize, errnoptr, parent, parent_hash, index);
+}
+
+/* Removes the entry at path from its parent directory. The inode it
+   named, and its data, are freed with the last link to it.
+*/
+int __myfs_remove_entry(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    uint32_t ino;
+    if (__myfs_detach_entry(fsptr, fssize, errnoptr, path, &ino) < 0) {
+        return -1;
+    }
+    __myfs_unlink_inode(fsptr, fssize, errnoptr, ino);
+    return 0;
+}
+
+/* Moves the entry at from to to, replacing what is at to.
+
+   Only the name moves: the entry at to is pointed at the inode of from,
+   or a new one is added for it, and the one at from is taken out. No
+   data or metadata is copied, and nothing is lost if the new entry
+   does not fit.
+*/
+int __myfs_move_entry(void *fsptr, size_t fssize, int *errnoptr, const char *from, const char *to) {
+    struct __myfs_dir_entry *f, *target, file;
+    struct __myfs_inode *node, *old, *new_parent;
+    size_t from_len;
+    uint64_t new_parent_hash;
+    uint32_t ino;
+
+    f = __myfs_find_path(fsptr, fssize, errnoptr, from);
+    if (f == NULL) {
+        return -1;
+    }
+    if (strcmp(from, to) == 0) {
+        return 0;
+    }
+    // A directory cannot be moved into itself
+    from_len = strlen(from);
+    if ((strncmp(from, to, from_len) == 0) && (to[from_len] == '/')) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    file.inode = f->inode;
+    node = __myfs_get_inode(fsptr, fssize, errnoptr, file.inode);
+    if (node == NULL) {
+        *errnoptr = EIO;
+        return -1;
+    }
+    new_parent = __myfs_find_parent(fsptr, fssize, errnoptr, to, file.file_name, &new_parent_hash);
+    if (new_parent == NULL) {
+        return -1;
+    }
+    target = __myfs_dir_lookup(fsptr, fssize, errnoptr, new_parent, file.file_name, NULL);
+    *errnoptr = 0;
+    if (target == NULL) {
+        if (__myfs_dir_add(fsptr, fssize, errnoptr, new_parent, new_parent_hash, &file) < 0) {
+            return -1;
+        }
+        if (node->file_type == DIRECTORY) {
+            __myfs_journal_dirty(fsptr, fssize, errnoptr, new_parent, sizeof(struct __myfs_inode));
+            new_parent->subdirs++;
+        }
+    } else if (target->inode != file.inode) {
+        // Replace an existing target, as long as the types are compatible
+        old = __myfs_get_inode(fsptr, fssize, errnoptr, target->inode);
+        if ((old != NULL) && (old->file_type == DIRECTORY) && (node->file_type != DIRECTORY)) {
+            *errnoptr = EISDIR;
+            return -1;
+        }
+        if ((old != NULL) && (old->file_type != DIRECTORY) && (node->file_type == DIRECTORY)) {
+            *errnoptr = ENOTDIR;
+            return -1;
+        }
+        if ((old != NULL) && (old->file_type == DIRECTORY) && (old->map.size != 0)) {
+            *errnoptr = ENOTEMPTY;
+            return -1;
+        }
+        ino = target->inode;
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, target, MYFS_DIR_ENTRY_SIZE);
+        target->inode = file.inode;
+        __myfs_unlink_inode(fsptr, fssize, errnoptr, ino);
+    }
+    if (__myfs_detach_entry(fsptr, fssize, errnoptr, from, &ino) < 0) {
+        return -1;
+    }
+    if (node->file_type == DIRECTORY) {
+        // Every path below the directory changed
+        __myfs_dcache_flush(fsptr, fssize, errnoptr);
+    }
+    return 0;
+}
+
+/* Snapshots
+
+   A snapshot is a copy of the whole filesystem as it was when it was
+   taken, kept in a directory of its own under MYFS_SNAPSHOT_DIR, much
+   like the .zfs directory of ZFS: mkdir /.snapshots/<name> takes one,
+   and rmdir /.snapshots/<name> deletes it with everything in it.
+   Nothing else may change in there.
+
+   Taking a snapshot copies the metadata only: every directory and file
+   gets a new inode, and the directories new entries, but the data
+   blocks are shared, see __myfs_map_share. The snapshots themselves are
+   left out of the copy.
+*/
+#define MYFS_SNAPSHOT_DIR "/.snapshots"
+
+/* Returns how many names deep path lies below MYFS_SNAPSHOT_DIR: 0 for
+   the directory itself, 1 for a snapshot, more for what is in one, and
+   -1 for a path outside of it.
+*/
+int __myfs_snapshot_depth(const char *path) {
+    size_t len = strlen(MYFS_SNAPSHOT_DIR);
+    int depth = 0;
+    if ((strncmp(path, MYFS_SNAPSHOT_DIR, len) != 0) || ((path[len] != '\0') && (path[len] != '/'))) {
+        return -1;
+    }
+    path += len;
+    while (1) {
+        while (*path == '/') {
+            path++;
+        }
+        if (*path == '\0') {
+            return depth;
+        }
+        depth++;
+        path += strcspn(path, "/");
+    }
+}
+
+// A directory of the live tree and its copy in the snapshot, whose path hashes to hash
+struct __myfs_snapshot_dir {
+    uint32_t from;
+    uint32_t to;
+    uint64_t hash;
+};
+
+/* Deletes the snapshot at path, with everything in it. The blocks of
+   data the live files still share lose a reference only. Running out
+   of memory half way leaves the rest of the snapshot behind, without
+   an entry, for fsck to free.
+*/
+int __myfs_snapshot_delete(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    size_t count = 0, room = 64;
+    uint32_t *stack = malloc(room * sizeof(uint32_t)), *grown;
+    uint32_t ino;
+    if (stack == NULL) {
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    if (__myfs_detach_entry(fsptr, fssize, errnoptr, path, &ino) < 0) {
+        free(stack);
+        return -1;
+    }
+    stack[count++] = ino;
+    while (count > 0) {
+        struct __myfs_inode *dir;
+        ino = stack[--count];
+        dir = __myfs_get_inode(fsptr, fssize, errnoptr, ino);
+        for (size_t i = 0; i < dir->map.size / MYFS_DIR_ENTRY_SIZE; i++) {
+            struct __myfs_dir_entry *e = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, i);
+            struct __myfs_inode *child;
+            if (e == NULL) {
+                continue;
+            }
+            child = __myfs_get_inode(fsptr, fssize, errnoptr, e->inode);
+            if ((child == NULL) || (child->file_type != DIRECTORY)) {
+                __myfs_unlink_inode(fsptr, fssize, errnoptr, e->inode);
+                continue;
+            }
+            if (count == room) {
+                grown = realloc(stack, 2 * room * sizeof(uint32_t));
+                if (grown == NULL) {
+                    free(stack);
+                    __myfs_dcache_flush(fsptr, fssize, errnoptr);
+                    *errnoptr = ENOMEM;
+                    return -1;
+                }
+                stack = grown;
+                room *= 2;
+            }
+            stack[count++] = e->inode;
+        }
+        __myfs_unlink_inode(fsptr, fssize, errnoptr, ino);
+    }
+    free(stack);
+    // Every path below the snapshot is gone
+    __myfs_dcache_flush(fsptr, fssize, errnoptr);
+    return 0;
+}
+
+/* Takes a snapshot of the whole filesystem at path, which must name a
+   new directory right under MYFS_SNAPSHOT_DIR. That directory is made
+   along with the first snapshot. The tree is walked a directory at a
+   time, with the directories still to copy on a stack. A snapshot that
+   fails half way is deleted again.
+*/
+int __myfs_snapshot_take(void *fsptr, size_t fssize, int *errnoptr, const char *path) {
+    size_t count = 0, room = 64;
+    struct __myfs_snapshot_dir *stack, *grown;
+    struct __myfs_dir_entry *top;
+    int res = 0, err;
+    if (__myfs_find_path(fsptr, fssize, errnoptr, MYFS_SNAPSHOT_DIR) == NULL) {
+        *errnoptr = 0;
+        if (__myfs_make_entry(fsptr, fssize, errnoptr, MYFS_SNAPSHOT_DIR, DIRECTORY) < 0) {
+            return -1;
+        }
+    }
+    if (__myfs_make_entry(fsptr, fssize, errnoptr, path, DIRECTORY) < 0) {
+        return -1;
+    }
+    top = __myfs_find_path(fsptr, fssize, errnoptr, path);
+    stack = malloc(room * sizeof(struct __myfs_snapshot_dir));
+    if ((top == NULL) || (stack == NULL)) {
+        *errnoptr = (top == NULL) ? EIO : ENOMEM;
+        res = -1;
+    } else {
+        stack[count].from = MYFS_ROOT_INODE;
+        stack[count].to = top->inode;
+        stack[count].hash = __myfs_hash_path(path);
+        count++;
+    }
+    while ((res == 0) && (count > 0)) {
+        struct __myfs_snapshot_dir d = stack[--count];
+        struct __myfs_inode *from = __myfs_get_inode(fsptr, fssize, errnoptr, d.from);
+        struct __myfs_inode *to = __myfs_get_inode(fsptr, fssize, errnoptr, d.to);
+        for (size_t i = 0; (res == 0) && (i < from->map.size / MYFS_DIR_ENTRY_SIZE); i++) {
+            struct __myfs_dir_entry *e = __myfs_dir_entry_at(fsptr, fssize, errnoptr, from, i);
+            struct __myfs_dir_entry entry;
+            struct __myfs_inode *child, *copy;
+            // The index of a large directory is the one entry without a name; the copy gets its own
+            if ((e == NULL) || (e->file_name[0] == '\0') ||
+                ((d.from == MYFS_ROOT_INODE) && (strcmp(e->file_name, MYFS_SNAPSHOT_DIR + 1) == 0))) {
+                continue;
+            }
+            child = __myfs_get_inode(fsptr, fssize, errnoptr, e->inode);
+            if (child == NULL) {
+                *errnoptr = EIO;
+                res = -1;
+                break;
+            }
+            memcpy(entry.file_name, e->file_name, MYFS_MAX_NAME_SIZE);
+            entry.inode = __myfs_alloc_inode(fsptr, fssize, errnoptr, child->file_type);
+            if (entry.inode == 0) {
+                res = -1;
+                break;
+            }
+            copy = __myfs_get_inode(fsptr, fssize, errnoptr, entry.inode);
+            copy->atime = child->atime;
+            copy->mtime = child->mtime;
+            if (((child->file_type == REG_FILE) && (__myfs_map_share(fsptr, fssize, errnoptr, &child->map, &copy->map) < 0)) ||
+                (__myfs_dir_add(fsptr, fssize, errnoptr, to, d.hash, &entry) < 0)) {
+                __myfs_unlink_inode(fsptr, fssize, errnoptr, entry.inode);
+                res = -1;
+                break;
+            }
+            if (child->file_type != DIRECTORY) {
+                continue;
+            }
+            __myfs_journal_dirty(fsptr, fssize, errnoptr, to, sizeof(struct __myfs_inode));
+            to->subdirs++;
+            if (count == room) {
+                grown = realloc(stack, 2 * room * sizeof(struct __myfs_snapshot_dir));
+                if (grown == NULL) {
+                    *errnoptr = ENOMEM;
+                    res = -1;
+                    break;
+                }
+                stack = grown;
+                room *= 2;
+            }
+            stack[count].from = e->inode;
+            stack[count].to = entry.inode;
+            stack[count].hash = __myfs_hash_name(d.hash, entry.file_name, strlen(entry.file_name));
+            count++;
+        }
+    }
+    free(stack);
+    if (res < 0) {
+        err = *errnoptr;
+        *errnoptr = 0;
+        __myfs_snapshot_delete(fsptr, fssize, errnoptr, path);
+        *errnoptr = err;
+    }
+    return res;
+}
+
+/* State of an open file, kept by FUSE in fi->fh between calls.
+
+   inode is the number of the file's inode, which stays the same when
+   the file is renamed, and generation the inode's generation at the
+   time: a different one means the file was deleted. last is a copy of
+   the extent the previous read or write ended in. It is only good for
+   as long as the superblock's seq is the one it was found under, as a
+   truncate may free the extent.
+   Threads sharing a handle take turns through lock; one that finds it
+   taken just goes without the handle.
+*/
+struct __myfs_handle {
+    pthread_mutex_t lock;
+    uint32_t inode;
+    uint32_t generation;
+    uint32_t seq;
+    struct __myfs_extent last;
+};
+
+/* Returns the inode of the file open through handle h, resolving path
+   again only if the file was deleted since the last call.
+*/
+struct __myfs_inode *__myfs_handle_inode(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_handle *h, const char *path) {
+    uint32_t seq = __myfs_seq_read_begin(fsptr, fssize, errnoptr);
+    struct __myfs_dir_entry *f;
+    struct __myfs_inode *node = __myfs_get_inode(fsptr, fssize, errnoptr, h->inode);
+    if (h->seq != seq) {
+        memset(&h->last, 0, sizeof(struct __myfs_extent));
+        h->seq = seq;
+    }
+    if ((node != NULL) && (node->nlink != 0) && (node->generation == h->generation)) {
+        return node;
+    }
+    h->inode = 0;
+    f = __myfs_find_path(fsptr, fssize, errnoptr, path);
+    if (f == NULL) {
+        return NULL;
+    }
+    node = __myfs_get_inode(fsptr, fssize, errnoptr, f->inode);
+    if (node == NULL) {
+        *errnoptr = EIO;
+        return NULL;
+    }
+    h->inode = f->inode;
+    h->generation = node->generation;
+    memset(&h->last, 0, sizeof(struct __myfs_extent));
+    return node;
+}
+
+/* End of helper functions */
+
+
+/* Implements an emulation of the stat system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+   
+   If path can be followed and describes a file or directory 
+   that exists and is accessable, the access information is 
+   put into stbuf. 
+
+   On success, 0 is returned. On failure, -1 is returned and 
+   the appropriate error code is put into *errnoptr.
+
+   man 2 stat documents all possible error codes and gives more detail
+   on what fields of stbuf need to be filled in. Essentially, only the
+   following fields need to be supported:
+
+   st_uid      the value passed in argument
+   st_gid      the value passed in argument
+   st_mode     (as fixed values S_IFDIR | 0755 for directories,
+                                S_IFREG | 0755 for files)
+   st_nlink    (as many as there are subdirectories (not files) for directories
+                (including . and ..),
+                1 for files)
+   st_size     (supported only for files, where it is the real file size)
+   st_atim
+   st_mtim
+
+*/
+int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf) {
+    struct __myfs_dir_entry *e;
+    struct __myfs_inode *f;
+    struct stat st;
+    uint32_t seq;
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    /* getattr is called without any lock. The lookup and the copy of
+       the metadata are thrown away and redone if a change overlapped
+       with them; after a few tries the caller is asked, with EAGAIN,
+       to take the lock instead.
+    */
+    for (int attempt = 0; attempt < MYFS_SEQ_RETRIES; attempt++) {
+        seq = __myfs_seq_read_begin(fsptr, fssize, errnoptr);
+        *errnoptr = 0;
+        st = *stbuf;
+        f = NULL;
+        e = __myfs_lookup_path(fsptr, fssize, errnoptr, path, 0);
+        if (e != NULL) {
+            f = __myfs_get_inode(fsptr, fssize, errnoptr, e->inode);
+            if (f == NULL) {
+                *errnoptr = ENOENT;
+            }
+        }
+        if (f != NULL) {
+            if (f->file_type == DIRECTORY) {
+                st.st_nlink = (nlink_t) f->subdirs + 2;
+                st.st_mode = S_IFDIR | 0755;
+            }
+            if (f->file_type == REG_FILE) {
+                st.st_size = (off_t) f->map.size;
+                st.st_nlink = (nlink_t) f->nlink;
+                st.st_mode = S_IFREG | 0755;
+            }
+            st.st_ino = (ino_t) e->inode;
+            st.st_blocks = (blkcnt_t) f->map.blocks * (__myfs_block_size(fsptr, fssize, errnoptr) / 512);
+            if (f->map.flags & MYFS_MAP_FRAG) {
+                st.st_blocks = (blkcnt_t) (f->map.frag_slots * __myfs_frag_size(fsptr, fssize, errnoptr) + 511) / 512;
+            }
+            st.st_blksize = (blksize_t) __myfs_block_size(fsptr, fssize, errnoptr);
+            st.st_atim = f->atime;
+            st.st_mtim = f->mtime;
+            st.st_uid = uid;
+            st.st_gid = gid;
+            if (__myfs_snapshot_depth(path) > 0) {
+                st.st_mode &= ~0222;
+            }
+        }
+        if (!__myfs_seq_read_retry(fsptr, fssize, errnoptr, seq)) {
+            if (f == NULL) {
+                return -1;
+            }
+            *stbuf = st;
+            return 0;
+        }
+    }
+    *errnoptr = EAGAIN;
+    return -1;
+}
+
+/* Implements an emulation of the readdir system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   If path can be followed and describes a directory that exists and
+   is accessable, the names of the subdirectories and files 
+   contained in that directory are output into *namesptr. The . and ..
+   directories must not be included in that listing.
+
+   If it needs to output file and subdirectory names, the function
+   starts by allocating (with calloc) an array of pointers to
+   characters of the right size (n entries for n names). Sets
+   *namesptr to that pointer. It then goes over all entries
+   in that array and allocates, for each of them an array of
+   characters of the right size (to hold the i-th name, together 
+   with the appropriate '\0' terminator). It puts the pointer
+   into that i-th array entry and fills the allocated array
+   of characters with the appropriate name. The calling function
+   will call free on each of the entries of *namesptr and 
+   on *namesptr.
+
+   The function returns the number of names that have been 
+   put into namesptr. 
+
+   If no name needs to be reported because the directory does
+   not contain any file or subdirectory besides . and .., 0 is 
+   returned and no allocation takes place.
+
+   On failure, -1 is returned and the *errnoptr is set to 
+   the appropriate error code. 
+
+   The error codes are documented in man 2 readdir.
+
+   In the case memory allocation with malloc/calloc fails, failure is
+   indicated by returning -1 and setting *errnoptr to EINVAL.
+
+*/ 
+int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, char ***namesptr) {
+	*errnoptr=0;
+	__myfs_try_build(fsptr,fssize,errnoptr);
+	if(*errnoptr!=0){
+		return -1;
+	}
+	struct __myfs_inode *d = __myfs_find_inode(fsptr,fssize,errnoptr,path);
+	if(d==NULL){
+		return -1;
+
+	}
+	if(d->file_type!=DIRECTORY){
+		*errnoptr=ENOTDIR;
+		return -1;
+	}
+
+	int out = __myfs_dir_count(fsptr,fssize,errnoptr,d);
+	if(out==0){
+		return 0;
+	}
+	namesptr[0]=calloc(out,sizeof(char*));
+	if(namesptr[0]==NULL){
+		*errnoptr=EINVAL;
+		return -1;
+	}
+
+	// The names are read straight out of the directory's blocks
+	// and the index of a large directory is not a name
+	struct __myfs_span_iter iter;
+	struct __myfs_dir_entry *dirs;
+	size_t avail, j=0;
+	__myfs_iter_init(&iter,&d->map,0,d->map.size);
+	while((dirs=(struct __myfs_dir_entry*)__myfs_iter_next(fsptr,fssize,errnoptr,&iter,&avail))!=NULL){
+		for(size_t i=0;i<avail/sizeof(struct __myfs_dir_entry);i++){
+			if(dirs[i].file_name[0]=='\0'){
+				continue;
+			}
+			namesptr[0][j]=strdup(dirs[i].file_name);
+			if(namesptr[0][j]==NULL){
+				*errnoptr=EINVAL;
+			}
+			j++;
+		}
+	}
+	if(*errnoptr!=0){
+		for(size_t i=0;i<j;i++){
+			free(namesptr[0][i]);
+		}
+		free(namesptr[0]);
+		namesptr[0]=NULL;
+		return -1;
+	}
+	return out;
+}
+
+/* Implements an emulation of the mknod system call for regular files
+   on the filesystem of size fssize pointed to by fsptr.
+
+   This function is called only for the creation of regular files.
+
+   If a file gets created, it is of size zero and has default
+   ownership and mode bits.
+
+   The call creates the file indicated by path.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 mknod.
+
+*/
+int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path) {
+    int res;
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    // The name of the snapshot directory is kept for it
+    if (__myfs_snapshot_depth(path) >= 0) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+    __myfs_seq_write_begin(fsptr, fssize, errnoptr);
+    res = __myfs_make_entry(fsptr, fssize, errnoptr, path, REG_FILE);
+    __myfs_seq_write_end(fsptr, fssize, errnoptr);
+    return res;
+}
+
+/* Implements an emulation of the unlink system call for regular files
+   on the filesystem of size fssize pointed to by fsptr.
+
+   This function is called only for the deletion of regular files.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 unlink.
+
+*/
+int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path) {
+    struct __myfs_inode *f;
+    int res;
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    if (__myfs_snapshot_depth(path) > 0) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+    f = __myfs_find_inode(fsptr, fssize, errnoptr, path);
+    if (f == NULL) {
+        return -1;
+    }
+    if (f->file_type != REG_FILE) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    __myfs_seq_write_begin(fsptr, fssize, errnoptr);
+    res = __myfs_remove_entry(fsptr, fssize, errnoptr, path);
+    __myfs_seq_write_end(fsptr, fssize, errnoptr);
+    return res;
+}
+
+/* Implements an emulation of the rmdir system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   The call deletes the directory indicated by path.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The function call must fail when the directory indicated by path is
+   not empty (if there are files or subdirectories other than . and ..).
+
+   The error codes are documented in man 2 rmdir.
+
+   A snapshot is deleted with everything in it, see
+   __myfs_snapshot_delete.
+
+*/
+int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path) {
+    struct __myfs_inode *f;
+    int res, depth;
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    depth = __myfs_snapshot_depth(path);
+    if ((depth == 0) || (depth > 1)) {
+        *errnoptr = (depth == 0) ? EBUSY : EROFS;
+        return -1;
+    }
+    f = __myfs_find_inode(fsptr, fssize, errnoptr, path);
+    if (f == NULL) {
+        return -1;
+    }
+    if (f->file_type != DIRECTORY) {
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+    if (f == __myfs_get_inode(fsptr, fssize, errnoptr, MYFS_ROOT_INODE)) {
+        *errnoptr = EBUSY;
+        return -1;
+    }
+    if ((depth < 0) && (f->map.size != 0)) {
+        *errnoptr = ENOTEMPTY;
+        return -1;
+    }
+    __myfs_seq_write_begin(fsptr, fssize, errnoptr);
+    if (depth == 1) {
+        res = __myfs_snapshot_delete(fsptr, fssize, errnoptr, path);
+    } else {
+        res = __myfs_remove_entry(fsptr, fssize, errnoptr, path);
+    }
+    __myfs_seq_write_end(fsptr, fssize, errnoptr);
+    return res;
+}
+
+/* Implements an emulation of the mkdir system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   The call creates the directory indicated by path.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 mkdir.
+
+   A directory right under MYFS_SNAPSHOT_DIR is a snapshot of the
+   whole filesystem, see __myfs_snapshot_take.
+
+*/
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path) {
+    int res, depth;
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    depth = __myfs_snapshot_depth(path);
+    if (depth > 1) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+    __myfs_seq_write_begin(fsptr, fssize, errnoptr);
+    if (depth == 1) {
+        res = __myfs_snapshot_take(fsptr, fssize, errnoptr, path);
+    } else {
+        res = __myfs_make_entry(fsptr, fssize, errnoptr, path, DIRECTORY);
+    }
+    __myfs_seq_write_end(fsptr, fssize, errnoptr);
+    return res;
+}
+
+/* Implements an emulation of the rename system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   The call moves the file or directory indicated by from to to.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   Caution: the function does more than what is hinted to by its name.
+   In cases the from and to paths differ, the file is moved out of 
+   the from path and added to the to path.
+
+   The error codes are documented in man 2 rename.
+
+*/
+int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *from, const char *to) {
+    int res;
+
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    // The snapshots stay where they are, and nothing moves into or out of them
+    if ((__myfs_snapshot_depth(from) == 0) || (__myfs_snapshot_depth(to) == 0)) {
+        *errnoptr = EBUSY;
+        return -1;
+    }
+    if ((__myfs_snapshot_depth(from) > 0) || (__myfs_snapshot_depth(to) > 0)) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+    __myfs_seq_write_begin(fsptr, fssize, errnoptr);
+    res = __myfs_move_entry(fsptr, fssize, errnoptr, from, to);
+    __myfs_seq_write_end(fsptr, fssize, errnoptr);
+    return res;
+}
+
+/* Implements an emulation of the truncate system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   The call changes the size of the file indicated by path to offset
+   bytes.
+
+   When the file becomes smaller due to the call, the extending bytes are
+   removed. When it becomes larger, zeros are appended.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 truncate.
+
+*/
+int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, off_t offset) {
+	struct __myfs_inode *f;
+    int res;
+
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    if (__myfs_snapshot_depth(path) > 0) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+    f = __myfs_find_inode(fsptr, fssize, errnoptr, path);
+    if (f == NULL) {
+        return -1;
+    }
+    if (f->file_type != REG_FILE) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    __myfs_seq_write_begin(fsptr, fssize, errnoptr);
+    res = __myfs_truncate_data(fsptr, fssize, errnoptr, &f->map, (size_t) offset);
+    __myfs_seq_write_end(fsptr, fssize, errnoptr);
+    return res;
+}
+
+/* Implements an emulation of the open system call on the filesystem 
+   of size fssize pointed to by fsptr, without actually performing the opening
+   of the file (no file descriptor is returned).
+
+   The call just checks if the file (or directory) indicated by path
+   can be accessed, i.e. if the path can be followed to an existing
+   object for which the access rights are granted.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The two only interesting error codes are 
+
+   * EFAULT: the filesystem is in a bad state, we can't do anything
+
+   * ENOENT: the file that we are supposed to open doesn't exist (or a
+             subpath).
+
+   It is possible to restrict ourselves to only these two error
+   conditions. It is also possible to implement more detailed error
+   condition answers.
+
+   The error codes are documented in man 2 open.
+
+*/
+int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path) {
+	struct __myfs_inode *f;
+
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    f = __myfs_find_inode(fsptr, fssize, errnoptr, path);
+    if (f == NULL) {
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    if (f->file_type != REG_FILE) {
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    return 0;
+}
+
+/* Same as __myfs_open_implem, but also sets up a handle for the open
+   file and puts it into *fh, to be passed to the read and write calls
+   and freed with __myfs_release_fh_implem once the file is closed.
+*/
+int __myfs_open_fh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, uint64_t *fh) {
+    struct __myfs_handle *h;
+    if (__myfs_open_implem(fsptr, fssize, errnoptr, path) < 0) {
+        return -1;
+    }
+    h = calloc(1, sizeof(struct __myfs_handle));
+    if (h == NULL) {
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_init(&h->lock, NULL);
+    *fh = (uint64_t) (uintptr_t) h;
+    return 0;
+}
+
+/* Frees a handle made by __myfs_open_fh_implem */
+void __myfs_release_fh_implem(uint64_t fh) {
+    struct __myfs_handle *h = (struct __myfs_handle *) (uintptr_t) fh;
+    if (h == NULL) {
         return;
     }
-    fat->is_used = (unsigned short) 1;
-    __myfs_write_data(fsptr, fssize, errnoptr, *block, 0, size_read - size_remove, data);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+}
+
+/* __myfs_read_implem for a file opened with __myfs_open_fh_implem.
+   fh is the handle it returned, or 0 to go without one.
+*/
+int __myfs_read_fh_implem(void *fsptr, size_t fssize, int *errnoptr, uint64_t fh,
+                          const char *path, char *buf, size_t size, off_t offset) {
+    struct __myfs_handle *h = (struct __myfs_handle *) (uintptr_t) fh;
+    struct __myfs_inode *f;
+    ssize_t res;
+
+	*errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
     if (*errnoptr != 0) {
-        return;
+        return -1;
+    }
+    if ((h != NULL) && (pthread_mutex_trylock(&h->lock) != 0)) {
+        h = NULL;
+    }
+    f = (h != NULL) ? __myfs_handle_inode(fsptr, fssize, errnoptr, h, path) : __myfs_find_inode(fsptr, fssize, errnoptr, path);
+    if (f == NULL) {
+        res = -1;
+    } else if (f->file_type == DIRECTORY) {
+        *errnoptr = EISDIR;
+        res = -1;
+    } else if (offset < 0) {
+        *errnoptr = EINVAL;
+        res = -1;
+    } else {
+        res = __myfs_read_data(fsptr, fssize, errnoptr, &f->map, offset, size, buf, (h != NULL) ? &h->last : NULL);
+    }
+    if (h != NULL) {
+        pthread_mutex_unlock(&h->lock);
+    }
+    if (res < 0) {
+        return -1;
     }
-    free(data);
-    return;
+    return res;
 }
 
-/* End of helper functions */
+/* Implements an emulation of the read system call on the filesystem 
+   of size fssize pointed to by fsptr.
 
+   The call copies up to size bytes from the file indicated by 
+   path into the buffer, starting to read at offset. See the man page
+   for read for the details when offset is beyond the end of the file etc.
+   
+   On success, the appropriate number of bytes read into the buffer is
+   returned. The value zero is returned on an end-of-file condition.
 
-/* Implements an emulation of the stat system call on the filesystem 
-   of size fssize pointed to by fsptr. 
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 read.
+
+*/
+int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset) {
+    return __myfs_read_fh_implem(fsptr, fssize, errnoptr, 0, path, buf, size, offset);
+}
+
+/* __myfs_write_implem for a file opened with __myfs_open_fh_implem.
+   fh is the handle it returned, or 0 to go without one.
+*/
+int __myfs_write_fh_implem(void *fsptr, size_t fssize, int *errnoptr, uint64_t fh,
+                           const char *path, const char *buf, size_t size, off_t offset) {
+    struct __myfs_handle *h = (struct __myfs_handle *) (uintptr_t) fh;
+    struct __myfs_inode *f;
+    ssize_t res;
+
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    if (__myfs_snapshot_depth(path) > 0) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+    if ((h != NULL) && (pthread_mutex_trylock(&h->lock) != 0)) {
+        h = NULL;
+    }
+    f = (h != NULL) ? __myfs_handle_inode(fsptr, fssize, errnoptr, h, path) : __myfs_find_inode(fsptr, fssize, errnoptr, path);
+    if (f == NULL) {
+        res = -1;
+    } else if (f->file_type == DIRECTORY) {
+        *errnoptr = EISDIR;
+        res = -1;
+    } else if (offset < 0) {
+        *errnoptr = EINVAL;
+        res = -1;
+    } else if (size == 0) {
+        res = 0;
+    } else {
+        res = __myfs_write_data(fsptr, fssize, errnoptr, &f->map, offset, size, buf, (h != NULL) ? &h->last : NULL);
+    }
+    if (h != NULL) {
+        pthread_mutex_unlock(&h->lock);
+    }
+    if (res < 0) {
+        return -1;
+    }
+    return res;
+}
+
+/* Implements an emulation of the write system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   The call copies up to size bytes to the file indicated by 
+   path into the buffer, starting to write at offset. See the man page
+   for write for the details when offset is beyond the end of the file etc.
    
-   If path can be followed and describes a file or directory 
-   that exists and is accessable, the access information is 
-   put into stbuf. 
+   On success, the appropriate number of bytes written into the file is
+   returned. The value zero is returned on an end-of-file condition.
 
-   On success, 0 is returned. On failure, -1 is returned and 
-   the appropriate error code is put into *errnoptr.
+   On failure, -1 is returned and *errnoptr is set appropriately.
 
-   man 2 stat documents all possible error codes and gives more detail
-   on what fields of stbuf need to be filled in. Essentially, only the
-   following fields need to be supported:
+   The error codes are documented in man 2 write.
 
-   st_uid      the value passed in argument
-   st_gid      the value passed in argument
-   st_mode     (as fixed values S_IFDIR | 0755 for directories,
-                                S_IFREG | 0755 for files)
-   st_nlink    (as many as there are subdirectories (not files) for directories
-                (including . and ..),
-                1 for files)
-   st_size     (supported only for files, where it is the real file size)
-   st_atim
-   st_mtim
+*/
+int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset) {
+    return __myfs_write_fh_implem(fsptr, fssize, errnoptr, 0, path, buf, size, offset);
+}
 
+/* Reports how fragmented the data of the file or directory indicated
+   by path is: *blocks is set to the number of data blocks it holds and
+   *runs to the number of runs of them that lie next to each other in
+   the image, in the order of the file. A file in one piece has one
+   run, and one with every block somewhere else has as many runs as
+   blocks. Holes do not count as breaks. A file kept inline or in
+   fragments has no blocks of its own and reports 0 for both.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
 */
-int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
-                          uid_t uid, gid_t gid,
-                          const char *path, struct stat *stbuf) {
-    size_t len;
+int __myfs_fragmentation_implem(void *fsptr, size_t fssize, int *errnoptr,
+                                const char *path, size_t *blocks, size_t *runs) {
+    struct __myfs_inode *f;
+    size_t logical = 0, next = 0;
+
+    *errnoptr = 0;
+    *blocks = 0;
+    *runs = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    f = __myfs_find_inode(fsptr, fssize, errnoptr, path);
+    if (f == NULL) {
+        return -1;
+    }
+    if (f->map.flags & MYFS_MAP_SMALL) {
+        return 0;
+    }
+    while ((logical = __myfs_extent_next_data(fsptr, fssize, errnoptr, &f->map, logical)) != SIZE_MAX) {
+        struct __myfs_extent *e = __myfs_extent_lookup(fsptr, fssize, errnoptr, &f->map, logical);
+        if (e == NULL) {
+            *errnoptr = EIO;
+            return -1;
+        }
+        if (e->start != next) {
+            (*runs)++;
+        }
+        *blocks += e->length;
+        next = e->start + e->length;
+        logical = (size_t) e->logical + e->length;
+    }
+    return 0;
+}
+
+/* Implements an emulation of the utimensat system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   The call changes the access and modification times of the file
+   or directory indicated by path to the values in ts.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 utimensat.
+
+*/
+int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          const char *path, const struct timespec ts[2]) {
+    struct __myfs_inode *f;
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    if (__myfs_snapshot_depth(path) > 0) {
+        *errnoptr = EROFS;
+        return -1;
+    }
+	f = __myfs_find_inode(fsptr, fssize, errnoptr, path);
+    if (f == NULL) {
+        return -1;
+    }
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, f, sizeof(struct __myfs_inode));
+    __myfs_seq_write_begin(fsptr, fssize, errnoptr);
+    f->atime = ts[0];
+    f->mtime = ts[1];
+    __myfs_seq_write_end(fsptr, fssize, errnoptr);
+	return 0;
+}
+
+/* Implements an emulation of the statfs system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   The call gets information of the filesystem usage and puts in 
+   into stbuf.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 statfs.
+
+   Essentially, only the following fields of struct statvfs need to be
+   supported:
+
+   f_bsize   fill with what you call a block (typically 1024 bytes)
+   f_blocks  fill with the total number of blocks in the filesystem
+   f_bfree   fill with the free number of blocks in the filesystem
+   f_bavail  fill with same value as f_bfree
+   f_namemax fill with your maximum file/directory name, if your
+             filesystem has such a maximum
+
+*/
+int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         struct statvfs *stbuf) {
+    struct __myfs_superblock* sb;
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    stbuf->f_bsize = sb->block_size;
+    stbuf->f_blocks = sb->block_count;
+    stbuf->f_bfree = __myfs_get_num_free_blocks(fsptr, fssize, errnoptr);
+    stbuf->f_bavail = stbuf->f_bfree;
+    stbuf->f_files = sb->inode_count;
+    stbuf->f_ffree = sb->inode_free;
+    stbuf->f_favail = stbuf->f_ffree;
+    stbuf->f_namemax = MYFS_MAX_NAME_SIZE - 1;
+    return 0;
+}
+
+// Returns 1 if the count blocks from start on are among the first limit blocks
+int __myfs_check_blocks(size_t start, size_t count, size_t limit) {
+    return (start <= limit) && (count <= limit - start);
+}
+
+/* Checks that the superblock of the filesystem of size fssize pointed
+   to by fsptr can be gone by: that it is of this version, with a valid
+   block size, and that every part of the image it points to lies
+   within fssize and has entries in the FAT. It runs before the journal
+   is replayed, when the superblock may be from the middle of an
+   operation a crash cut short. Growing sets up a part before the
+   superblock points to it, and fssize never shrinks, so any superblock
+   a crash can leave behind passes.
+
+   Returns 0 if the superblock is fine, and -1 with *errnoptr set to
+   EFAULT if it is not.
+*/
+int __myfs_check_superblock(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t block_size, header, limit, end, state_blocks;
+    if ((fssize < MYFS_HEADER_SIZE) || (sb->version != MYFS_VERSION)) {
+        goto bad;
+    }
+    block_size = sb->block_size;
+    if ((block_size < MYFS_MIN_BLOCK_SIZE) || (block_size > MYFS_MAX_BLOCK_SIZE) || ((block_size & (block_size - 1)) != 0)) {
+        goto bad;
+    }
+    if ((sb->block_capacity % MYFS_BITMAP_WORD_BITS != 0) || (sb->block_capacity > fssize / MYFS_FAT_SIZE)) {
+        goto bad;
+    }
+    header = __myfs_layout_header(sb->block_capacity);
+    if (header > fssize) {
+        goto bad;
+    }
+    // The slices of the FAT follow each other, from block_capacity on
+    if ((sb->fat_slices == 0) || (sb->fat_slices > MYFS_FAT_SLICES) || (sb->fat_capacity < sb->block_capacity) ||
+        (sb->fat_capacity % MYFS_BITMAP_WORD_BITS != 0) || ((sb->fat_slices > 1) && (sb->fat_first[1] != sb->block_capacity))) {
+        goto bad;
+    }
+    limit = min((fssize - header) / block_size, sb->fat_capacity);
+    for (size_t s = 1; s < sb->fat_slices; s++) {
+        end = (s + 1 < sb->fat_slices) ? sb->fat_first[s + 1] : sb->fat_capacity;
+        if ((sb->fat_first[s] % MYFS_BITMAP_WORD_BITS != 0) || (end < sb->fat_first[s]) ||
+            (end - sb->fat_first[s] > fssize / MYFS_FAT_SIZE) ||
+            !__myfs_check_blocks(sb->fat_block[s], __myfs_fat_slice_blocks(end - sb->fat_first[s], block_size), limit)) {
+            goto bad;
+        }
+    }
+    if ((sb->block_count > limit) || (sb->frag_list >= limit) ||
+        !__myfs_check_blocks(sb->dcache_block, (sb->dcache_slots * sizeof(struct __myfs_dcache_slot) + block_size - 1) / block_size, limit)) {
+        goto bad;
+    }
+    if ((sb->inode_groups == 0) || (sb->inode_groups > MYFS_INODE_GROUPS) || (sb->inode_first[0] != 0) ||
+        (sb->inode_count <= MYFS_ROOT_INODE)) {
+        goto bad;
+    }
+    for (size_t g = 0; g < sb->inode_groups; g++) {
+        end = (g + 1 < sb->inode_groups) ? sb->inode_first[g + 1] : sb->inode_count;
+        if ((end < sb->inode_first[g]) ||
+            !__myfs_check_blocks(sb->inode_block[g], ((end - sb->inode_first[g]) * sizeof(struct __myfs_inode) + block_size - 1) / block_size, limit)) {
+            goto bad;
+        }
+    }
+    if (sb->journal_blocks != 0) {
+        state_blocks = 1 + (3 * __myfs_journal_map_words(fsptr, fssize, errnoptr) * sizeof(uint64_t) + block_size - 1) / block_size;
+        if (!__myfs_check_blocks(sb->journal_block, sb->journal_blocks, limit) ||
+            !__myfs_check_blocks(sb->journal_state_block, state_blocks, limit)) {
+            goto bad;
+        }
+    }
+    if (((sb->journal_next_blocks != 0) && !__myfs_check_blocks(sb->journal_next_block, sb->journal_next_blocks, limit)) ||
+        ((sb->journal_old_blocks != 0) && !__myfs_check_blocks(sb->journal_old_block, sb->journal_old_blocks, limit))) {
+        goto bad;
+    }
+    return 0;
+bad:
+    *errnoptr = EFAULT;
+    return -1;
+}
+
+/* Makes the filesystem of size fssize pointed to by fsptr ready for
+   use, building it if there is none yet, with blocks of block_size
+   bytes and room to grow up to max_size bytes. An existing filesystem
+   keeps the block size it was built with. The journal is replayed, so that whatever a crash
+   left behind is brought back to the last commit, and the state that
+   only made sense to the process that had the filesystem mounted
+   before is reset. If fssize is larger than the filesystem, the
+   filesystem grows into the extra space.
+
+   Must be called once, before any other operation.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+*/
+int __myfs_mount_implem(void *fsptr, size_t fssize, int *errnoptr, size_t max_size, size_t block_size) {
+    struct __myfs_superblock* sb;
+    *errnoptr = 0;
+    if (*(uint64_t *) fsptr != MYFS_MAGIC) {
+        __myfs_build(fsptr, fssize, errnoptr, max_size, block_size);
+        if (*errnoptr != 0) {
+            return -1;
+        }
+    }
+    // Nothing goes by the superblock before it is checked, the replay included
+    if (__myfs_check_superblock(fsptr, fssize, errnoptr) < 0) {
+        return -1;
+    }
+    sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    if ((sb->journal_blocks != 0) && (__myfs_journal_replay(fsptr, fssize, errnoptr) < 0)) {
+        return -1;
+    }
+    // The replay may have brought back another superblock
+    if (__myfs_check_superblock(fsptr, fssize, errnoptr) < 0) {
+        return -1;
+    }
+    sb->seq = 0;
+    sb->frag_lock = 0;
+    __myfs_dcache_flush(fsptr, fssize, errnoptr);
+    if (sb->journal_blocks != 0) {
+        struct __myfs_journal_state *state = __myfs_journal_get_state(fsptr, fssize, errnoptr);
+        memset(state, 0, sizeof(struct __myfs_journal_state));
+        pthread_mutex_init(&state->lock, NULL);
+        memset(__myfs_journal_get_maps(fsptr, fssize, errnoptr), 0, 3 * __myfs_journal_map_words(fsptr, fssize, errnoptr) * sizeof(uint64_t));
+    }
+    if (__myfs_grow(fsptr, fssize, errnoptr) < 0) {
+        return -1;
+    }
+    // Nothing tells what the replay and the last mount left unwritten
+    if (msync(fsptr, fssize, MS_SYNC) != 0) {
+        *errnoptr = EIO;
+        return -1;
+    }
+    if (__myfs_journal_checkpoint(fsptr, fssize, errnoptr) < 0) {
+        return -1;
+    }
+    return __myfs_journal_switch(fsptr, fssize, errnoptr);
+}
+
+/* Returns 1 if fewer than 1/MYFS_GROW_FREE of the blocks of the
+   filesystem are free and it has room to grow, and 0 otherwise. Takes
+   no lock.
+*/
+int __myfs_grow_due_implem(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t count;
+    if ((*(uint64_t *) fsptr != MYFS_MAGIC) || (sb->version != MYFS_VERSION)) {
+        return 0;
+    }
+    count = __myfs_get_fat_size(fsptr, fssize, errnoptr);
+    return ((count < sb->fat_capacity) || (sb->fat_slices < MYFS_FAT_SLICES)) &&
+           (__myfs_get_num_free_blocks(fsptr, fssize, errnoptr) < count / MYFS_GROW_FREE);
+}
+
+/* Returns the size the filesystem of size fssize pointed to by fsptr
+   is to grow to: twice its size, but no larger than it has room for
+   once the FAT cannot get another slice. Returns 0 if it cannot grow
+   any further.
+*/
+size_t __myfs_grow_size_implem(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t end;
+    *errnoptr = 0;
+    if ((*(uint64_t *) fsptr != MYFS_MAGIC) || (sb->version != MYFS_VERSION)) {
+        return 0;
+    }
+    if (sb->fat_slices < MYFS_FAT_SLICES) {
+        return 2 * fssize;
+    }
+    if (__myfs_get_fat_size(fsptr, fssize, errnoptr) >= sb->fat_capacity) {
+        return 0;
+    }
+    end = __myfs_layout_header(sb->block_capacity) + sb->fat_capacity * sb->block_size;
+    return (fssize < end) ? min(2 * fssize, end) : 0;
+}
+
+/* Takes the space between the end of the filesystem pointed to by
+   fsptr and fssize into use, as far as the filesystem has room for it.
+   The memory up to fssize must be mapped before, and must stay mapped
+   at the same address. Must be called with no other operation going
+   on.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+*/
+int __myfs_grow_implem(void *fsptr, size_t fssize, int *errnoptr) {
     *errnoptr = 0;
     __myfs_try_build(fsptr, fssize, errnoptr);
     if (*errnoptr != 0) {
         return -1;
     }
-    struct __myfs_dir_entry f = __myfs_find_path(fsptr, fssize, errnoptr, path);
-    if (*errnoptr != 0) {
+    if (__myfs_grow(fsptr, fssize, errnoptr) < 0) {
         return -1;
     }
-    if (f.file_type == DIRECTORY) {
-        len = (size_t) 0;
-        free(__myfs_load_mem(fsptr, fssize, errnoptr, f.file_block, &len));
-        stbuf->st_nlink = (short) len / sizeof(struct __myfs_dir_entry);
-        stbuf->st_nlink += (short) 2;
-        stbuf->st_mode = S_IFDIR | 0755;
-    }
-    if (f.file_type == REG_FILE) {
-        len = 0;
-        free(__myfs_load_mem(fsptr, fssize, errnoptr, f.file_block, &len));
-        stbuf->st_size = (off_t) len;
-        stbuf->st_mode = S_IFREG | 0755;
+    // The image did grow: should the new journal fail to take over, the next mount retries
+    if ((__myfs_get_superblock(fsptr, fssize, errnoptr)->journal_next_blocks != 0) &&
+        (__myfs_journal_checkpoint(fsptr, fssize, errnoptr) == 0)) {
+        __myfs_journal_switch(fsptr, fssize, errnoptr);
     }
-    stbuf->st_atim = f.atime;
-    stbuf->st_mtim = f.mtime;
-    stbuf->st_uid = uid;
-    stbuf->st_gid = gid;
+    *errnoptr = 0;
     return 0;
 }
 
-/* Implements an emulation of the readdir system call on the filesystem 
-   of size fssize pointed to by fsptr. 
-
-   If path can be followed and describes a directory that exists and
-   is accessable, the names of the subdirectories and files 
-   contained in that directory are output into *namesptr. The . and ..
-   directories must not be included in that listing.
-
-   If it needs to output file and subdirectory names, the function
-   starts by allocating (with calloc) an array of pointers to
-   characters of the right size (n entries for n names). Sets
-   *namesptr to that pointer. It then goes over all entries
-   in that array and allocates, for each of them an array of
-   characters of the right size (to hold the i-th name, together 
-   with the appropriate '\0' terminator). It puts the pointer
-   into that i-th array entry and fills the allocated array
-   of characters with the appropriate name. The calling function
-   will call free on each of the entries of *namesptr and 
-   on *namesptr.
-
-   The function returns the number of names that have been 
-   put into namesptr. 
-
-   If no name needs to be reported because the directory does
-   not contain any file or subdirectory besides . and .., 0 is 
-   returned and no allocation takes place.
-
-   On failure, -1 is returned and the *errnoptr is set to 
-   the appropriate error code. 
+/* Returns 1 if enough changes piled up since the last commit that the
+   next one should not wait any longer, and 0 otherwise. Takes no lock.
+*/
+int __myfs_journal_due_implem(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    struct __myfs_journal_state *state;
+    size_t journal_blocks = __atomic_load_n(&sb->journal_blocks, __ATOMIC_RELAXED);
+    if ((*(uint64_t *) fsptr != MYFS_MAGIC) || (sb->version != MYFS_VERSION) || (journal_blocks == 0)) {
+        return 0;
+    }
+    state = __myfs_journal_get_state(fsptr, fssize, errnoptr);
+    return (__atomic_load_n(&state->dirty, __ATOMIC_RELAXED) >= min(MYFS_JOURNAL_BATCH, journal_blocks / 4)) ||
+           __atomic_load_n(&state->overflow, __ATOMIC_RELAXED) ||
+           (__atomic_load_n(&state->head, __ATOMIC_RELAXED) >= journal_blocks / 2);
+}
 
-   The error codes are documented in man 2 readdir.
+/* Makes every change made to the filesystem of size fssize pointed to
+   by fsptr so far durable, writing the metadata to the journal and
+   the journal to the disk. Must be called with no other operation
+   going on.
 
-   In the case memory allocation with malloc/calloc fails, failure is
-   indicated by returning -1 and setting *errnoptr to EINVAL.
+   On success, 0 is returned.
 
-*/ 
-int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
-                          const char *path, char ***namesptr) {
-	*errnoptr=0;
-	struct __myfs_dir_entry d = __myfs_find_path(fsptr,fssize,errnoptr,path);
-	if(*errnoptr!=0){
-		return -1;
+   On failure, -1 is returned and *errnoptr is set appropriately.
 
-	}
-	if(d.file_type!=DIRECTORY){
-		*errnoptr=ENOTDIR;
-		return -1;
-	}
+*/
+int __myfs_commit_implem(void *fsptr, size_t fssize, int *errnoptr) {
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    return __myfs_journal_commit(fsptr, fssize, errnoptr);
+}
 
-	size_t memory_size=0;
-	struct __myfs_dir_entry* dirs = __myfs_load_mem(fsptr,fssize,errnoptr,d.file_block,&memory_size);	
-	if(*errnoptr!=0){
-		return -1;
-	}
-	namesptr[0]=calloc(memory_size/sizeof(struct __myfs_dir_entry)+2,sizeof(char*));
+/* Writes everything changed in the filesystem of size fssize pointed
+   to by fsptr back to the disk and empties the journal, as is done before unmounting.
+   Must be called with no other operation going on.
 
+   On success, 0 is returned.
 
-	for(size_t i=0;i<memory_size/sizeof(struct __myfs_dir_entry);i++){
-		namesptr[0][i]=calloc(strlen(dirs[i].file_name)+1,sizeof(char));
-		strcpy(namesptr[0][i],dirs[i].file_name);
+   On failure, -1 is returned and *errnoptr is set appropriately.
 
-	}
-	int out = memory_size/sizeof(struct __myfs_dir_entry);
-	return out;
+*/
+int __myfs_checkpoint_implem(void *fsptr, size_t fssize, int *errnoptr) {
+    *errnoptr = 0;
+    __myfs_try_build(fsptr, fssize, errnoptr);
+    if (*errnoptr != 0) {
+        return -1;
+    }
+    return __myfs_journal_checkpoint(fsptr, fssize, errnoptr);
 }
 
-/* Implements an emulation of the mknod system call for regular files
-   on the filesystem of size fssize pointed to by fsptr.
-
-   This function is called only for the creation of regular files.
-
-   If a file gets created, it is of size zero and has default
-   ownership and mode bits.
+/* Implements an emulation of the fsync system call on the filesystem
+   of size fssize pointed to by fsptr, as far as the file data goes.
 
-   The call creates the file indicated by path.
+   The call writes the file data changed since it was last written back
+   to the disk: all of it, or, if datasync is set, just that of the file
+   indicated by path, which must not change meanwhile. It leaves the
+   metadata to __myfs_commit_implem, which is to follow.
 
    On success, 0 is returned.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
 
-   The error codes are documented in man 2 mknod.
+   The error codes are documented in man 2 fsync.
 
 */
-int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path) {
-    size_t last, next_dir_len;
-    char *t_path;
-    struct __myfs_dir_entry f, new_f;
+int __myfs_fsync_implem(void *fsptr, size_t fssize, int *errnoptr,
+                        const char *path, int datasync) {
+    struct __myfs_inode *f;
     *errnoptr = 0;
     __myfs_try_build(fsptr, fssize, errnoptr);
     if (*errnoptr != 0) {
         return -1;
     }
-    // 1. strip off last part of path
-    // a. finding last /
-    last = strrchr(path, '/') - path;
-    t_path = __myfs_get_parent_path(path);
-    f = __myfs_find_path(fsptr, fssize, errnoptr, t_path);
-    if (*errnoptr != 0) {
-        return -1;
+    if (!datasync) {
+        return __myfs_sync_all(fsptr, fssize, errnoptr);
     }
-    // Next build new dir entry
-    next_dir_len = (strlen(path) - 1) - last;
-    if (next_dir_len > MYFS_MAX_NAME_SIZE) {
-        *errnoptr = ENAMETOOLONG;
+    f = __myfs_find_inode(fsptr, fssize, errnoptr, path);
+    if (f == NULL) {
         return -1;
     }
-    char *new_name = __myfs_get_child_path(path);
-    memcpy(new_f.file_name, new_name, strlen(new_name) + 1);
-    new_f.file_block = __myfs_alloc_block(fsptr, fssize, errnoptr);
-    new_f.file_type = REG_FILE;
-    free(new_name);
-    // Finally append
-    __myfs_append_data(fsptr, fssize, errnoptr, f.file_block, sizeof(struct __myfs_dir_entry), &new_f);
-    return 0;
+    return __myfs_sync_map(fsptr, fssize, errnoptr, &f->map);
 }
 
-/* Implements an emulation of the unlink system call for regular files
-   on the filesystem of size fssize pointed to by fsptr.
+/* Writes file data of the filesystem of size fssize pointed to by fsptr
+   back to the disk, as a background flusher does: starting at unit
+   *cursor, until about max_units changed units are written or the end
+   of the filesystem is reached. *cursor is left where the next call is
+   to go on, or at 0 once the whole filesystem was covered.
 
-   This function is called only for the deletion of regular files.
+   Unlike the other calls, this one may run while other operations are
+   going on, without any lock. It must not overlap with another call
+   writing data back, __myfs_fsync_implem included, as that one could
+   find a unit already taken and return before the unit is written.
 
    On success, 0 is returned.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
 
-   The error codes are documented in man 2 unlink.
+*/
+int __myfs_writeback_implem(void *fsptr, size_t fssize, int *errnoptr,
+                            size_t *cursor, size_t max_units) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    *errnoptr = 0;
+    if ((*(uint64_t *) fsptr != MYFS_MAGIC) || (sb->version != MYFS_VERSION)) {
+        *cursor = 0;
+        return 0;
+    }
+    return __myfs_sync_some(fsptr, fssize, errnoptr, cursor, max_units);
+}
 
+/* Returns 1 if at least threshold bytes of file data are waiting to be
+   written back, and 0 otherwise. Takes no lock.
 */
-int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path) {
-    char *t_path;
-    struct __myfs_dir_entry f, parent, *dirs;
-    size_t dirs_size;
-    // a. finding last /
-    t_path = __myfs_get_parent_path(path);
-    f = __myfs_find_path(fsptr, fssize, errnoptr, path);
-    parent = __myfs_find_path(fsptr, fssize, errnoptr, t_path);
-    dirs = __myfs_load_mem(fsptr, fssize, errnoptr, parent.file_block, &dirs_size);
-    for (size_t i = 0; i < dirs_size / sizeof(struct __myfs_dir_entry); i++) {
-        if (strcmp(f.file_name, dirs[i].file_name) == 0) {
-            if (dirs[i].file_type != REG_FILE) {
-                *errnoptr = EISDIR;
-                return -1;
-            }
-            __myfs_free_data(fsptr, fssize, errnoptr, dirs[i].file_block);
-            __myfs_remove_data(fsptr, fssize, errnoptr, &parent.file_block, i * sizeof(struct __myfs_dir_entry), sizeof(struct __myfs_dir_entry));
-            free(t_path);
-            return 0;
-        }
+int __myfs_writeback_due_implem(void *fsptr, size_t fssize, int *errnoptr, size_t threshold) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    if ((*(uint64_t *) fsptr != MYFS_MAGIC) || (sb->version != MYFS_VERSION) ||
+        (__atomic_load_n(&sb->journal_blocks, __ATOMIC_RELAXED) == 0)) {
+        return 0;
     }
-    free(t_path);
-    *errnoptr = ENOENT;
-    return -1;
+    return __atomic_load_n(&__myfs_journal_get_state(fsptr, fssize, errnoptr)->unsynced, __ATOMIC_RELAXED) * sb->block_size >= threshold;
 }
 
-/* Implements an emulation of the rmdir system call on the filesystem 
-   of size fssize pointed to by fsptr. 
+/* Offline check and repair
+
+   __myfs_fsck_implem checks an image nobody has mounted. It walks the
+   directory tree from the root, checking every extent map on the way,
+   and writes down in kind which blocks the tree holds and what their
+   FAT entries must say, and in frags which slots of fragment blocks
+   it holds, or how many files hold a block of data. A single pass over the bitmap and the FAT then sets the
+   two against each other, so even a multi-GB image costs one sweep
+   over its allocation tables rather than a lookup per block: a block
+   marked used that nothing holds was leaked and is freed, and a block
+   that is held but marked free is taken back. Inodes in use that no
+   entry names are orphans and are freed, their blocks with the sweep.
+   The references on blocks of data shared with snapshots are set to
+   the number of files found holding them.
+
+   A map that points outside of the image, is out of order or shares
+   blocks with a map seen before, other than blocks of data, cannot be
+   trusted at all: it is emptied, and the blocks stay with the map
+   seen first. Entries that
+   name a free inode, or a directory named elsewhere already, are
+   dropped.
+
+   Repairs go through the journal like any other change. Nothing is
+   allocated before the sweep is done, as a block marked free may
+   still belong to a file not reached yet, so the indexes of
+   directories that lost entries are rebuilt at the very end.
+*/
+struct __myfs_fsck_range {
+    uint64_t start;
+    uint32_t length;
+    uint32_t kind;
+};
 
-   The call deletes the directory indicated by path.
+/* The state of a check. ranges holds the blocks of the map being
+   checked; for a fragment, length is the mask of its slots instead.
+   stack holds the inodes reached but not checked yet, and reindex the
+   directories whose index is to be rebuilt.
+*/
+struct __myfs_fsck {
+    int repair;
+    FILE *log;
+    size_t problems;
+    uint8_t *kind;
+    uint32_t *frags;
+    uint32_t *links;
+    uint32_t *subdirs;
+    struct __myfs_fsck_range *ranges;
+    size_t range_count;
+    size_t range_room;
+    uint32_t *stack;
+    size_t stack_count;
+    size_t stack_room;
+    uint32_t *reindex;
+    size_t reindex_count;
+    size_t reindex_room;
+    size_t map_blocks;
+    uint64_t map_end;
+    size_t shared;
+};
 
-   On success, 0 is returned.
+void __myfs_fsck_report(struct __myfs_fsck *ck, const char *format, ...) {
+    va_list args;
+    ck->problems++;
+    if (ck->log == NULL) {
+        return;
+    }
+    va_start(args, format);
+    vfprintf(ck->log, format, args);
+    va_end(args);
+    fputc('\n', ck->log);
+}
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+// Makes room for one more item of size bytes in *array, which holds count of them
+int __myfs_fsck_room(void **array, size_t count, size_t *room, size_t size) {
+    void *grown;
+    if (count < *room) {
+        return 0;
+    }
+    grown = realloc(*array, max(2 * *room, (size_t) 64) * size);
+    if (grown == NULL) {
+        return -1;
+    }
+    *array = grown;
+    *room = max(2 * *room, (size_t) 64);
+    return 0;
+}
 
-   The function call must fail when the directory indicated by path is
-   not empty (if there are files or subdirectories other than . and ..).
+int __myfs_fsck_add(struct __myfs_fsck *ck, uint64_t start, uint32_t length, uint32_t kind) {
+    if (__myfs_fsck_room((void **) &ck->ranges, ck->range_count, &ck->range_room, sizeof(struct __myfs_fsck_range)) < 0) {
+        return -1;
+    }
+    ck->ranges[ck->range_count].start = start;
+    ck->ranges[ck->range_count].length = length;
+    ck->ranges[ck->range_count].kind = kind;
+    ck->range_count++;
+    return 0;
+}
 
-   The error codes are documented in man 2 rmdir.
+int __myfs_fsck_push(uint32_t **array, size_t *count, size_t *room, uint32_t ino) {
+    if (__myfs_fsck_room((void **) array, *count, room, sizeof(uint32_t)) < 0) {
+        return -1;
+    }
+    (*array)[(*count)++] = ino;
+    return 0;
+}
 
+/* Collects the blocks of one level of an extent tree, and of the levels
+   below it, into ck->ranges. *end is the file block every extent from
+   here on has to start at or after. Returns 1 if the tree makes no
+   sense, and -1 on failure.
 */
-int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path) {
-    char *t_path;
-    struct __myfs_dir_entry f, parent, *dirs;
-    size_t dirs_size;
-    t_path = __myfs_get_parent_path(path);
-    f = __myfs_find_path(fsptr, fssize, errnoptr, path);
-    parent = __myfs_find_path(fsptr, fssize, errnoptr, t_path);
-    dirs = __myfs_load_mem(fsptr, fssize, errnoptr, parent.file_block, &dirs_size);
-    for (size_t i = 0; i < dirs_size / sizeof(struct __myfs_dir_entry); i++) {
-        if (strcmp(f.file_name, dirs[i].file_name) == 0) {
-            if (dirs[i].file_type != DIRECTORY) {
-                *errnoptr = ENOTDIR;
+int __myfs_fsck_level(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_fsck *ck, struct __myfs_extent *entries,
+                      uint32_t count, uint32_t depth, uint32_t kind, uint64_t *end) {
+    size_t fat_size = __myfs_get_fat_size(fsptr, fssize, errnoptr);
+    for (uint32_t i = 0; i < count; i++) {
+        struct __myfs_extent *e = entries + i;
+        struct __myfs_extent_node *node;
+        int res;
+        if ((e->start == 0) || (e->start >= fat_size) || (e->logical < *end)) {
+            return 1;
+        }
+        if (depth == 0) {
+            if ((e->length == 0) || (e->length > fat_size - e->start)) {
+                return 1;
+            }
+            if (__myfs_fsck_add(ck, e->start, e->length, kind) < 0) {
                 return -1;
             }
-            __myfs_free_data(fsptr, fssize, errnoptr, dirs[i].file_block);
-            __myfs_remove_data(fsptr, fssize, errnoptr, &parent.file_block, i*sizeof(struct __myfs_dir_entry), sizeof(struct __myfs_dir_entry));
-            free(t_path);
-            return 0;
+            ck->map_blocks += e->length;
+            *end = (uint64_t) e->logical + e->length;
+            continue;
+        }
+        node = __myfs_get_extent_node(fsptr, fssize, errnoptr, e->start);
+        if ((node->depth != depth - 1) || (node->count > __myfs_node_extents(fsptr, fssize, errnoptr))) {
+            return 1;
+        }
+        if (__myfs_fsck_add(ck, e->start, 1, MYFS_FAT_META) < 0) {
+            return -1;
+        }
+        ck->map_blocks++;
+        *end = e->logical;
+        res = __myfs_fsck_level(fsptr, fssize, errnoptr, ck, node->entries, node->count, depth - 1, kind, end);
+        if (res != 0) {
+            return res;
         }
     }
-    free(t_path);
-    *errnoptr = ENOENT;
-      return -1;
+    return 0;
 }
 
-/* Implements an emulation of the mkdir system call on the filesystem 
-   of size fssize pointed to by fsptr. 
+/* Collects the blocks of map into ck->ranges, its data blocks as kind.
+   Returns 1 if the map makes no sense, and -1 on failure.
+*/
+int __myfs_fsck_collect(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_fsck *ck, struct __myfs_extent_map *map, uint32_t kind) {
+    size_t fat_size = __myfs_get_fat_size(fsptr, fssize, errnoptr);
+    int res;
+    ck->range_count = 0;
+    ck->map_blocks = 0;
+    ck->map_end = 0;
+    if (((map->flags & MYFS_MAP_SMALL) == MYFS_MAP_SMALL) || ((map->flags & MYFS_MAP_SMALL) && (map->flags & MYFS_MAP_FIXED))) {
+        return 1;
+    }
+    if (map->flags & MYFS_MAP_INLINE) {
+        return map->size > MYFS_INLINE_DATA;
+    }
+    if (map->flags & MYFS_MAP_FRAG) {
+        if ((map->frag_block == 0) || (map->frag_block >= fat_size) || (map->frag_slots == 0) ||
+            ((size_t) map->frag_slot + map->frag_slots > MYFS_FRAG_SLOTS) ||
+            (map->size > map->frag_slots * __myfs_frag_size(fsptr, fssize, errnoptr))) {
+            return 1;
+        }
+        return __myfs_fsck_add(ck, map->frag_block, ((((uint32_t) 1) << map->frag_slots) - 1) << map->frag_slot, MYFS_FAT_FRAG);
+    }
+    if ((map->depth > MYFS_MAX_DEPTH) || (map->count > MYFS_INLINE_EXTENTS)) {
+        return 1;
+    }
+    res = __myfs_fsck_level(fsptr, fssize, errnoptr, ck, map->root, map->count, map->depth, kind, &ck->map_end);
+    if (res < 0) {
+        *errnoptr = ENOMEM;
+    }
+    return res;
+}
 
-   The call creates the directory indicated by path.
+// Gives back the first count ranges of ck->ranges
+void __myfs_fsck_unclaim(struct __myfs_fsck *ck, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        struct __myfs_fsck_range *r = ck->ranges + i;
+        if (r->kind == MYFS_FAT_FRAG) {
+            ck->frags[r->start] &= ~r->length;
+            if (ck->frags[r->start] == 0) {
+                ck->kind[r->start] = 0;
+            }
+        } else if (r->kind == 1) {
+            for (size_t b = r->start; b < r->start + r->length; b++) {
+                if (--ck->frags[b] == 0) {
+                    ck->kind[b] = 0;
+                }
+            }
+        } else {
+            memset(ck->kind + r->start, 0, r->length);
+        }
+    }
+}
 
-   On success, 0 is returned.
+/* Marks the blocks in ck->ranges as held. Returns 1, with nothing
+   marked, if any of them is held already, unless it is a block of
+   data held by other files only, which a snapshot shares with them.
+*/
+int __myfs_fsck_claim(struct __myfs_fsck *ck) {
+    for (size_t i = 0; i < ck->range_count; i++) {
+        struct __myfs_fsck_range *r = ck->ranges + i;
+        if (r->kind == MYFS_FAT_FRAG) {
+            if (((ck->kind[r->start] != 0) && (ck->kind[r->start] != MYFS_FAT_FRAG)) || ((ck->frags[r->start] & r->length) != 0)) {
+                __myfs_fsck_unclaim(ck, i);
+                return 1;
+            }
+            ck->kind[r->start] = MYFS_FAT_FRAG;
+            ck->frags[r->start] |= r->length;
+            continue;
+        }
+        for (size_t b = r->start; b < r->start + r->length; b++) {
+            if ((ck->kind[b] != 0) && ((r->kind != 1) || (ck->kind[b] != 1) || (ck->frags[b] == 0))) {
+                __myfs_fsck_unclaim(ck, i);
+                return 1;
+            }
+        }
+        memset(ck->kind + r->start, r->kind, r->length);
+        for (size_t b = r->start; (r->kind == 1) && (b < r->start + r->length); b++) {
+            ck->frags[b]++;
+        }
+    }
+    return 0;
+}
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+/* Checks map, the map of inode ino, and claims its blocks. A map that
+   makes no sense or shares blocks with one seen before is emptied
+   when repairing. Returns 0 if the map is fine, 1 if it is not, and
+   -1 on failure.
+*/
+int __myfs_fsck_check_map(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_fsck *ck, uint32_t ino,
+                          struct __myfs_extent_map *map, uint32_t kind) {
+    int res = __myfs_fsck_collect(fsptr, fssize, errnoptr, ck, map, kind);
+    if (res == 0) {
+        res = __myfs_fsck_claim(ck);
+        if (res != 0) {
+            __myfs_fsck_report(ck, "inode %u: shares blocks with another file", ino);
+        }
+    } else if (res > 0) {
+        __myfs_fsck_report(ck, "inode %u: bad extent map", ino);
+    }
+    if (res <= 0) {
+        return res;
+    }
+    if (ck->repair) {
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, map, sizeof(struct __myfs_extent_map));
+        memset(map->data, 0, MYFS_INLINE_DATA);
+        map->size = 0;
+        map->depth = 0;
+        map->count = 0;
+        map->blocks = 0;
+        map->flags &= ~MYFS_MAP_SMALL;
+        ck->range_count = 0;
+    }
+    return 1;
+}
 
-   The error codes are documented in man 2 mkdir.
+/* Goes on with map once its blocks are claimed: frees the blocks past
+   the end of the file, which a crash in the middle of a truncate may
+   leave behind, and puts right the count of its blocks and its tail.
+   Returns -1 on failure.
+*/
+int __myfs_fsck_finish_map(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_fsck *ck, uint32_t ino,
+                           struct __myfs_extent_map *map, uint32_t kind) {
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    struct __myfs_extent_map copy;
+    if (!(map->flags & MYFS_MAP_SMALL) && (ck->map_end > (map->size + block_size - 1) / block_size)) {
+        __myfs_fsck_report(ck, "inode %u: blocks past the end of the file", ino);
+        if (ck->repair) {
+            __myfs_fsck_unclaim(ck, ck->range_count);
+            __myfs_extent_truncate(fsptr, fssize, errnoptr, map, (map->size + block_size - 1) / block_size);
+            if ((__myfs_fsck_collect(fsptr, fssize, errnoptr, ck, map, kind) != 0) || (__myfs_fsck_claim(ck) != 0)) {
+                return -1;
+            }
+        }
+    }
+    if (map->blocks != ck->map_blocks) {
+        __myfs_fsck_report(ck, "inode %u: counts %u blocks instead of %zu", ino, map->blocks, ck->map_blocks);
+        if (ck->repair) {
+            __myfs_journal_dirty(fsptr, fssize, errnoptr, map, sizeof(struct __myfs_extent_map));
+            map->blocks = ck->map_blocks;
+        }
+    }
+    if (!(map->flags & MYFS_MAP_SMALL) && (map->depth > 0)) {
+        copy = *map;
+        __myfs_extent_find_tail(fsptr, fssize, errnoptr, &copy);
+        if (copy.tail != map->tail) {
+            __myfs_fsck_report(ck, "inode %u: tail of the extent tree is off", ino);
+            if (ck->repair) {
+                __myfs_journal_dirty(fsptr, fssize, errnoptr, map, sizeof(struct __myfs_extent_map));
+                map->tail = copy.tail;
+            }
+        }
+    }
+    return 0;
+}
 
+/* Checks the directory with inode ino: its own map, then its entries,
+   then its index. The entries still to keep are moved together over
+   the ones dropped, and the directory is cut down to them. Returns -1
+   on failure.
 */
-int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path) {
-    char *t_path, *new_name;
-    struct __myfs_dir_entry f, new_f;
-    size_t last, next_dir_len;
-    *errnoptr = 0;
-    __myfs_try_build(fsptr, fssize, errnoptr);
-    if (*errnoptr != 0) {
+int __myfs_fsck_dir(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_fsck *ck, uint32_t ino) {
+    struct __myfs_inode *dir = __myfs_get_inode(fsptr, fssize, errnoptr, ino);
+    struct __myfs_inode *table;
+    size_t count, kept = 0;
+    uint32_t index = 0, subdirs = 0;
+    int indexed, changed = 0, res;
+    res = __myfs_fsck_check_map(fsptr, fssize, errnoptr, ck, ino, &dir->map, MYFS_FAT_META);
+    if ((res < 0) || ((res > 0) && !ck->repair)) {
+        return min(res, 0);
+    }
+    // The blocks are claimed for good once the directory stopped changing
+    __myfs_fsck_unclaim(ck, ck->range_count);
+    if (dir->map.size % MYFS_DIR_ENTRY_SIZE != 0) {
+        __myfs_fsck_report(ck, "directory %u: size %zu is not a whole number of entries", ino, (size_t) dir->map.size);
+        changed = 1;
+    }
+    count = dir->map.size / MYFS_DIR_ENTRY_SIZE;
+    indexed = __myfs_dir_is_indexed(fsptr, fssize, errnoptr, dir);
+    for (size_t i = 0; i < count; i++) {
+        struct __myfs_dir_entry *e = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, i);
+        struct __myfs_inode *child;
+        if (e == NULL) {
+            __myfs_fsck_report(ck, "directory %u: hole at entry %zu", ino, i);
+            changed = 1;
+            break;
+        }
+        child = __myfs_get_inode(fsptr, fssize, errnoptr, e->inode);
+        if ((i == 0) && indexed) {
+            if ((child == NULL) || (child->file_type != DIR_INDEX) || (child->nlink == 0) || (ck->links[e->inode] != 0)) {
+                __myfs_fsck_report(ck, "directory %u: bad index", ino);
+                changed = 1;
+                indexed = 0;
+                continue;
+            }
+            index = e->inode;
+            ck->links[index]++;
+            kept++;
+            continue;
+        }
+        if ((memchr(e->file_name, '\0', MYFS_MAX_NAME_SIZE) == NULL) || (e->file_name[0] == '\0') || (strchr(e->file_name, '/') != NULL)) {
+            __myfs_fsck_report(ck, "directory %u: entry %zu has a bad name", ino, i);
+            changed = 1;
+            continue;
+        }
+        if ((child == NULL) || (e->inode == MYFS_ROOT_INODE) || (child->nlink == 0) ||
+            ((child->file_type != DIRECTORY) && (child->file_type != REG_FILE)) ||
+            ((child->file_type == DIRECTORY) && (ck->links[e->inode] != 0))) {
+            __myfs_fsck_report(ck, "directory %u: entry %s names bad inode %u", ino, e->file_name, e->inode);
+            changed = 1;
+            continue;
+        }
+        if ((ck->links[e->inode]++ == 0) && (__myfs_fsck_push(&ck->stack, &ck->stack_count, &ck->stack_room, e->inode) < 0)) {
+            *errnoptr = ENOMEM;
+            return -1;
+        }
+        if (child->file_type == DIRECTORY) {
+            subdirs++;
+        }
+        if ((kept != i) && ck->repair) {
+            struct __myfs_dir_entry *to = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, kept);
+            __myfs_journal_dirty(fsptr, fssize, errnoptr, to, MYFS_DIR_ENTRY_SIZE);
+            memcpy(to, e, MYFS_DIR_ENTRY_SIZE);
+        }
+        kept++;
+    }
+    ck->subdirs[ino] = subdirs;
+    if (changed && ck->repair) {
+        // An index with no entries left goes, like in __myfs_dir_remove
+        if (indexed && (kept == 1)) {
+            ck->links[index]--;
+            indexed = 0;
+            kept = 0;
+        }
+        if (__myfs_truncate_data(fsptr, fssize, errnoptr, &dir->map, kept * MYFS_DIR_ENTRY_SIZE) < 0) {
+            return -1;
+        }
+        if (indexed && (__myfs_fsck_push(&ck->reindex, &ck->reindex_count, &ck->reindex_room, ino) < 0)) {
+            *errnoptr = ENOMEM;
+            return -1;
+        }
+    }
+    if ((__myfs_fsck_collect(fsptr, fssize, errnoptr, ck, &dir->map, MYFS_FAT_META) != 0) || (__myfs_fsck_claim(ck) != 0) ||
+        (__myfs_fsck_finish_map(fsptr, fssize, errnoptr, ck, ino, &dir->map, MYFS_FAT_META) < 0)) {
+        return -1;
+    }
+    if (!indexed) {
+        return 0;
+    }
+    table = __myfs_get_inode(fsptr, fssize, errnoptr, index);
+    res = __myfs_fsck_check_map(fsptr, fssize, errnoptr, ck, index, &table->map, MYFS_FAT_META);
+    if ((res == 0) && (__myfs_fsck_finish_map(fsptr, fssize, errnoptr, ck, index, &table->map, MYFS_FAT_META) < 0)) {
+        return -1;
+    }
+    if ((res < 0) || (changed && ck->repair)) {
+        return min(res, 0);
+    }
+    // Every entry must be found through the index, where it is
+    for (size_t i = 1; (res == 0) && (i < kept); i++) {
+        struct __myfs_dir_entry *e = __myfs_dir_entry_at(fsptr, fssize, errnoptr, dir, i);
+        struct __myfs_dir_index_slot *slot = __myfs_dir_index_find(fsptr, fssize, errnoptr, dir, &table->map, e->file_name);
+        if ((slot == NULL) || (slot->entry != i)) {
+            __myfs_fsck_report(ck, "directory %u: index out of date", ino);
+            res = 1;
+        }
+    }
+    if ((res > 0) && ck->repair && (__myfs_fsck_push(&ck->reindex, &ck->reindex_count, &ck->reindex_room, ino) < 0)) {
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/* Marks count blocks from start on as held by the metadata. Returns -1
+   if they are not all inside the image.
+*/
+int __myfs_fsck_meta(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_fsck *ck, size_t start, size_t count, uint32_t kind) {
+    if ((start > __myfs_get_fat_size(fsptr, fssize, errnoptr)) || (count > __myfs_get_fat_size(fsptr, fssize, errnoptr) - start)) {
+        *errnoptr = EIO;
+        return -1;
+    }
+    memset(ck->kind + start, kind, count);
+    return 0;
+}
+
+int __myfs_fsck_mark_meta(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_fsck *ck) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    if ((__myfs_fsck_meta(fsptr, fssize, errnoptr, ck, 0, 1, 1) < 0) ||
+        (__myfs_fsck_meta(fsptr, fssize, errnoptr, ck, sb->dcache_block,
+                          (sb->dcache_slots * sizeof(struct __myfs_dcache_slot) + block_size - 1) / block_size, 1) < 0)) {
+        return -1;
+    }
+    if ((sb->inode_groups == 0) || (sb->inode_groups > MYFS_INODE_GROUPS)) {
+        *errnoptr = EIO;
+        return -1;
+    }
+    for (size_t g = 0; g < sb->inode_groups; g++) {
+        size_t end = (g + 1 < sb->inode_groups) ? sb->inode_first[g + 1] : sb->inode_count;
+        if ((end < sb->inode_first[g]) ||
+            (__myfs_fsck_meta(fsptr, fssize, errnoptr, ck, sb->inode_block[g],
+                              ((end - sb->inode_first[g]) * sizeof(struct __myfs_inode) + block_size - 1) / block_size, MYFS_FAT_META) < 0)) {
+            *errnoptr = EIO;
+            return -1;
+        }
+    }
+    if ((sb->fat_slices == 0) || (sb->fat_slices > MYFS_FAT_SLICES)) {
+        *errnoptr = EIO;
         return -1;
     }
-    // 1. strip off last part of path
-    // a. finding last /
-    last = strrchr(path, '/') - path;
-    t_path = __myfs_get_parent_path(path);
-    f = __myfs_find_path(fsptr, fssize, errnoptr, t_path);
-    if (*errnoptr != 0) {
+    for (size_t s = 1; s < sb->fat_slices; s++) {
+        size_t end = (s + 1 < sb->fat_slices) ? sb->fat_first[s + 1] : sb->fat_capacity;
+        if ((end < sb->fat_first[s]) ||
+            (__myfs_fsck_meta(fsptr, fssize, errnoptr, ck, sb->fat_block[s],
+                              __myfs_fat_slice_blocks(end - sb->fat_first[s], block_size), MYFS_FAT_META) < 0)) {
+            *errnoptr = EIO;
+            return -1;
+        }
+    }
+    if ((sb->journal_blocks != 0) &&
+        ((__myfs_fsck_meta(fsptr, fssize, errnoptr, ck, sb->journal_block, sb->journal_blocks, 1) < 0) ||
+         (__myfs_fsck_meta(fsptr, fssize, errnoptr, ck, sb->journal_state_block,
+                           1 + (3 * __myfs_journal_map_words(fsptr, fssize, errnoptr) * sizeof(uint64_t) + block_size - 1) / block_size, 1) < 0))) {
         return -1;
     }
-    // Next build new dir entry
-    next_dir_len = strlen(path) - 1 - last;
-    if (next_dir_len > MYFS_MAX_NAME_SIZE) {
-        *errnoptr = ENAMETOOLONG;
+    if ((__myfs_fsck_meta(fsptr, fssize, errnoptr, ck, sb->journal_next_block, sb->journal_next_blocks, 1) < 0) ||
+        (__myfs_fsck_meta(fsptr, fssize, errnoptr, ck, sb->journal_old_block, sb->journal_old_blocks, 1) < 0)) {
         return -1;
     }
-    new_name = __myfs_get_child_path(path);
-    memcpy(new_f.file_name, new_name, strlen(new_name) + 1);
-    new_f.file_block = __myfs_alloc_block(fsptr, fssize, errnoptr);
-    new_f.file_type = DIRECTORY;
-    free(new_name);
-
-    // Finally append
-    __myfs_append_data(fsptr, fssize, errnoptr, f.file_block, sizeof(struct __myfs_dir_entry), &new_f);
     return 0;
 }
 
-/* Implements an emulation of the rename system call on the filesystem 
-   of size fssize pointed to by fsptr. 
-
-   The call moves the file or directory indicated by from to to.
-
-   On success, 0 is returned.
-
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   Caution: the function does more than what is hinted to by its name.
-   In cases the from and to paths differ, the file is moved out of 
-   the from path and added to the to path.
-
-   The error codes are documented in man 2 rename.
+// Frees a run of leaked blocks
+void __myfs_fsck_leaked(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_fsck *ck, size_t start, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    __myfs_fsck_report(ck, "blocks %zu to %zu: in use, but nothing holds them", start, start + length - 1);
+    if (ck->repair) {
+        __myfs_release_run(fsptr, fssize, errnoptr, start, length);
+    }
+}
 
+/* The sweep: goes over the bitmap and the FAT once, front to back, and
+   sets them right by what the walk found. Fragment blocks keep their
+   place on the list or off it, unless the list turns out broken, in
+   which case it is made anew. Returns the number of free blocks the
+   bitmap had.
 */
-int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
-                         const char *from, const char *to) {
-    size_t dirs_size;
-	char *t_path, *to_path, *to_name;
-	struct __myfs_dir_entry f, parent, *dirs, file, new_parent;
-	int found = 0;
-
-	t_path = __myfs_get_parent_path(from);
-    f = __myfs_find_path(fsptr, fssize, errnoptr, from);
-    parent = __myfs_find_path(fsptr, fssize, errnoptr, t_path);
-    dirs = __myfs_load_mem(fsptr, fssize, errnoptr, parent.file_block, &dirs_size);
-    for (size_t i = 0; i < dirs_size / sizeof(struct __myfs_dir_entry); i++) {
-        if (strcmp(f.file_name, dirs[i].file_name) == 0) {
-            __myfs_remove_data(fsptr, fssize, errnoptr, &parent.file_block, i*sizeof(struct __myfs_dir_entry), sizeof(struct __myfs_dir_entry));
-            __myfs_copy_dir_entry(&file, dirs + i);
-            to_name = __myfs_get_child_path(to);
-            strncpy(file.file_name, to_name, MYFS_MAX_NAME_SIZE);
-            free(to_name);
-            found = 1;
+size_t __myfs_fsck_sweep(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_fsck *ck) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    struct __myfs_fat_entry *fat;
+    size_t fat_size = __myfs_get_fat_size(fsptr, fssize, errnoptr);
+    size_t leak = 0, leaked = 0, lost = 0, lost_count = 0, free_blocks = 0, listed = 0, n = 0;
+    uint32_t full = (((uint32_t) 1) << MYFS_FRAG_SLOTS) - 1;
+    uint64_t block;
+    for (size_t b = 0; b <= fat_size; b++) {
+        int used = (b < fat_size) && __myfs_bitmap_test(fsptr, fssize, errnoptr, b);
+        uint32_t kind = (b < fat_size) ? ck->kind[b] : 0;
+        if ((lost_count > 0) && ((kind == 0) || used)) {
+            __myfs_fsck_report(ck, "blocks %zu to %zu: held, but marked free", lost, lost + lost_count - 1);
+            lost_count = 0;
+        }
+        if ((kind == 0) && used) {
+            if (leaked == 0) {
+                leak = b;
+            }
+            leaked++;
+            continue;
+        }
+        __myfs_fsck_leaked(fsptr, fssize, errnoptr, ck, leak, leaked);
+        leaked = 0;
+        if (b == fat_size) {
             break;
         }
+        fat = __myfs_get_fat(fsptr, fssize, errnoptr, b);
+        if (!used) {
+            free_blocks++;
+        }
+        if ((kind != 0) && !used) {
+            if (lost_count == 0) {
+                lost = b;
+            }
+            lost_count++;
+            if (ck->repair) {
+                __myfs_journal_dirty(fsptr, fssize, errnoptr, __myfs_bitmap_word(fsptr, fssize, errnoptr, b), sizeof(uint64_t));
+                __myfs_bitmap_set(fsptr, fssize, errnoptr, b);
+            }
+        }
+        if ((kind == 0) && (fat->is_used != 0)) {
+            __myfs_fsck_report(ck, "block %zu: free, but its FAT entry is not", b);
+            if (ck->repair) {
+                __myfs_journal_dirty(fsptr, fssize, errnoptr, fat, MYFS_FAT_SIZE);
+                memset(fat, 0, MYFS_FAT_SIZE);
+            }
+        } else if (kind == MYFS_FAT_FRAG) {
+            if ((fat->is_used != MYFS_FAT_FRAG) && (fat->is_used != MYFS_FAT_FRAG_OFF)) {
+                __myfs_fsck_report(ck, "block %zu: holds fragments, but its FAT entry does not say so", b);
+                if (ck->repair) {
+                    __myfs_journal_dirty(fsptr, fssize, errnoptr, fat, MYFS_FAT_SIZE);
+                    fat->is_used = MYFS_FAT_FRAG_OFF;
+                    fat->next_block = 0;
+                }
+            }
+            if (fat->used_size != ck->frags[b]) {
+                __myfs_fsck_report(ck, "block %zu: slots %#x in use instead of %#x", b, fat->used_size, ck->frags[b]);
+                if (ck->repair) {
+                    __myfs_journal_dirty(fsptr, fssize, errnoptr, fat, MYFS_FAT_SIZE);
+                    fat->used_size = ck->frags[b];
+                }
+            }
+            listed += (fat->is_used == MYFS_FAT_FRAG);
+        } else if (kind != 0) {
+            if (fat->is_used != kind) {
+                __myfs_fsck_report(ck, "block %zu: FAT entry says %u instead of %u", b, fat->is_used, kind);
+                if (ck->repair) {
+                    __myfs_journal_dirty(fsptr, fssize, errnoptr, fat, MYFS_FAT_SIZE);
+                    fat->is_used = kind;
+                }
+            }
+            // Blocks of data count the files holding them besides the first
+            if ((kind == 1) && (ck->frags[b] > 0) && (fat->used_size != ck->frags[b] - 1)) {
+                __myfs_fsck_report(ck, "block %zu: %u references instead of %u", b, fat->used_size + 1, ck->frags[b]);
+                if (ck->repair) {
+                    __myfs_journal_dirty(fsptr, fssize, errnoptr, fat, MYFS_FAT_SIZE);
+                    fat->used_size = ck->frags[b] - 1;
+                }
+            }
+            ck->shared += (kind == 1) && (ck->frags[b] > 1);
+        }
     }
-    if (found == 0) {
-        free(t_path);
-        free(dirs);
-        *errnoptr = EBADF;
-    }
-    to_path = __myfs_get_parent_path(to);
-    new_parent = __myfs_find_path(fsptr, fssize, errnoptr, to_path);
-    
-    __myfs_append_data(fsptr, fssize, errnoptr, new_parent.file_block, sizeof(struct __myfs_dir_entry), &file);
-    free(to_path);
-    return 0;
+    // Every block marked to be on the fragment list must be on it, and nothing else
+    for (block = sb->frag_list; block != 0; block = __myfs_get_fat(fsptr, fssize, errnoptr, block)->next_block, n++) {
+        if ((n == listed) || (block >= fat_size) || (ck->kind[block] != MYFS_FAT_FRAG) ||
+            (__myfs_get_fat(fsptr, fssize, errnoptr, block)->is_used != MYFS_FAT_FRAG) ||
+            (__myfs_get_fat(fsptr, fssize, errnoptr, block)->used_size == full)) {
+            break;
+        }
+    }
+    if ((block != 0) || (n != listed)) {
+        __myfs_fsck_report(ck, "fragment list is broken");
+        if (ck->repair) {
+            __myfs_journal_dirty(fsptr, fssize, errnoptr, sb, sizeof(struct __myfs_superblock));
+            sb->frag_list = 0;
+            for (size_t b = fat_size; b-- > 0; ) {
+                if (ck->kind[b] != MYFS_FAT_FRAG) {
+                    continue;
+                }
+                fat = __myfs_get_fat(fsptr, fssize, errnoptr, b);
+                __myfs_journal_dirty(fsptr, fssize, errnoptr, fat, MYFS_FAT_SIZE);
+                fat->is_used = MYFS_FAT_FRAG_OFF;
+                fat->next_block = 0;
+                if (fat->used_size != full) {
+                    fat->is_used = MYFS_FAT_FRAG;
+                    fat->next_block = sb->frag_list;
+                    sb->frag_list = b;
+                }
+            }
+        }
+    }
+    return free_blocks;
 }
 
-/* Implements an emulation of the truncate system call on the filesystem 
-   of size fssize pointed to by fsptr. 
-
-   The call changes the size of the file indicated by path to offset
-   bytes.
-
-   When the file becomes smaller due to the call, the extending bytes are
-   removed. When it becomes larger, zeros are appended.
-
-   On success, 0 is returned.
-
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The error codes are documented in man 2 truncate.
-
+/* Goes over the inode table after the walk: frees the inodes no entry
+   names, and puts right the link counts. Returns the number of free
+   inodes.
 */
-int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
-                           const char *path, off_t offset) {
-	struct __myfs_dir_entry f;
-	size_t size;
-
-    f = __myfs_find_path(fsptr, fssize, errnoptr, path);
-    size = __myfs_get_size(fsptr, fssize, errnoptr, f.file_block);
-    if (offset > size) {
-        __myfs_append_data(fsptr, fssize, errnoptr, f.file_block, offset - size, calloc(offset - size, sizeof(char)));
-    } else {
-        __myfs_remove_data(fsptr, fssize, errnoptr, &f.file_block, offset, size - offset);
+size_t __myfs_fsck_inodes(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_fsck *ck) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t free_inodes = 0;
+    for (uint32_t ino = 1; ino < sb->inode_count; ino++) {
+        struct __myfs_inode *node = __myfs_get_inode(fsptr, fssize, errnoptr, ino);
+        uint32_t generation = node->generation;
+        if (node->nlink == 0) {
+            free_inodes++;
+            continue;
+        }
+        if (ck->links[ino] == 0) {
+            __myfs_fsck_report(ck, "inode %u: in use, but no entry names it", ino);
+            if (ck->repair) {
+                // Its blocks go with the sweep
+                __myfs_journal_dirty(fsptr, fssize, errnoptr, node, sizeof(struct __myfs_inode));
+                memset(node, 0, sizeof(struct __myfs_inode));
+                node->generation = generation + 1;
+                free_inodes++;
+            }
+            continue;
+        }
+        if (node->nlink != ck->links[ino]) {
+            __myfs_fsck_report(ck, "inode %u: %u links instead of %u", ino, node->nlink, ck->links[ino]);
+            if (ck->repair) {
+                __myfs_journal_dirty(fsptr, fssize, errnoptr, node, sizeof(struct __myfs_inode));
+                node->nlink = ck->links[ino];
+            }
+        }
+        if ((node->file_type == DIRECTORY) && (node->subdirs != ck->subdirs[ino])) {
+            __myfs_fsck_report(ck, "inode %u: %u subdirectories instead of %u", ino, node->subdirs, ck->subdirs[ino]);
+            if (ck->repair) {
+                __myfs_journal_dirty(fsptr, fssize, errnoptr, node, sizeof(struct __myfs_inode));
+                node->subdirs = ck->subdirs[ino];
+            }
+        }
     }
-    return 0;
+    return free_inodes;
 }
 
-/* Implements an emulation of the open system call on the filesystem 
-   of size fssize pointed to by fsptr, without actually performing the opening
-   of the file (no file descriptor is returned).
-
-   The call just checks if the file (or directory) indicated by path
-   can be accessed, i.e. if the path can be followed to an existing
-   object for which the access rights are granted.
-
-   On success, 0 is returned.
-
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The two only interesting error codes are 
-
-   * EFAULT: the filesystem is in a bad state, we can't do anything
-
-   * ENOENT: the file that we are supposed to open doesn't exist (or a
-             subpath).
-
-   It is possible to restrict ourselves to only these two error
-   conditions. It is also possible to implement more detailed error
-   condition answers.
+/* Checks the filesystem of size fssize pointed to by fsptr, which must
+   not be mounted by anybody else, and repairs it if repair is set. To
+   repair, it is mounted first, which replays the journal, and the
+   repairs are checkpointed before returning. Without repair, nothing
+   in the image is written, not even by the replay: records left in
+   the journal are a problem of their own. Every problem found is
+   written to log, a line each, unless log is NULL.
 
-   The error codes are documented in man 2 open.
+   On success, the number of problems found is returned.
 
+   On failure, -1 is returned and *errnoptr is set appropriately: EINVAL
+   if there is no filesystem at all, and EIO if the superblock is too
+   damaged to go by.
 */
-int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr,
-                       const char *path) {
-	struct __myfs_dir_entry f;
-
+int __myfs_fsck_implem(void *fsptr, size_t fssize, int *errnoptr, int repair, FILE *log) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    struct __myfs_fsck ck;
+    struct __myfs_inode *root;
+    size_t fat_size, free_count, free_blocks, free_inodes;
+    int res = -1;
     *errnoptr = 0;
-    f = __myfs_find_path(fsptr, fssize, errnoptr, path);
-    if (*errnoptr != 0) {
-        *errnoptr = ENOENT;
+    if ((fssize < MYFS_HEADER_SIZE) || (*(uint64_t *) fsptr != MYFS_MAGIC)) {
+        *errnoptr = EINVAL;
         return -1;
     }
-    if (f.file_type != REG_FILE) {
-        *errnoptr = EISDIR;
+    if (__myfs_check_superblock(fsptr, fssize, errnoptr) < 0) {
+        *errnoptr = EIO;
         return -1;
     }
-    return 0;
-}
-
-/* Implements an emulation of the read system call on the filesystem 
-   of size fssize pointed to by fsptr.
-
-   The call copies up to size bytes from the file indicated by 
-   path into the buffer, starting to read at offset. See the man page
-   for read for the details when offset is beyond the end of the file etc.
-   
-   On success, the appropriate number of bytes read into the buffer is
-   returned. The value zero is returned on an end-of-file condition.
-
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The error codes are documented in man 2 read.
-
-*/
-int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
-                       const char *path, char *buf, size_t size, off_t offset) {
-    struct __myfs_dir_entry f;
-
-	*errnoptr = 0;
-    f = __myfs_find_path(fsptr, fssize, errnoptr, path);
-    if (*errnoptr != 0) {
+    if (repair && (__myfs_mount_implem(fsptr, fssize, errnoptr, fssize, sb->block_size) < 0)) {
         return -1;
     }
-	if (f.file_type == DIRECTORY) {
-        *errnoptr = EINVAL;
+    fat_size = __myfs_get_fat_size(fsptr, fssize, errnoptr);
+    root = __myfs_get_inode(fsptr, fssize, errnoptr, MYFS_ROOT_INODE);
+    if ((sb->root.inode != MYFS_ROOT_INODE) || (root == NULL) || (root->file_type != DIRECTORY) || (root->nlink == 0)) {
+        *errnoptr = EIO;
         return -1;
     }
-    size = __myfs_read_data(fsptr, fssize, errnoptr, f.file_block, offset, size, buf);
-    if (*errnoptr != 0) {
-        return -1;
+    memset(&ck, 0, sizeof(struct __myfs_fsck));
+    ck.repair = repair;
+    ck.log = log;
+    ck.kind = calloc(fat_size, sizeof(uint8_t));
+    ck.frags = calloc(fat_size, sizeof(uint32_t));
+    ck.links = calloc(sb->inode_count, sizeof(uint32_t));
+    ck.subdirs = calloc(sb->inode_count, sizeof(uint32_t));
+    if ((ck.kind == NULL) || (ck.frags == NULL) || (ck.links == NULL) || (ck.subdirs == NULL)) {
+        *errnoptr = ENOMEM;
+        goto out;
+    }
+    if (__myfs_fsck_mark_meta(fsptr, fssize, errnoptr, &ck) < 0) {
+        goto out;
+    }
+    // What the records would put right shows up as more problems
+    if (!repair && (sb->journal_blocks != 0) && (__myfs_journal_record(fsptr, fssize, errnoptr, 0) != 0)) {
+        __myfs_fsck_report(&ck, "journal: holds records, which were not replayed");
+    }
+    // The walk: directories are checked as they are taken off the stack, files too
+    ck.links[MYFS_ROOT_INODE] = 1;
+    if (__myfs_fsck_push(&ck.stack, &ck.stack_count, &ck.stack_room, MYFS_ROOT_INODE) < 0) {
+        *errnoptr = ENOMEM;
+        goto out;
+    }
+    while (ck.stack_count > 0) {
+        uint32_t ino = ck.stack[--ck.stack_count];
+        struct __myfs_inode *node = __myfs_get_inode(fsptr, fssize, errnoptr, ino);
+        if (node->file_type == DIRECTORY) {
+            if (__myfs_fsck_dir(fsptr, fssize, errnoptr, &ck, ino) < 0) {
+                goto out;
+            }
+            continue;
+        }
+        switch (__myfs_fsck_check_map(fsptr, fssize, errnoptr, &ck, ino, &node->map, 1)) {
+        case -1:
+            goto out;
+        case 0:
+            if (__myfs_fsck_finish_map(fsptr, fssize, errnoptr, &ck, ino, &node->map, 1) < 0) {
+                goto out;
+            }
+        }
+    }
+    free_inodes = __myfs_fsck_inodes(fsptr, fssize, errnoptr, &ck);
+    if (sb->inode_free != free_inodes) {
+        __myfs_fsck_report(&ck, "superblock: %u free inodes instead of %zu", sb->inode_free, free_inodes);
+    }
+    // Freeing leaked blocks moves the count, so it is taken first
+    free_count = sb->free_count;
+    free_blocks = __myfs_fsck_sweep(fsptr, fssize, errnoptr, &ck);
+    if (free_count != free_blocks) {
+        __myfs_fsck_report(&ck, "superblock: %zu free blocks instead of %zu", free_count, free_blocks);
+    }
+    if (sb->shared_count != ck.shared) {
+        __myfs_fsck_report(&ck, "superblock: %zu shared blocks instead of %zu", (size_t) sb->shared_count, ck.shared);
+    }
+    if (repair) {
+        __myfs_journal_dirty(fsptr, fssize, errnoptr, sb, sizeof(struct __myfs_superblock));
+        sb->inode_free = free_inodes;
+        sb->shared_count = ck.shared;
+        sb->free_count = 0;
+        for (size_t b = 0; b < fat_size; b++) {
+            sb->free_count += !__myfs_bitmap_test(fsptr, fssize, errnoptr, b);
+        }
+        // The bitmap is right again: the indexes can have blocks
+        for (size_t i = 0; i < ck.reindex_count; i++) {
+            struct __myfs_inode *dir = __myfs_get_inode(fsptr, fssize, errnoptr, ck.reindex[i]);
+            if (__myfs_dir_index_rebuild(fsptr, fssize, errnoptr, dir) < 0) {
+                goto out;
+            }
+        }
+        __myfs_dcache_flush(fsptr, fssize, errnoptr);
+        if (__myfs_journal_checkpoint(fsptr, fssize, errnoptr) < 0) {
+            goto out;
+        }
     }
-    return size;
+    res = (int) min(ck.problems, (size_t) INT32_MAX);
+out:
+    free(ck.kind);
+    free(ck.frags);
+    free(ck.links);
+    free(ck.subdirs);
+    free(ck.ranges);
+    free(ck.stack);
+    free(ck.reindex);
+    return res;
 }
 
-/* Implements an emulation of the write system call on the filesystem 
-   of size fssize pointed to by fsptr.
-
-   The call copies up to size bytes to the file indicated by 
-   path into the buffer, starting to write at offset. See the man page
-   for write for the details when offset is beyond the end of the file etc.
-   
-   On success, the appropriate number of bytes written into the file is
-   returned. The value zero is returned on an end-of-file condition.
-
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The error codes are documented in man 2 write.
-
+/* Finds count free blocks in a row, looking from *cursor on and
+   wrapping around once, and moves *cursor past them. Whole words of
+   the bitmap in use are skipped at once. Returns the first of the
+   blocks, or 0 if there is no such run.
 */
-int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path, const char *buf, size_t size, off_t offset) {
-    struct __myfs_dir_entry f;
-
-	f = __myfs_find_path(fsptr, fssize, errnoptr, path);
-    if (*errnoptr != 0) {
-        return -1;
-    }
-    __myfs_write_data(fsptr, fssize, errnoptr, f.file_block, offset, size, buf);
-    if (*errnoptr != 0) {
-        return -1;
+size_t __myfs_find_free_run(void *fsptr, size_t fssize, int *errnoptr, size_t count, size_t *cursor) {
+    size_t fat_size = __myfs_get_fat_size(fsptr, fssize, errnoptr);
+    size_t block = *cursor, start = 0, run = 0;
+    for (size_t n = 0; n < fat_size; ) {
+        uint64_t word;
+        if (block >= fat_size) {
+            block = 0;
+            run = 0;
+        }
+        word = *__myfs_bitmap_word(fsptr, fssize, errnoptr, block);
+        if ((block % MYFS_BITMAP_WORD_BITS == 0) && (word == ~((uint64_t) 0))) {
+            block += MYFS_BITMAP_WORD_BITS;
+            n += MYFS_BITMAP_WORD_BITS;
+            run = 0;
+            continue;
+        }
+        if ((word >> (block % MYFS_BITMAP_WORD_BITS)) & 1) {
+            run = 0;
+        } else {
+            if (run == 0) {
+                start = block;
+            }
+            if (++run == count) {
+                *cursor = block + 1;
+                return start;
+            }
+        }
+        block++;
+        n++;
     }
-    return size;
+    return 0;
 }
 
-/* Implements an emulation of the utimensat system call on the filesystem 
-   of size fssize pointed to by fsptr.
-
-   The call changes the access and modification times of the file
-   or directory indicated by path to the values in ts.
-
-   On success, 0 is returned.
-
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The error codes are documented in man 2 utimensat.
-
+/* Rewrites the data of the file f into count free blocks in a row,
+   starting at block start, which are claimed already. The file keeps
+   its holes. The copy goes to the disk before the file is switched
+   over to it, so a crash leaves the file in its old blocks or in its
+   new ones. Returns -1 on failure, with the new blocks freed again.
 */
-int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
-                          const char *path, const struct timespec ts[2]) {
-    struct __myfs_dir_entry f;
-	f = __myfs_find_path(fsptr, fssize, errnoptr, path);
-    f.atime = ts[0];
-    f.mtime = ts[1];
-    __myfs_write_path(fsptr, fssize, errnoptr, path, f);
-	return 0;
+int __myfs_defrag_file(void *fsptr, size_t fssize, int *errnoptr, struct __myfs_inode *f, size_t start, size_t count) {
+    size_t block_size = __myfs_block_size(fsptr, fssize, errnoptr);
+    struct __myfs_extent_map map, old;
+    size_t logical = 0, done = 0;
+    memset(&map, 0, sizeof(struct __myfs_extent_map));
+    map.flags = f->map.flags;
+    map.size = f->map.size;
+    while ((logical = __myfs_extent_next_data(fsptr, fssize, errnoptr, &f->map, logical)) != SIZE_MAX) {
+        struct __myfs_extent *e = __myfs_extent_lookup(fsptr, fssize, errnoptr, &f->map, logical);
+        struct __myfs_extent ext;
+        if ((e == NULL) || (done + e->length > count)) {
+            *errnoptr = EIO;
+            break;
+        }
+        ext.logical = e->logical;
+        ext.length = e->length;
+        ext.start = start + done;
+        memcpy(__myfs_get_block(fsptr, fssize, errnoptr, ext.start), __myfs_get_block(fsptr, fssize, errnoptr, e->start), e->length * block_size);
+        map.blocks += e->length;
+        if (__myfs_extent_insert(fsptr, fssize, errnoptr, &map, ext) < 0) {
+            map.blocks -= e->length;
+            break;
+        }
+        done += e->length;
+        logical = (size_t) ext.logical + ext.length;
+    }
+    if ((*errnoptr != 0) ||
+        (__myfs_journal_sync(fsptr, fssize, errnoptr, __myfs_get_block(fsptr, fssize, errnoptr, start), count * block_size) < 0)) {
+        __myfs_extent_truncate(fsptr, fssize, errnoptr, &map, 0);
+        __myfs_release_run(fsptr, fssize, errnoptr, start + done, count - done);
+        return -1;
+    }
+    old = f->map;
+    __myfs_journal_dirty(fsptr, fssize, errnoptr, f, sizeof(struct __myfs_inode));
+    f->map = map;
+    __myfs_extent_truncate(fsptr, fssize, errnoptr, &old, 0);
+    return 0;
 }
 
-/* Implements an emulation of the statfs system call on the filesystem 
-   of size fssize pointed to by fsptr.
-
-   The call gets information of the filesystem usage and puts in 
-   into stbuf.
+/* Rewrites every regular file of the filesystem of size fssize pointed
+   to by fsptr whose blocks are not in one run into a single run, as
+   far as there are free runs long enough. Files are taken in the order
+   of their inodes and laid out one after the other from the front of
+   the image on, so that files made together stay together. Small files and directories stay where
+   they are, and so do files sharing blocks with a snapshot, which a
+   copy would stop sharing. Each file is committed on its own, as the blocks it frees
+   may go to the next one. Must follow __myfs_fsck_implem, which mounts
+   the filesystem, and nothing else may have it mounted.
 
-   On success, 0 is returned.
+   On success, the number of files rewritten is returned.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The error codes are documented in man 2 statfs.
-
-   Essentially, only the following fields of struct statvfs need to be
-   supported:
-
-   f_bsize   fill with what you call a block (typically 1024 bytes)
-   f_blocks  fill with the total number of blocks in the filesystem
-   f_bfree   fill with the free number of blocks in the filesystem
-   f_bavail  fill with same value as f_bfree
-   f_namemax fill with your maximum file/directory name, if your
-             filesystem has such a maximum
-
 */
-int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr,
-                         struct statvfs *stbuf) {
-    errnoptr = 0;
+int __myfs_defrag_implem(void *fsptr, size_t fssize, int *errnoptr) {
+    struct __myfs_superblock* sb = __myfs_get_superblock(fsptr, fssize, errnoptr);
+    size_t cursor = 0, limit = SIZE_MAX;
+    int moved = 0;
+    *errnoptr = 0;
     __myfs_try_build(fsptr, fssize, errnoptr);
-    stbuf->f_bsize = MYFS_BLOCK_SIZE;
-    stbuf->f_blocks = __myfs_get_fat_size(fsptr, fssize, errnoptr);
-    if (errnoptr != 0) {
+    if (*errnoptr != 0) {
         return -1;
     }
-    stbuf->f_bfree = __myfs_get_num_free_blocks(fsptr, fssize, errnoptr);
-    if (errnoptr != 0) {
+    for (uint32_t ino = MYFS_ROOT_INODE + 1; ino < sb->inode_count; ino++) {
+        struct __myfs_inode *f = __myfs_get_inode(fsptr, fssize, errnoptr, ino);
+        size_t logical = 0, next = 0, blocks = 0, runs = 0, start;
+        int shared = 0;
+        if ((f->nlink == 0) || (f->file_type != REG_FILE) || (f->map.flags & MYFS_MAP_SMALL)) {
+            continue;
+        }
+        while ((logical = __myfs_extent_next_data(fsptr, fssize, errnoptr, &f->map, logical)) != SIZE_MAX) {
+            struct __myfs_extent *e = __myfs_extent_lookup(fsptr, fssize, errnoptr, &f->map, logical);
+            if (e == NULL) {
+                *errnoptr = EIO;
+                return -1;
+            }
+            for (size_t b = e->start; (sb->shared_count != 0) && !shared && (b < e->start + e->length); b++) {
+                shared = (__myfs_get_fat(fsptr, fssize, errnoptr, b)->used_size != 0);
+            }
+            if (e->start != next) {
+                runs++;
+            }
+            blocks += e->length;
+            next = e->start + e->length;
+            logical = (size_t) e->logical + e->length;
+        }
+        // No run was found for fewer blocks than limit, so none will be for more
+        if ((runs <= 1) || (blocks >= limit) || shared) {
+            continue;
+        }
+        start = __myfs_find_free_run(fsptr, fssize, errnoptr, blocks, &cursor);
+        if (start == 0) {
+            limit = blocks;
+            continue;
+        }
+        if (__myfs_claim_run(fsptr, fssize, errnoptr, start, blocks) != blocks) {
+            *errnoptr = EIO;
+            return -1;
+        }
+        if ((__myfs_defrag_file(fsptr, fssize, errnoptr, f, start, blocks) < 0) ||
+            (__myfs_journal_commit(fsptr, fssize, errnoptr) < 0)) {
+            return -1;
+        }
+        moved++;
+    }
+    if (__myfs_journal_checkpoint(fsptr, fssize, errnoptr) < 0) {
         return -1;
     }
-    stbuf->f_bavail = stbuf->f_bfree;
-    stbuf->f_namemax = MYFS_MAX_NAME_SIZE;
-    return 0;
+    return moved;
 }
-
@@ -0,0 +1,136 @@
+/*
+
+  myfs-fsck: checks and repairs a MyFS backup-file offline
+
+  gcc -O2 -Wall myfs-fsck.c implementation.c -o myfs-fsck -pthread
+  ./myfs-fsck [-n] [-d] <backup-file>
+
+  The backup-file must not be mounted while this runs. The journal is
+  replayed first, as mounting does, then the directory tree is checked
+  against the bitmap and the FAT, and whatever does not match is put
+  right: leaked blocks and orphaned inodes are freed, wrong counts are
+  fixed. Every problem found is printed, a line each.
+
+  -n: only check, and leave the backup-file as it is
+  -d: once the filesystem is clean, rewrite every file whose blocks
+      are scattered over the image into a single run
+
+  Exits with 0 if the filesystem was clean, 1 if problems were found
+  and fixed, 4 if problems were found and left alone (-n), and 8 if
+  the check could not be done at all, like e2fsck does.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define MYFS_FSCK_CLEAN     0
+#define MYFS_FSCK_FIXED     1
+#define MYFS_FSCK_UNFIXED   4
+#define MYFS_FSCK_ERROR     8
+
+/* Declaration for the implementations */
+int __myfs_fsck_implem(void *, size_t, int *, int, FILE *);
+int __myfs_defrag_implem(void *, size_t, int *);
+
+static void __myfs_fsck_usage(const char *progname) {
+  fprintf(stderr, "usage: %s [-n] [-d] <backup-file>\n"
+          "\n"
+          "    -n    only check, change nothing\n"
+          "    -d    rewrite fragmented files into single runs of blocks\n",
+          progname);
+}
+
+int main(int argc, char **argv) {
+  int opt, check_only = 0, defrag = 0, fd, err, problems, moved, res;
+  struct stat st;
+  void *memory;
+  size_t size;
+
+  while ((opt = getopt(argc, argv, "nd")) != -1) {
+    switch (opt) {
+    case 'n':
+      check_only = 1;
+      break;
+    case 'd':
+      defrag = 1;
+      break;
+    default:
+      __myfs_fsck_usage(argv[0]);
+      return MYFS_FSCK_ERROR;
+    }
+  }
+  if ((optind != argc - 1) || (check_only && defrag)) {
+    __myfs_fsck_usage(argv[0]);
+    return MYFS_FSCK_ERROR;
+  }
+
+  /* A check alone writes nothing, not even the replay of the journal,
+     so the backup-file is mapped read-only for it.
+  */
+  fd = open(argv[optind], check_only ? O_RDONLY : O_RDWR);
+  if (fd < 0) {
+    perror("Cannot open backup-file");
+    return MYFS_FSCK_ERROR;
+  }
+  if (fstat(fd, &st) != 0) {
+    perror("Cannot stat backup-file");
+    close(fd);
+    return MYFS_FSCK_ERROR;
+  }
+  size = (size_t) st.st_size;
+  if (size == ((size_t) 0)) {
+    fprintf(stderr, "%s: empty backup-file\n", argv[optind]);
+    close(fd);
+    return MYFS_FSCK_ERROR;
+  }
+  memory = mmap(NULL, size, check_only ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    perror("Cannot map backup-file into memory");
+    close(fd);
+    return MYFS_FSCK_ERROR;
+  }
+
+  problems = __myfs_fsck_implem(memory, size, &err, !check_only, stdout);
+  if (problems < 0) {
+    fprintf(stderr, "%s: %s\n", argv[optind], (err == EINVAL) ? "no MyFS filesystem" : strerror(err));
+    res = MYFS_FSCK_ERROR;
+  } else if (problems == 0) {
+    printf("%s: clean\n", argv[optind]);
+    res = MYFS_FSCK_CLEAN;
+  } else {
+    printf("%s: %d problems %s\n", argv[optind], problems, check_only ? "found" : "fixed");
+    res = check_only ? MYFS_FSCK_UNFIXED : MYFS_FSCK_FIXED;
+  }
+
+  if (defrag && (res != MYFS_FSCK_ERROR)) {
+    moved = __myfs_defrag_implem(memory, size, &err);
+    if (moved < 0) {
+      fprintf(stderr, "%s: cannot defragment: %s\n", argv[optind], strerror(err));
+      res = MYFS_FSCK_ERROR;
+    } else {
+      printf("%s: %d files rewritten in one piece\n", argv[optind], moved);
+    }
+  }
+
+  if (!check_only && (msync(memory, size, MS_SYNC) != 0)) {
+    perror("Cannot synchronize memory map with backup-file");
+    res = MYFS_FSCK_ERROR;
+  }
+  if (munmap(memory, size) != 0) {
+    perror("Cannot unmap memory");
+  }
+  if (close(fd) != 0) {
+    perror("Cannot close backup-file");
+  }
+  return res;
+}
@@ -50,11 +50,17 @@
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 
 struct __myfs_options_struct_t {
         const char *filename;
         const char *size;
+        const char *max_size;
+        const char *flush_interval;
+        const char *flush_bytes;
+        const char *block_size;
         int show_help;
 };
 
@@ -63,6 +69,10 @@ struct __myfs_options_struct_t {
 static const struct fuse_opt __myfs_option_spec[] = {
         OPTION("--backupfile=%s", filename),
         OPTION("--size=%s", size),
+        OPTION("--maxsize=%s", max_size),
+        OPTION("--flushinterval=%s", flush_interval),
+        OPTION("--flushbytes=%s", flush_bytes),
+        OPTION("--blocksize=%s", block_size),
         OPTION("-h", show_help),
         OPTION("--help", show_help),
         FUSE_OPT_END
@@ -74,18 +84,51 @@ struct __memory_block_struct_t {
 };
 typedef struct __memory_block_struct_t memory_block_t;
 
+#define MYFS_FILE_LOCKS    64
+
+/* memory is the start of max_size bytes of address space, reserved
+   when the filesystem is set up. The first size bytes of it are mapped
+   to the backup-file, or to memory of our own without one, and the
+   mapping grows into the rest, see __myfs_grow.
+
+   The flusher thread writes changed file data back to the backup-file
+   in the background. It sleeps for flush_interval seconds, or until
+   more than flush_bytes bytes are waiting, and goes over the image in
+   chunks of MYFS_FLUSH_CHUNK units. writeback_lock keeps it and fsync
+   from writing data back at the same time; flusher_lock and
+   flusher_cond are for waking it up and stopping it.
+*/
 struct __myfs_environment_struct_t {
-  pthread_mutex_t env_lock;
+  pthread_rwlock_t env_lock;
+  pthread_rwlock_t file_locks[MYFS_FILE_LOCKS];
   uid_t           uid;
   gid_t           gid;
   void            *memory;
   size_t          size;
+  size_t          max_size;
   int             using_backup;
   int             backup_fd;
+  pthread_mutex_t writeback_lock;
+  pthread_mutex_t flusher_lock;
+  pthread_cond_t  flusher_cond;
+  pthread_t       flusher;
+  int             flusher_running;
+  int             flusher_wake;
+  int             flusher_stop;
+  size_t          flush_interval;
+  size_t          flush_bytes;
+  size_t          block_size;
 };
 
-#define MYFS_DEFAULT_SIZE  ((size_t) (128 << 20))   /* 128MB */
+#define MYFS_DEFAULT_SIZE  ((size_t) (4 << 20))     /* 4MB */
+#define MYFS_DEFAULT_MAX_SIZE ((size_t) 16 << 30)   /* 16GB */
 #define MYFS_MIN_SIZE      ((size_t) (2048))        /* 2kB */
+#define MYFS_DEFAULT_FLUSH_INTERVAL ((size_t) 5)    /* seconds */
+#define MYFS_DEFAULT_FLUSH_BYTES ((size_t) (32 << 20)) /* 32MB */
+#define MYFS_FLUSH_CHUNK   ((size_t) 256)
+#define MYFS_DEFAULT_BLOCK_SIZE ((size_t) 4096)     /* 4kB */
+#define MYFS_MIN_BLOCK_SIZE ((size_t) 1024)        /* 1kB */
+#define MYFS_MAX_BLOCK_SIZE ((size_t) (1 << 20))   /* 1MB */
 
 static int __myfs_parse_size(size_t *size, const char *str) {
   unsigned long long int tmp, t;
@@ -102,14 +145,125 @@ static int __myfs_parse_size(size_t *size, const char *str) {
   return 1;
 }
 
+static int __myfs_init_locks(struct __myfs_environment_struct_t *env) {
+  int i;
+
+  if (pthread_rwlock_init(&(env->env_lock), NULL) != 0) {
+    perror("Cannot setup lock");
+    return 0;
+  }
+  if ((pthread_mutex_init(&(env->writeback_lock), NULL) != 0) ||
+      (pthread_mutex_init(&(env->flusher_lock), NULL) != 0) ||
+      (pthread_cond_init(&(env->flusher_cond), NULL) != 0)) {
+    perror("Cannot setup lock");
+    pthread_rwlock_destroy(&(env->env_lock));
+    return 0;
+  }
+  for (i=0;i<MYFS_FILE_LOCKS;i++) {
+    if (pthread_rwlock_init(&(env->file_locks[i]), NULL) != 0) {
+      perror("Cannot setup lock");
+      while (i > 0) {
+        i--;
+        pthread_rwlock_destroy(&(env->file_locks[i]));
+      }
+      pthread_rwlock_destroy(&(env->env_lock));
+      pthread_mutex_destroy(&(env->writeback_lock));
+      pthread_mutex_destroy(&(env->flusher_lock));
+      pthread_cond_destroy(&(env->flusher_cond));
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void __myfs_destroy_locks(struct __myfs_environment_struct_t *env) {
+  int i;
+
+  for (i=0;i<MYFS_FILE_LOCKS;i++) {
+    if (pthread_rwlock_destroy(&(env->file_locks[i])) != 0) {
+      perror("Cannot destroy lock");
+    }
+  }
+  if (pthread_rwlock_destroy(&(env->env_lock)) != 0) {
+    perror("Cannot destroy lock");
+  }
+  if ((pthread_mutex_destroy(&(env->writeback_lock)) != 0) ||
+      (pthread_mutex_destroy(&(env->flusher_lock)) != 0) ||
+      (pthread_cond_destroy(&(env->flusher_cond)) != 0)) {
+    perror("Cannot destroy lock");
+  }
+}
+
+/* Files are spread over the file locks by the hash of their path.
+   Paths only change under the exclusive env_lock, so a file keeps
+   its lock for as long as anybody holds env_lock shared.
+*/
+static pthread_rwlock_t *__myfs_file_lock(struct __myfs_environment_struct_t *env, const char *path) {
+  unsigned long long int hash = 14695981039346656037ULL;
+
+  for (;*path != '\0';path++) {
+    hash ^= (unsigned char) *path;
+    hash *= 1099511628211ULL;
+  }
+  return &(env->file_locks[hash % MYFS_FILE_LOCKS]);
+}
+
+/* Maps the len bytes of the backup-file starting at offset, or fresh
+   memory if there is none, at the same offset into the reserved range
+   starting at memory. offset must be a multiple of the page size.
+*/
+static int __myfs_map_range(void *memory, int fd, size_t offset, size_t len) {
+  void *ptr;
+
+  if (fd >= 0) {
+    ptr = mmap(((char *) memory) + offset, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, (off_t) offset);
+  } else {
+    ptr = mmap(((char *) memory) + offset, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  }
+  return ptr != MAP_FAILED;
+}
+
+/* Declaration for the implementations of the operations */
+
+int __myfs_getattr_implem(void *, size_t, int *, uid_t, gid_t, const char *, struct stat *);
+int __myfs_readdir_implem(void *, size_t, int *, const char *, char ***);
+int __myfs_mknod_implem(void *, size_t, int *, const char *);
+int __myfs_unlink_implem(void *, size_t, int *, const char *);
+int __myfs_mkdir_implem(void *, size_t, int *, const char *);
+int __myfs_rmdir_implem(void *, size_t, int *, const char *);
+int __myfs_rename_implem(void *, size_t, int *, const char *, const char*);
+int __myfs_truncate_implem(void *, size_t, int *, const char *, off_t);
+int __myfs_open_implem(void *, size_t, int *, const char *);
+int __myfs_read_implem(void *, size_t, int *, const char *, char *, size_t, off_t);
+int __myfs_write_implem(void *, size_t, int *, const char *, const char *, size_t, off_t);
+int __myfs_open_fh_implem(void *, size_t, int *, const char *, uint64_t *);
+int __myfs_read_fh_implem(void *, size_t, int *, uint64_t, const char *, char *, size_t, off_t);
+int __myfs_write_fh_implem(void *, size_t, int *, uint64_t, const char *, const char *, size_t, off_t);
+void __myfs_release_fh_implem(uint64_t);
+int __myfs_statfs_implem(void *, size_t, int *, struct statvfs*);
+int __myfs_utimens_implem(void *, size_t, int *, const char *, const struct timespec [2]);
+int __myfs_mount_implem(void *, size_t, int *, size_t, size_t);
+size_t __myfs_min_size_implem(size_t, size_t);
+size_t __myfs_grow_size_implem(void *, size_t, int *);
+int __myfs_grow_due_implem(void *, size_t, int *);
+int __myfs_grow_implem(void *, size_t, int *);
+int __myfs_journal_due_implem(void *, size_t, int *);
+int __myfs_commit_implem(void *, size_t, int *);
+int __myfs_checkpoint_implem(void *, size_t, int *);
+int __myfs_fsync_implem(void *, size_t, int *, const char *, int);
+int __myfs_writeback_implem(void *, size_t, int *, size_t *, size_t);
+int __myfs_writeback_due_implem(void *, size_t, int *, size_t);
+int __myfs_fragmentation_implem(void *, size_t, int *, const char *, size_t *, size_t *);
+
+/* End of declarations */
+
 static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, struct __myfs_options_struct_t *opts) {
-  int size_specified, using_backup;
-  size_t size;
+  int size_specified, using_backup, __myfs_errno;
+  size_t size, max_size, min_size, page;
   int fd;
   void *memory;
   off_t off;
   size_t len;
-  size_t orig_size;
 
   /* Handle size */
   if (opts->size != NULL) {
@@ -131,9 +285,47 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     size = MYFS_MIN_SIZE;
   }
 
-  /* Setup lock for the threads */
-  if (pthread_mutex_init(&(env->env_lock), NULL) != 0) {
-    perror("Cannot setup mutex");
+  /* Handle the size the filesystem may grow to */
+  max_size = MYFS_DEFAULT_MAX_SIZE;
+  if ((opts->max_size != NULL) && (!__myfs_parse_size(&max_size, opts->max_size))) {
+    fprintf(stderr, "Cannot parse maximum size indication\n");
+    return 0;
+  }
+
+  /* Handle writeback settings */
+  env->flush_interval = MYFS_DEFAULT_FLUSH_INTERVAL;
+  env->flush_bytes = MYFS_DEFAULT_FLUSH_BYTES;
+  if ((opts->flush_interval != NULL) && (!__myfs_parse_size(&(env->flush_interval), opts->flush_interval))) {
+    fprintf(stderr, "Cannot parse flush interval\n");
+    return 0;
+  }
+  if ((opts->flush_bytes != NULL) && (!__myfs_parse_size(&(env->flush_bytes), opts->flush_bytes))) {
+    fprintf(stderr, "Cannot parse flush threshold\n");
+    return 0;
+  }
+
+  /* Handle the block size, which only a new filesystem takes */
+  env->block_size = MYFS_DEFAULT_BLOCK_SIZE;
+  if ((opts->block_size != NULL) && (!__myfs_parse_size(&(env->block_size), opts->block_size))) {
+    fprintf(stderr, "Cannot parse block size\n");
+    return 0;
+  }
+  if ((env->block_size < MYFS_MIN_BLOCK_SIZE) || (env->block_size > MYFS_MAX_BLOCK_SIZE) ||
+      ((env->block_size & (env->block_size - 1)) != 0)) {
+    fprintf(stderr, "Block size must be a power of two from 1kB to 1MB\n");
+    return 0;
+  }
+
+  /* A new filesystem needs room for its metadata, so it starts out at
+     least that large, whatever size was asked for
+  */
+  min_size = __myfs_min_size_implem(max_size, env->block_size);
+  env->flusher_running = 0;
+  env->flusher_wake = 0;
+  env->flusher_stop = 0;
+
+  /* Setup locks for the threads */
+  if (!__myfs_init_locks(env)) {
     return 0;    
   }
   
@@ -143,27 +335,20 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     fd = open(opts->filename, O_CREAT | O_RDWR, 00644);
     if (fd < 0) {
       perror("Cannot open backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+      __myfs_destroy_locks(env);
       return 0;
     }
     off = lseek(fd, 0, SEEK_END);
     if (off < ((off_t) 0)) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+      __myfs_destroy_locks(env);
       return 0;
     }
     len = (size_t) off;
-    orig_size = len;
     off = lseek(fd, 0, SEEK_SET);
     if (off < ((off_t) 0)) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+      __myfs_destroy_locks(env);
       return 0;
     }
     if (size_specified) {
@@ -178,53 +363,74 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
         }
       } 
     }
+    if ((len == ((size_t) 0)) && (size < min_size)) {
+      size = min_size;
+    }
     if (ftruncate(fd, size) != 0) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+      __myfs_destroy_locks(env);
       return 0;
     }
   } else {
     using_backup = 0;
     fd = -1;
-    orig_size = 0;
+    if (size < min_size) {
+      size = min_size;
+    }
   }
 
-  /* Do the mmap */
-  if (using_backup) {
-    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (memory == MAP_FAILED) {
-      perror("Cannot map backup-file into memory");
-      if (close(fd) != 0) {
-        perror("Cannot close backup-file");
-      }
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
-      return 0;
+  /* Reserve the address space for the largest the filesystem may
+     become, and map the filesystem at its start. Growing maps more of
+     it in place, so the filesystem never moves in memory. A backup-file
+     larger than it was, because a larger size was asked for, is not
+     wiped: the filesystem grows into the extra space when mounted.
+  */
+  page = (size_t) sysconf(_SC_PAGESIZE);
+  if (max_size < size) {
+    max_size = size;
+  }
+  max_size = (max_size + page - 1) / page * page;
+  memory = mmap(NULL, max_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory == MAP_FAILED) {
+    perror("Cannot reserve memory");
+    if (using_backup && (close(fd) != 0)) {
+      perror("Cannot close backup-file");
     }
-  } else {
-    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (memory == MAP_FAILED) {
+    __myfs_destroy_locks(env);
+    return 0;
+  }
+  if (!__myfs_map_range(memory, fd, 0, size)) {
+    if (using_backup) {
+      perror("Cannot map backup-file into memory");
+    } else {
       perror("Cannot map in memory");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
-      return 0;
     }
+    if (munmap(memory, max_size) != 0) {
+      perror("Cannot unmap memory");
+    }
+    if (using_backup && (close(fd) != 0)) {
+      perror("Cannot close backup-file");
+    }
+    __myfs_destroy_locks(env);
+    return 0;
   }
 
-  /* If the original size is different from the current size, we
-     changed the filesystem and we need to wipe out the old filesystem
-     completely.
+  /* Format a fresh filesystem, or replay the journal of an existing
+     one, before FUSE starts, so that the operations holding the lock
+     shared never have to, and so that a filesystem that cannot be
+     mounted stops right here.
   */
-  if (using_backup) {
-    if (orig_size != size) {
-      if (orig_size != ((size_t) 0)) {
-        memset(memory, 0, orig_size);
-      }
+  __myfs_errno = 0;
+  if (__myfs_mount_implem(memory, size, &__myfs_errno, max_size, env->block_size) < 0) {
+    fprintf(stderr, "Cannot mount filesystem: %s\n", strerror(__myfs_errno));
+    if (munmap(memory, max_size) != 0) {
+      perror("Cannot unmap memory");
+    }
+    if (using_backup && (close(fd) != 0)) {
+      perror("Cannot close backup-file");
     }
+    __myfs_destroy_locks(env);
+    return 0;
   }
   
   /* Get uid and gid, write back and succeed */
@@ -232,6 +438,7 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
   env->gid = getgid();
   env->memory = memory;
   env->size = size;
+  env->max_size = max_size;
   env->using_backup = using_backup;
   env->backup_fd = fd;
   return 1;
@@ -243,7 +450,7 @@ static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
       perror("Cannot synchronize memory map with backup-file");
     }
   }
-  if (munmap(env->memory, env->size) != 0) {
+  if (munmap(env->memory, env->max_size) != 0) {
     perror("Cannot unmap memory");
   }
   if (env->using_backup) {
@@ -251,38 +458,222 @@ static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
       perror("Cannot close backup-file");
     }
   }
-  if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-    perror("Cannot destroy mutex");
+  __myfs_destroy_locks(env);
+}
+
+/* FUSE operations part
+
+   FUSE runs its loop multithreaded unless -s is given. Operations that
+   only read the filesystem (readdir, open, read, statfs, getxattr and
+   fsync)
+   take env_lock shared and run in parallel; all others take it
+   exclusive, except for write.
+
+   write only changes the data and the extents of one file, and blocks
+   are allocated without a lock, so write takes env_lock shared too.
+   It then takes the file's own lock exclusive, and read takes it
+   shared. Writes to different files thus proceed in parallel.
+
+   getattr first runs without any lock. The implementation checks a
+   sequence counter that every change to the metadata bumps, and
+   retries when one overlapped. Only if it keeps failing with EAGAIN
+   is getattr run again under the shared lock.
+
+   open puts a handle for the file into fi->fh, which read and write
+   use to skip the path lookup, and release frees it. release needs no
+   lock, as nothing else can use the handle by then.
+
+   Changes to the metadata are committed to the journal in batches.
+   Every operation that changes the filesystem checks afterwards
+   whether enough changes piled up, and if so commits them under the
+   exclusive lock. fsync commits right away.
+
+   With a backup-file, a flusher thread writes changed file data back
+   in the background, every few seconds or once enough piled up, and
+   then commits the journal, so that a crash loses only the last few
+   seconds. It holds no env_lock while writing data back: that needs
+   just writeback_lock, which fsync takes as well, and which is only
+   held for one chunk at a time.
+
+   The filesystem starts small and grows as it fills up. Operations
+   that may take space check afterwards whether free blocks are running
+   low, and if so grow the filesystem under the exclusive lock. One
+   that runs out of space anyway grows it and tries again.
+*/
+
+/* Commits the journal if enough changes piled up since the last
+   commit. Called without env_lock held.
+*/
+static void __myfs_commit_if_due(struct __myfs_environment_struct_t *env) {
+  int __myfs_errno;
+
+  if (!__myfs_journal_due_implem(env->memory, __atomic_load_n(&(env->size), __ATOMIC_RELAXED), &__myfs_errno)) return;
+  pthread_rwlock_wrlock(&(env->env_lock));
+  if (__myfs_journal_due_implem(env->memory, env->size, &__myfs_errno)) {
+    __myfs_commit_implem(env->memory, env->size, &__myfs_errno);
   }
+  pthread_rwlock_unlock(&(env->env_lock));
 }
 
-static int __myfs_sync_environment(struct __myfs_environment_struct_t *env) {
-  if (env == NULL) return -1;
-  if (!(env->using_backup)) return 0;
-  if (msync(env->memory, env->size, MS_SYNC) != 0) return -1;
-  if (fsync(env->backup_fd) != 0) return -1;
-  return 0;
+/* Grows the filesystem, to twice its size unless max_size or the
+   filesystem itself does not allow for that: the backup-file is
+   extended and mapped into the reserved range right after the part
+   mapped already. getattr and the flusher go on without env_lock, but
+   as the filesystem stays where it is in memory, they never see it
+   move. The flusher reads size, though, and the state of the journal,
+   which moves when the filesystem grows past what its FAT has room
+   for, so writeback_lock is taken as well. Called without env_lock
+   held.
+
+   seen is the size the caller ran into a full filesystem with, or
+   found it running low at. Others may have grown it since, while the
+   caller waited for the lock: then there is room to try again, and it
+   does not grow once more. If only_if_due is set, the filesystem only
+   grows if it still runs low on free blocks. Returns 1 if the
+   filesystem grew, by this call or since seen, and 0 if it did not.
+*/
+static int __myfs_grow(struct __myfs_environment_struct_t *env, size_t seen, int only_if_due) {
+  size_t new_size, page, mapped;
+  int __myfs_errno, res;
+
+  res = 0;
+  page = (size_t) sysconf(_SC_PAGESIZE);
+  pthread_rwlock_wrlock(&(env->env_lock));
+  if (env->size != seen) {
+    pthread_rwlock_unlock(&(env->env_lock));
+    return 1;
+  }
+  if (only_if_due && !__myfs_grow_due_implem(env->memory, env->size, &__myfs_errno)) {
+    pthread_rwlock_unlock(&(env->env_lock));
+    return 0;
+  }
+  pthread_mutex_lock(&(env->writeback_lock));
+  new_size = __myfs_grow_size_implem(env->memory, env->size, &__myfs_errno);
+  new_size = (new_size + page - 1) / page * page;
+  if (new_size > env->max_size) {
+    new_size = env->max_size;
+  }
+  if (new_size > env->size) {
+    mapped = (env->size + page - 1) / page * page;
+    if (env->using_backup && (ftruncate(env->backup_fd, (off_t) new_size) != 0)) {
+      perror("Cannot grow backup-file");
+    } else if ((new_size > mapped) &&
+               (!__myfs_map_range(env->memory, env->backup_fd, mapped, new_size - mapped))) {
+      perror("Cannot map grown filesystem into memory");
+    } else if (__myfs_grow_implem(env->memory, new_size, &__myfs_errno) < 0) {
+      fprintf(stderr, "Cannot grow filesystem: %s\n", strerror(__myfs_errno));
+    } else {
+      __atomic_store_n(&(env->size), new_size, __ATOMIC_RELAXED);
+      res = 1;
+    }
+  }
+  pthread_mutex_unlock(&(env->writeback_lock));
+  pthread_rwlock_unlock(&(env->env_lock));
+  return res;
 }
 
-/* Declaration for the implementations of the operations */
+/* Grows the filesystem ahead of time once it runs low on free blocks,
+   so that writes seldom run into a full filesystem. Called without
+   env_lock held.
+*/
+static void __myfs_grow_if_due(struct __myfs_environment_struct_t *env) {
+  size_t seen;
+  int __myfs_errno;
 
-int __myfs_getattr_implem(void *, size_t, int *, uid_t, gid_t, const char *, struct stat *);
-int __myfs_readdir_implem(void *, size_t, int *, const char *, char ***);
-int __myfs_mknod_implem(void *, size_t, int *, const char *);
-int __myfs_unlink_implem(void *, size_t, int *, const char *);
-int __myfs_mkdir_implem(void *, size_t, int *, const char *);
-int __myfs_rmdir_implem(void *, size_t, int *, const char *);
-int __myfs_rename_implem(void *, size_t, int *, const char *, const char*);
-int __myfs_truncate_implem(void *, size_t, int *, const char *, off_t);
-int __myfs_open_implem(void *, size_t, int *, const char *);
-int __myfs_read_implem(void *, size_t, int *, const char *, char *, size_t, off_t);
-int __myfs_write_implem(void *, size_t, int *, const char *, const char *, size_t, off_t);
-int __myfs_statfs_implem(void *, size_t, int *, struct statvfs*);
-int __myfs_utimens_implem(void *, size_t, int *, const char *, const struct timespec [2]);
+  seen = __atomic_load_n(&(env->size), __ATOMIC_RELAXED);
+  if (!__myfs_grow_due_implem(env->memory, seen, &__myfs_errno)) return;
+  __myfs_grow(env, seen, 1);
+}
 
-/* End of declarations */
+/* Wakes the flusher up early if more than flush_bytes bytes of data
+   wait to be written back. Called without env_lock held.
+*/
+static void __myfs_flush_if_due(struct __myfs_environment_struct_t *env) {
+  int __myfs_errno;
+
+  if ((!env->flusher_running) || (env->flush_bytes == 0)) return;
+  if (!__myfs_writeback_due_implem(env->memory, __atomic_load_n(&(env->size), __ATOMIC_RELAXED), &__myfs_errno, env->flush_bytes)) return;
+  pthread_mutex_lock(&(env->flusher_lock));
+  env->flusher_wake = 1;
+  pthread_cond_signal(&(env->flusher_cond));
+  pthread_mutex_unlock(&(env->flusher_lock));
+}
+
+/* One round of the flusher: writes back the data that changed, a
+   chunk at a time and without env_lock, then commits the journal, so
+   that the metadata pointing at the data is on the disk too.
+*/
+static void __myfs_flush_round(struct __myfs_environment_struct_t *env) {
+  size_t cursor = 0;
+  int __myfs_errno, res;
+
+  do {
+    pthread_mutex_lock(&(env->writeback_lock));
+    res = __myfs_writeback_implem(env->memory,
+                                  env->size,
+                                  &__myfs_errno,
+                                  &cursor,
+                                  MYFS_FLUSH_CHUNK);
+    pthread_mutex_unlock(&(env->writeback_lock));
+  } while ((res >= 0) && (cursor != 0) && (!__atomic_load_n(&(env->flusher_stop), __ATOMIC_RELAXED)));
+  if (res < 0) {
+    fprintf(stderr, "Cannot write back data: %s\n", strerror(__myfs_errno));
+    return;
+  }
+  pthread_rwlock_wrlock(&(env->env_lock));
+  res = __myfs_commit_implem(env->memory,
+                             env->size,
+                             &__myfs_errno);
+  pthread_rwlock_unlock(&(env->env_lock));
+  if (res < 0) {
+    fprintf(stderr, "Cannot commit journal: %s\n", strerror(__myfs_errno));
+  }
+}
+
+static void *__myfs_flusher(void *arg) {
+  struct __myfs_environment_struct_t *env;
+  struct timespec deadline;
+
+  env = (struct __myfs_environment_struct_t *) arg;
+  pthread_mutex_lock(&(env->flusher_lock));
+  while (!env->flusher_stop) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += env->flush_interval;
+    while ((!env->flusher_stop) && (!env->flusher_wake)) {
+      if (env->flush_interval == 0) {
+        pthread_cond_wait(&(env->flusher_cond), &(env->flusher_lock));
+      } else if (pthread_cond_timedwait(&(env->flusher_cond), &(env->flusher_lock), &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+    env->flusher_wake = 0;
+    if (env->flusher_stop) break;
+    pthread_mutex_unlock(&(env->flusher_lock));
+    __myfs_flush_round(env);
+    pthread_mutex_lock(&(env->flusher_lock));
+  }
+  pthread_mutex_unlock(&(env->flusher_lock));
+  return NULL;
+}
 
-/* FUSE operations part */
+static void __myfs_start_flusher(struct __myfs_environment_struct_t *env) {
+  if ((!env->using_backup) || ((env->flush_interval == 0) && (env->flush_bytes == 0))) return;
+  if (pthread_create(&(env->flusher), NULL, __myfs_flusher, env) != 0) {
+    perror("Cannot start flusher thread");
+    return;
+  }
+  env->flusher_running = 1;
+}
+
+static void __myfs_stop_flusher(struct __myfs_environment_struct_t *env) {
+  if (!env->flusher_running) return;
+  pthread_mutex_lock(&(env->flusher_lock));
+  __atomic_store_n(&(env->flusher_stop), 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&(env->flusher_cond));
+  pthread_mutex_unlock(&(env->flusher_lock));
+  pthread_join(env->flusher, NULL);
+  env->flusher_running = 0;
+}
 
 static int __myfs_getattr(const char *path, struct stat *st) {
   struct fuse_context *context;
@@ -294,16 +685,27 @@ static int __myfs_getattr(const char *path, struct stat *st) {
 
   memset(st, 0, sizeof(struct stat));
   
+  /* First try without the lock, see below */
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_getattr_implem(env->memory,
-                              env->size,
+                              __atomic_load_n(&(env->size), __ATOMIC_RELAXED),
                               &__myfs_errno,
                               env->uid,
                               env->gid,
                               path,
                               st);
-  pthread_mutex_unlock(&(env->env_lock));  
+  if ((res < 0) && (__myfs_errno == EAGAIN)) {
+    __myfs_errno = ENOENT;
+    pthread_rwlock_rdlock(&(env->env_lock));
+    res = __myfs_getattr_implem(env->memory,
+                                env->size,
+                                &__myfs_errno,
+                                env->uid,
+                                env->gid,
+                                path,
+                                st);
+    pthread_rwlock_unlock(&(env->env_lock));
+  }
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -324,13 +726,13 @@ static int __myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
   names = NULL;
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  pthread_rwlock_rdlock(&(env->env_lock));
   res = __myfs_readdir_implem(env->memory,
                               env->size,
                               &__myfs_errno,
                               path,
                               &names);
-  pthread_mutex_unlock(&(env->env_lock));
+  pthread_rwlock_unlock(&(env->env_lock));
   if (res >= 0) {
     if (res == 0) {
       filler(buf, ".", NULL, 0);
@@ -358,6 +760,7 @@ static int __myfs_mknod(const char* path, mode_t mode, dev_t dev) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  size_t seen;
 
   (void) dev;
 
@@ -366,13 +769,18 @@ static int __myfs_mknod(const char* path, mode_t mode, dev_t dev) {
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_mknod_implem(env->memory,
-                            env->size,
-                            &__myfs_errno,
-                            path);
-  pthread_mutex_unlock(&(env->env_lock));
+  do {
+    __myfs_errno = ENOENT;
+    pthread_rwlock_wrlock(&(env->env_lock));
+    res = __myfs_mknod_implem(env->memory,
+                              env->size,
+                              &__myfs_errno,
+                              path);
+    seen = env->size;
+    pthread_rwlock_unlock(&(env->env_lock));
+  } while ((res < 0) && (__myfs_errno == ENOSPC) && __myfs_grow(env, seen, 0));
+  __myfs_grow_if_due(env);
+  __myfs_commit_if_due(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -387,12 +795,13 @@ static int __myfs_unlink(const char* path) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  pthread_rwlock_wrlock(&(env->env_lock));
   res = __myfs_unlink_implem(env->memory,
                              env->size,
                              &__myfs_errno,
                              path);
-  pthread_mutex_unlock(&(env->env_lock));
+  pthread_rwlock_unlock(&(env->env_lock));
+  __myfs_commit_if_due(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -402,17 +811,23 @@ static int __myfs_mkdir(const char* path, mode_t mode) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  size_t seen;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_mkdir_implem(env->memory,
-                            env->size,
-                            &__myfs_errno,
-                            path);
-  pthread_mutex_unlock(&(env->env_lock));
+  do {
+    __myfs_errno = ENOENT;
+    pthread_rwlock_wrlock(&(env->env_lock));
+    res = __myfs_mkdir_implem(env->memory,
+                              env->size,
+                              &__myfs_errno,
+                              path);
+    seen = env->size;
+    pthread_rwlock_unlock(&(env->env_lock));
+  } while ((res < 0) && (__myfs_errno == ENOSPC) && __myfs_grow(env, seen, 0));
+  __myfs_grow_if_due(env);
+  __myfs_commit_if_due(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -427,12 +842,13 @@ static int __myfs_rmdir(const char* path) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  pthread_rwlock_wrlock(&(env->env_lock));
   res = __myfs_rmdir_implem(env->memory,
                             env->size,
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
+  pthread_rwlock_unlock(&(env->env_lock));
+  __myfs_commit_if_due(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -442,18 +858,24 @@ static int __myfs_rename(const char* from, const char* to) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  size_t seen;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_rename_implem(env->memory,
-                             env->size,
-                             &__myfs_errno,
-                             from,
-                             to);
-  pthread_mutex_unlock(&(env->env_lock));
+  do {
+    __myfs_errno = ENOENT;
+    pthread_rwlock_wrlock(&(env->env_lock));
+    res = __myfs_rename_implem(env->memory,
+                               env->size,
+                               &__myfs_errno,
+                               from,
+                               to);
+    seen = env->size;
+    pthread_rwlock_unlock(&(env->env_lock));
+  } while ((res < 0) && (__myfs_errno == ENOSPC) && __myfs_grow(env, seen, 0));
+  __myfs_grow_if_due(env);
+  __myfs_commit_if_due(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -463,18 +885,24 @@ static int __myfs_truncate(const char* path, off_t size) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  size_t seen;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_truncate_implem(env->memory,
-                               env->size,
-                               &__myfs_errno,
-                               path,
-                               size);
-  pthread_mutex_unlock(&(env->env_lock));
+  do {
+    __myfs_errno = ENOENT;
+    pthread_rwlock_wrlock(&(env->env_lock));
+    res = __myfs_truncate_implem(env->memory,
+                                 env->size,
+                                 &__myfs_errno,
+                                 path,
+                                 size);
+    seen = env->size;
+    pthread_rwlock_unlock(&(env->env_lock));
+  } while ((res < 0) && (__myfs_errno == ENOSPC) && __myfs_grow(env, seen, 0));
+  __myfs_grow_if_due(env);
+  __myfs_commit_if_due(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -494,12 +922,13 @@ static int __myfs_open(const char* path, struct fuse_file_info* fi) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_open_implem(env->memory,
-                           env->size,
-                           &__myfs_errno,
-                           path);
-  pthread_mutex_unlock(&(env->env_lock));
+  pthread_rwlock_rdlock(&(env->env_lock));
+  res = __myfs_open_fh_implem(env->memory,
+                              env->size,
+                              &__myfs_errno,
+                              path,
+                              &(fi->fh));
+  pthread_rwlock_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -508,23 +937,26 @@ static int __myfs_open(const char* path, struct fuse_file_info* fi) {
 static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  pthread_rwlock_t *file_lock;
   int __myfs_errno, res;
 
-  (void) fi;
-  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_read_implem(env->memory,
-                           env->size,
-                           &__myfs_errno,
-                           path,
-                           buf,
-                           size,
-                           offset);
-  pthread_mutex_unlock(&(env->env_lock));
+  pthread_rwlock_rdlock(&(env->env_lock));
+  file_lock = __myfs_file_lock(env, path);
+  pthread_rwlock_rdlock(file_lock);
+  res = __myfs_read_fh_implem(env->memory,
+                              env->size,
+                              &__myfs_errno,
+                              fi->fh,
+                              path,
+                              buf,
+                              size,
+                              offset);
+  pthread_rwlock_unlock(file_lock);
+  pthread_rwlock_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -533,23 +965,40 @@ static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, s
 static int __myfs_write(const char* path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  pthread_rwlock_t *file_lock;
   int __myfs_errno, res;
+  size_t done, seen;
 
-  (void) fi;
-  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_write_implem(env->memory,
-                            env->size,
-                            &__myfs_errno,
-                            path,
-                            buf,
-                            size,
-                            offset);
-  pthread_mutex_unlock(&(env->env_lock));
+  /* A write that runs out of space, whether it wrote part of the data
+     or none, goes on with the rest once the filesystem grew.
+  */
+  done = 0;
+  do {
+    __myfs_errno = ENOENT;
+    pthread_rwlock_rdlock(&(env->env_lock));
+    file_lock = __myfs_file_lock(env, path);
+    pthread_rwlock_wrlock(file_lock);
+    res = __myfs_write_fh_implem(env->memory,
+                                 env->size,
+                                 &__myfs_errno,
+                                 fi->fh,
+                                 path,
+                                 buf + done,
+                                 size - done,
+                                 offset + done);
+    pthread_rwlock_unlock(file_lock);
+    seen = env->size;
+    pthread_rwlock_unlock(&(env->env_lock));
+    if (res > 0) done += res;
+  } while ((done < size) && ((res > 0) || (__myfs_errno == ENOSPC)) && __myfs_grow(env, seen, 0));
+  __myfs_grow_if_due(env);
+  __myfs_commit_if_due(env);
+  __myfs_flush_if_due(env);
+  if (done > 0)
+    return done;
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -568,12 +1017,12 @@ static int __myfs_statfs(const char* path, struct statvfs* stbuf) {
   memset(stbuf, 0, sizeof(struct statvfs));
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  pthread_rwlock_rdlock(&(env->env_lock));
   res = __myfs_statfs_implem(env->memory,
                              env->size,
                              &__myfs_errno,
                              stbuf);
-  pthread_mutex_unlock(&(env->env_lock));
+  pthread_rwlock_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -588,13 +1037,14 @@ static int __myfs_utimens(const char* path, const struct timespec ts[2]) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  pthread_rwlock_wrlock(&(env->env_lock));
   res = __myfs_utimens_implem(env->memory,
                               env->size,
                               &__myfs_errno,
                               path,
                               ts);
-  pthread_mutex_unlock(&(env->env_lock));
+  pthread_rwlock_unlock(&(env->env_lock));
+  __myfs_commit_if_due(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -603,29 +1053,140 @@ static int __myfs_utimens(const char* path, const struct timespec ts[2]) {
 static int __myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  pthread_rwlock_t *file_lock;
   int __myfs_errno, res;
   
-  (void) path;
-  (void) datasync;
   (void) fi;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
+  /* The data goes to the disk first, so that the metadata committed
+     after it never points at data that is not there yet. Only the
+     ranges that changed are written, with a ranged msync each, so
+     neither the whole mapping nor the whole backup file is flushed.
+  */
   __myfs_errno = EIO;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_sync_environment(env);
-  pthread_mutex_unlock(&(env->env_lock));
+  pthread_rwlock_rdlock(&(env->env_lock));
+  file_lock = __myfs_file_lock(env, path);
+  pthread_rwlock_rdlock(file_lock);
+  pthread_mutex_lock(&(env->writeback_lock));
+  res = __myfs_fsync_implem(env->memory,
+                            env->size,
+                            &__myfs_errno,
+                            path,
+                            datasync);
+  pthread_mutex_unlock(&(env->writeback_lock));
+  pthread_rwlock_unlock(file_lock);
+  pthread_rwlock_unlock(&(env->env_lock));
+  if (res < 0)
+    return -__myfs_errno;
+  pthread_rwlock_wrlock(&(env->env_lock));
+  res = __myfs_commit_implem(env->memory,
+                             env->size,
+                             &__myfs_errno);
+  pthread_rwlock_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;  
 }
 
+static int __myfs_release(const char *path, struct fuse_file_info *fi) {
+  (void) path;
+
+  /* Called once the last descriptor for an open file is closed, so
+     unlike flush, which runs on every close, it can free the handle.
+  */
+  __myfs_release_fh_implem(fi->fh);
+  fi->fh = 0;
+  return 0;
+}
+
+/* The fragmentation of a file is reported as the extended attribute
+   MYFS_XATTR_FRAG, which reads as "<blocks> blocks in <runs> runs".
+*/
+#define MYFS_XATTR_FRAG "user.myfs.fragmentation"
+
+static int __myfs_getxattr(const char *path, const char *name, char *value, size_t size) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  pthread_rwlock_t *file_lock;
+  int __myfs_errno, res, len;
+  size_t blocks, runs;
+  char text[64];
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  if (strcmp(name, MYFS_XATTR_FRAG) != 0) return -ENODATA;
+  __myfs_errno = ENOENT;
+  pthread_rwlock_rdlock(&(env->env_lock));
+  file_lock = __myfs_file_lock(env, path);
+  pthread_rwlock_rdlock(file_lock);
+  res = __myfs_fragmentation_implem(env->memory,
+                                    env->size,
+                                    &__myfs_errno,
+                                    path,
+                                    &blocks,
+                                    &runs);
+  pthread_rwlock_unlock(file_lock);
+  pthread_rwlock_unlock(&(env->env_lock));
+  if (res < 0)
+    return -__myfs_errno;
+  len = snprintf(text, sizeof(text), "%zu blocks in %zu runs", blocks, runs);
+  if (size == 0)
+    return len;
+  if ((size_t) len > size)
+    return -ERANGE;
+  memcpy(value, text, len);
+  return len;
+}
+
+static int __myfs_listxattr(const char *path, char *list, size_t size) {
+  (void) path;
+
+  if (size == 0)
+    return sizeof(MYFS_XATTR_FRAG);
+  if (size < sizeof(MYFS_XATTR_FRAG))
+    return -ERANGE;
+  memcpy(list, MYFS_XATTR_FRAG, sizeof(MYFS_XATTR_FRAG));
+  return sizeof(MYFS_XATTR_FRAG);
+}
+
+static void *__myfs_init(struct fuse_conn_info *conn) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+
+  (void) conn;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  /* The filesystem was mounted when the environment was set up; the
+     flusher thread has to wait for FUSE, which may fork first.
+  */
+  if (env != NULL) {
+    __myfs_start_flusher(env);
+  }
+  return env;
+}
+
 static void __myfs_destroy(void *private_data) {
   struct __myfs_environment_struct_t *env;
+  int __myfs_errno;
   
   if (private_data == NULL) return;
   env = (struct __myfs_environment_struct_t *) private_data;
+  __myfs_stop_flusher(env);
+  /* Leave nothing in the journal, so that the next mount has
+     nothing to replay.
+  */
+  __myfs_errno = 0;
+  pthread_rwlock_wrlock(&(env->env_lock));
+  __myfs_checkpoint_implem(env->memory,
+                           env->size,
+                           &__myfs_errno);
+  pthread_rwlock_unlock(&(env->env_lock));
   __myfs_clear_environment(env);
 }
 
@@ -644,6 +1205,10 @@ static struct fuse_operations __myfs_operations = {
   .statfs = __myfs_statfs,
   .utimens = __myfs_utimens,
   .fsync = __myfs_fsync,
+  .release = __myfs_release,
+  .getxattr = __myfs_getxattr,
+  .listxattr = __myfs_listxattr,
+  .init = __myfs_init,
   .destroy = __myfs_destroy
 };
 
@@ -654,14 +1219,29 @@ static void __myfs_show_help(const char *name) {
         printf("File-system specific options:\n"
                "    --backupfile=<s>        File to read file-system content from and save to\n"
                "                            Default: none, all changes are lost\n"
-               "    --size=<s>              Size of the file system\n"
-               "                            Default: 128MB if no backup-file is given.\n"
+               "    --size=<s>              Size of the file system to start with\n"
+               "                            Default: 4MB if no backup-file is given.\n"
                "                                     Size of the backup-file otherwise.\n"
                "                            If both a backup-file and a size are specified,\n"
                "                            the actual size is the maximum of the size of the\n"
                "                            backup-file and the size specified.\n"
-               "                            The minimum size of a filesystem is 2kB. If a\n"
-               "                            lesser size is used, it is increased to 2kB.\n"
+               "                            A new file system takes at least the room of\n"
+               "                            its metadata and a few blocks, about 25kB with\n"
+               "                            4kB blocks. If a lesser size is used, it is\n"
+               "                            increased to that.\n"
+               "    --maxsize=<s>           Size the file system may grow to as it fills\n"
+               "                            up.\n"
+               "                            Default: 16GB\n"
+               "    --flushinterval=<s>     Seconds between writebacks of changed data\n"
+               "                            to the backup-file, 0 for none.\n"
+               "                            Default: 5\n"
+               "    --flushbytes=<s>        Write changed data back early once this many\n"
+               "                            bytes piled up, 0 to never do so.\n"
+               "                            Default: 32MB\n"
+               "    --blocksize=<s>         Size of a block of a new file system, a power\n"
+               "                            of two from 1kB to 1MB. An existing file\n"
+               "                            system keeps the block size it was made with.\n"
+               "                            Default: 4kB\n"
                "\n");
 }
 
@@ -674,6 +1254,10 @@ int main(int argc, char *argv[]) {
   /* Initialize defaults */
   __myfs_options.filename = NULL;
   __myfs_options.size = NULL;
+  __myfs_options.max_size = NULL;
+  __myfs_options.flush_interval = NULL;
+  __myfs_options.flush_bytes = NULL;
+  __myfs_options.block_size = NULL;
   __myfs_options.show_help = 0;
         
   /* Parse options */